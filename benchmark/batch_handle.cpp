@@ -0,0 +1,89 @@
+// Dispatch a pre-decoded batch of socket events three ways: through the
+// single threaded queue, as a loop of individual handle calls and with
+// handle_batch. Reports the cost per event.
+// Usage: batch_handle [events]
+#include "contexts.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace tsm::detail;
+using SocketHsm = make_hsm_t<bench::SocketContext>;
+using SocketEvent = tuple_to_variant_t<get_events_t<SocketHsm>>;
+using QueuedSocketHsm =
+  SingleThreadedExecutionPolicy<bench::SocketContext, make_hsm_t>;
+
+template<typename F>
+void
+report(char const* name, std::size_t events, std::size_t handled, F&& run) {
+    auto begin = std::chrono::steady_clock::now();
+    std::size_t got = run();
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::nano> elapsed = end - begin;
+    std::printf("%-14s %6.2f ns/event (%zu handled)\n",
+                name,
+                elapsed.count() / events,
+                got);
+    if (got != handled) {
+        std::printf("  expected %zu handled events\n", handled);
+    }
+}
+
+int
+main(int argc, char** argv) {
+    std::size_t events =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+
+    // Open, Bind, Listen, 60 x Accept, Close: one 64-event batch
+    using S = bench::SocketContext;
+    std::vector<SocketEvent> batch{ S::Open{}, S::Bind{}, S::Listen{} };
+    batch.resize(63, S::Accept{});
+    batch.push_back(S::Close{});
+    std::size_t batches = events / batch.size();
+    events = batches * batch.size();
+    std::printf("%zu events in %zu-event batches\n", events, batch.size());
+
+    report("queue + step", events, events, [&] {
+        QueuedSocketHsm hsm;
+        std::size_t handled = 0;
+        // the queue holds fewer than 64 events, so feed it half a batch at
+        // a time
+        std::size_t const half = batch.size() / 2;
+        for (std::size_t b = 0; b < batches; ++b) {
+            for (std::size_t first = 0; first < batch.size(); first += half) {
+                for (std::size_t i = first; i < first + half; ++i) {
+                    hsm.send_event(SocketEvent(batch[i]));
+                }
+                for (std::size_t i = 0; i < half; ++i) {
+                    handled += hsm.step();
+                }
+            }
+        }
+        return handled;
+    });
+
+    report("handle loop", events, events, [&] {
+        SocketHsm hsm;
+        std::size_t handled = 0;
+        for (std::size_t b = 0; b < batches; ++b) {
+            for (auto& e : batch) {
+                handled += std::visit(
+                  [&hsm](auto& event) { return hsm.handle(event); }, e);
+            }
+        }
+        return handled;
+    });
+
+    report("handle_batch", events, events, [&] {
+        SocketHsm hsm;
+        std::size_t handled = 0;
+        for (std::size_t b = 0; b < batches; ++b) {
+            handled +=
+              handle_batch(hsm, std::span(batch)).handled.count();
+        }
+        return handled;
+    });
+    return 0;
+}
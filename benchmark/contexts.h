@@ -0,0 +1,103 @@
+#pragma once
+#include "tsm.h"
+
+#include <cstdint>
+
+// Workloads shared by the benchmarks
+namespace bench {
+using tsm::detail::ClockedTransition;
+using tsm::detail::ClockTickEvent;
+using tsm::detail::Transition;
+
+// Traffic light driven by clock ticks
+struct LightContext {
+    struct G1 {
+        bool handle(LightContext&, ClockTickEvent& t) {
+            if (t.ticks_ >= 30) {
+                t.ticks_ = 0;
+                return true;
+            }
+            return false;
+        }
+    };
+
+    struct Y1 {
+        bool handle(LightContext&, ClockTickEvent& t) {
+            if (t.ticks_ >= 5) {
+                t.ticks_ = 0;
+                return true;
+            }
+            return false;
+        }
+        void entry(LightContext& l) { l.walk_pressed_ = false; }
+    };
+
+    struct G2 {
+        bool handle(LightContext& l, ClockTickEvent& t) {
+            if (t.ticks_ >= 60 || (l.walk_pressed_ && t.ticks_ >= 30)) {
+                t.ticks_ = 0;
+                return true;
+            }
+            return false;
+        }
+    };
+
+    struct Y2 {
+        bool handle(LightContext&, ClockTickEvent& t) {
+            if (t.ticks_ >= 5) {
+                t.ticks_ = 0;
+                return true;
+            }
+            return false;
+        }
+    };
+
+    bool walk_pressed_{};
+
+    using transitions = std::tuple<ClockedTransition<G1, Y1>,
+                                   ClockedTransition<Y1, G2>,
+                                   ClockedTransition<G2, Y2>,
+                                   ClockedTransition<Y2, G1>>;
+};
+
+// Who sent an event and its place in that sender's stream, so a consumer can
+// spot events that went missing or arrived out of order
+struct Sequenced {
+    std::uint32_t producer{};
+    std::uint32_t sequence{};
+};
+
+// TCP socket life cycle
+struct SocketContext {
+    struct Open : Sequenced {};
+    struct Bind : Sequenced {};
+    struct Listen : Sequenced {};
+    struct Connect : Sequenced {};
+    struct Accept : Sequenced {};
+    struct Close : Sequenced {};
+
+    struct Closed {};
+    struct Ready {};
+    struct Bound {};
+    struct Connected {};
+    struct Listening {
+        void entry(SocketContext& s) { s.listens_++; }
+    };
+
+    void on_accept() { accepted_++; }
+
+    using transitions =
+      std::tuple<Transition<Closed, Open, Ready>,
+                 Transition<Ready, Bind, Bound>,
+                 Transition<Bound, Listen, Listening>,
+                 Transition<Ready, Connect, Connected>,
+                 Transition<Listening, Accept, Listening,
+                            &SocketContext::on_accept>,
+                 Transition<Connected, Close, Closed>,
+                 Transition<Bound, Close, Closed>,
+                 Transition<Listening, Close, Closed>>;
+
+    std::uint32_t listens_{};
+    std::uint32_t accepted_{};
+};
+} // namespace bench
@@ -0,0 +1,68 @@
+// Record a synthetic socket workload into a journal, then replay it as fast
+// as possible.
+// Usage: journal_replay [events] [path]
+#include "contexts.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+using namespace tsm::detail;
+using SocketHsm = make_hsm_t<bench::SocketContext>;
+using SocketEvent = tuple_to_variant_t<get_events_t<SocketHsm>>;
+
+int
+main(int argc, char** argv) {
+    std::size_t events =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/tsm_journal.bin";
+
+    {
+        using S = bench::SocketContext;
+        EventRecorder<SocketEvent, 1 << 16> recorder;
+        if (!recorder.open(path.c_str())) {
+            std::perror("open");
+            return 1;
+        }
+        // Open, Bind, Listen, 13 x Accept, Close
+        std::size_t recorded = 0;
+        while (recorded < events) {
+            std::size_t step = recorded % 17;
+            SocketEvent e = step == 0   ? SocketEvent{ S::Open{} }
+                      : step == 1 ? SocketEvent{ S::Bind{} }
+                      : step == 2 ? SocketEvent{ S::Listen{} }
+                      : step == 16
+                        ? SocketEvent{ S::Close{} }
+                        : SocketEvent{ S::Accept{} };
+            // keep the benchmark lossless: wait for the writer to catch up
+            while (recorder.pending() > (1 << 15)) {
+                std::this_thread::yield();
+            }
+            recorder.record(e);
+            ++recorded;
+        }
+        recorder.close();
+        std::printf("recorded %zu events, dropped %llu\n", recorded,
+                    static_cast<unsigned long long>(recorder.dropped()));
+    }
+
+    JournalReplayer<SocketEvent> replayer;
+    if (!replayer.open(path.c_str())) {
+        std::perror("replay");
+        return 1;
+    }
+    SocketHsm hsm;
+    auto stats = replayer.replay(hsm);
+    std::printf("replayed %llu events (%llu handled) in %.3f s: %.1f M "
+                "events/s%s\n",
+                static_cast<unsigned long long>(stats.events),
+                static_cast<unsigned long long>(stats.handled),
+                stats.seconds,
+                stats.events_per_second() / 1e6,
+                stats.complete ? "" : " (journal truncated)");
+    std::printf("accepted %u connections\n", hsm.accepted_);
+    replayer.close();
+    std::remove(path.c_str());
+    return 0;
+}
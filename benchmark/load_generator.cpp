@@ -0,0 +1,434 @@
+// Load generator for the threaded policies. Producer threads send a mix of
+// traffic-light clock ticks and socket events to a set of machine pairs, at a
+// fixed rate or flat out. Each configuration reports sustained throughput,
+// dropped events, queueing and handling latency percentiles, and events that
+// were lost or handled out of order. Every socket event carries its
+// producer's sequence number for that machine; the machine thread checks
+// them as it takes the events off its queue. An event is lost if it was
+// neither dropped at the queue nor seen by the machine, and out of order if
+// it arrived after a later one from the same producer. Clock ticks carry no
+// payload, so for them lost is queued minus handled.
+// Usage: load_generator [key=value ...]
+//   policy=threaded,realtime,concurrent  producers=1,2,4  machines=1,4
+//   events=100000 (per producer)  rate=0 (events/s per producer, 0 = flat out)
+//   mix=50 (percent socket events, the rest are clock ticks)
+#include "contexts.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace tsm::detail;
+
+namespace bench {
+// The shared workloads, with queue metrics and latency tracking turned on
+struct LoadLight : LightContext {
+    static constexpr bool queue_stats = true;
+    static constexpr bool event_latency = true;
+};
+
+struct LoadSocket : SocketContext {
+    static constexpr bool queue_stats = true;
+    static constexpr bool event_latency = true;
+};
+} // namespace bench
+
+using Socket = bench::SocketContext;
+
+template<typename Context>
+using Realtime = RealtimeExecutionPolicy<Context>;
+
+// What a socket machine's thread saw of each producer's sequence. Written by
+// that thread only; read once the machine has stopped.
+struct OrderCheck {
+    explicit OrderCheck(std::size_t producers)
+      : next(producers) {}
+
+    // one past the highest sequence number seen, per producer
+    std::vector<std::uint32_t> next;
+    std::uint64_t seen{};
+    std::uint64_t out_of_order{};
+
+    template<typename Event>
+    static void observe(void* self, Event const& event) {
+        auto& check = *static_cast<OrderCheck*>(self);
+        std::visit(
+          [&check](bench::Sequenced const& e) {
+              ++check.seen;
+              auto& next = check.next[e.producer];
+              if (e.sequence < next) {
+                  ++check.out_of_order;
+              } else {
+                  next = e.sequence + 1;
+              }
+          },
+          event);
+    }
+
+    // Hook the check into a socket machine before it starts
+    template<typename Machine>
+    void attach(Machine& machine) {
+        machine.observe_events(&observe<typename Machine::Event>, this);
+    }
+};
+
+// A light and a socket machine, each with its own thread
+template<template<typename> class Policy>
+struct Pair {
+    explicit Pair(std::size_t producers)
+      : order(producers) {
+        order.attach(socket);
+    }
+
+    Policy<bench::LoadLight> light;
+    Policy<bench::LoadSocket> socket;
+    OrderCheck order;
+
+    void start() {
+        light.start();
+        socket.start();
+    }
+
+    void stop() {
+        light.stop();
+        socket.stop();
+    }
+
+    auto const& light_machine() const { return light; }
+    auto const& socket_machine() const { return socket; }
+
+    template<typename E>
+    void send(E e) {
+        if constexpr (std::is_same_v<E, ClockTickEvent>) {
+            light.send_event(e);
+        } else {
+            socket.send_event(e);
+        }
+    }
+};
+
+// The same pair behind a ConcurrentHsm, which routes by event type
+struct Concurrent {
+    explicit Concurrent(std::size_t producers)
+      : order(producers) {
+        order.attach(std::get<1>(machines.hsms_));
+    }
+
+    tsm::ConcurrentHsm<ThreadedExecutionPolicy,
+                       bench::LoadLight,
+                       bench::LoadSocket>
+      machines;
+    OrderCheck order;
+
+    void start() {
+        std::apply([](auto&... hsm) { (hsm.start(), ...); }, machines.hsms_);
+    }
+
+    void stop() {
+        std::apply([](auto&... hsm) { (hsm.stop(), ...); }, machines.hsms_);
+    }
+
+    auto const& light_machine() const { return std::get<0>(machines.hsms_); }
+    auto const& socket_machine() const { return std::get<1>(machines.hsms_); }
+
+    template<typename E>
+    void send(E e) {
+        machines.send_event(e);
+    }
+};
+
+struct Config {
+    std::vector<std::string> policies{ "threaded", "realtime", "concurrent" };
+    std::vector<std::size_t> producers{ 1, 2, 4 };
+    std::vector<std::size_t> machines{ 1, 4 };
+    std::size_t events = 100'000;
+    double rate = 0;
+    unsigned mix = 50;
+};
+
+struct Totals {
+    std::uint64_t enqueued{};
+    std::uint64_t dropped{};
+    std::uint64_t handled{};
+    LatencyHistogram queued;
+    LatencyHistogram handling;
+};
+
+template<typename... Events, typename Machine>
+void
+collect(Machine const& machine, Totals& totals, bool histograms) {
+    auto stats = machine.queue_stats();
+    totals.enqueued += stats.enqueued;
+    totals.dropped += stats.dropped;
+    totals.handled +=
+      (std::uint64_t{} + ... +
+       machine.template handling_latency<Events>().count());
+    if (histograms) {
+        (totals.queued.merge(machine.template queued_latency<Events>()), ...);
+        (totals.handling.merge(machine.template handling_latency<Events>()),
+         ...);
+    }
+}
+
+template<typename Lane>
+void
+collect(std::vector<std::unique_ptr<Lane>> const& lanes,
+        Totals& totals,
+        bool histograms = false) {
+    for (auto const& lane : lanes) {
+        collect<ClockTickEvent>(lane->light_machine(), totals, histograms);
+        collect<Socket::Open,
+                Socket::Bind,
+                Socket::Listen,
+                Socket::Connect,
+                Socket::Accept,
+                Socket::Close>(lane->socket_machine(), totals, histograms);
+    }
+}
+
+struct ProducerResult {
+    std::uint64_t socket_sent{};
+};
+
+struct Lost {
+    std::uint64_t lost{};
+    std::uint64_t out_of_order{};
+};
+
+// What the machines' threads saw against what the producers sent. Call once
+// the lanes have stopped.
+template<typename Lane>
+Lost
+count_lost(std::vector<std::unique_ptr<Lane>> const& lanes,
+           std::vector<ProducerResult> const& results) {
+    Lost lost;
+    std::uint64_t sent = 0;
+    for (auto const& result : results) {
+        sent += result.socket_sent;
+    }
+    std::uint64_t accounted = 0;
+    for (auto const& lane : lanes) {
+        Totals light;
+        collect<ClockTickEvent>(lane->light_machine(), light, false);
+        lost.lost += light.enqueued - std::min(light.handled, light.enqueued);
+        accounted += lane->order.seen +
+                     lane->socket_machine().queue_stats().dropped;
+        lost.out_of_order += lane->order.out_of_order;
+    }
+    lost.lost += sent - std::min(sent, accounted);
+    return lost;
+}
+
+// Sends config.events events round-robin over the lanes
+template<typename Lane>
+void
+produce(std::size_t id,
+        Config const& config,
+        std::vector<std::unique_ptr<Lane>>& lanes,
+        std::atomic<bool> const& go,
+        ProducerResult& result) {
+    std::minstd_rand random(static_cast<unsigned>(id + 1));
+    // next sequence number for each lane's socket machine
+    std::vector<std::uint32_t> sequence(lanes.size());
+    std::size_t script = 0;
+
+    while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::chrono::duration<double> period(config.rate > 0 ? 1 / config.rate
+                                                         : 0);
+    for (std::size_t i = 0; i < config.events; ++i) {
+        if (config.rate > 0) {
+            std::this_thread::sleep_until(
+              begin + std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(period * i));
+        }
+        std::size_t index = (id + i) % lanes.size();
+        auto& lane = *lanes[index];
+        if (random() % 100 >= config.mix) {
+            lane.send(ClockTickEvent{});
+            continue;
+        }
+        // a socket's life: open, bind, listen, accept twice, close
+        bench::Sequenced tag{ static_cast<std::uint32_t>(id),
+                              sequence[index]++ };
+        switch (script++ % 6) {
+            case 0: lane.send(Socket::Open{ tag }); break;
+            case 1: lane.send(Socket::Bind{ tag }); break;
+            case 2: lane.send(Socket::Listen{ tag }); break;
+            case 3:
+            case 4: lane.send(Socket::Accept{ tag }); break;
+            default: lane.send(Socket::Close{ tag }); break;
+        }
+        ++result.socket_sent;
+    }
+}
+
+template<typename Lane>
+void
+run(char const* policy,
+    Config const& config,
+    std::size_t producers,
+    std::size_t machines) {
+    std::vector<std::unique_ptr<Lane>> lanes;
+    for (std::size_t i = 0; i < machines; ++i) {
+        lanes.push_back(std::make_unique<Lane>(producers));
+        lanes.back()->start();
+    }
+    if constexpr (requires { lanes[0]->light.status(); }) {
+        auto const& status = lanes[0]->light.status();
+        if (!status.ok()) {
+            auto error = status.scheduling ? status.scheduling
+                         : status.affinity ? status.affinity
+                                           : status.memory_lock;
+            std::printf("  (%s: real-time setup incomplete: %s)\n",
+                        policy,
+                        error.message().c_str());
+        }
+    }
+
+    std::atomic<bool> go{};
+    std::vector<ProducerResult> results(producers);
+    std::vector<std::thread> threads;
+    for (std::size_t id = 0; id < producers; ++id) {
+        threads.emplace_back(produce<Lane>,
+                             id,
+                             std::cref(config),
+                             std::ref(lanes),
+                             std::cref(go),
+                             std::ref(results[id]));
+    }
+    auto begin = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // wait for the machines to work off their queues
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (;;) {
+        Totals totals;
+        collect(lanes, totals);
+        if (totals.handled >= totals.enqueued ||
+            std::chrono::steady_clock::now() > deadline) {
+            break;
+        }
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+
+    Totals totals;
+    collect(lanes, totals, true);
+    for (auto& lane : lanes) {
+        lane->stop();
+    }
+
+    auto [lost, out_of_order] = count_lost(lanes, results);
+    auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1e3; };
+    std::printf("%-10s %4zu %4zu %12.0f %9llu %6llu %6llu"
+                " %9.1f %9.1f %9.1f %9.1f%s\n",
+                policy,
+                producers,
+                machines,
+                totals.handled / elapsed.count(),
+                static_cast<unsigned long long>(totals.dropped),
+                static_cast<unsigned long long>(lost),
+                static_cast<unsigned long long>(out_of_order),
+                us(totals.queued.percentile(0.5)),
+                us(totals.queued.percentile(0.99)),
+                us(totals.queued.percentile(0.999)),
+                us(totals.handling.percentile(0.99)),
+                lost != 0 || out_of_order != 0 ? "  <-- LOST/REORDERED" : "");
+}
+
+template<typename T>
+std::vector<T>
+parse_list(std::string const& value, T (*convert)(std::string const&)) {
+    std::vector<T> list;
+    std::size_t begin = 0;
+    while (begin <= value.size()) {
+        auto end = std::min(value.find(',', begin), value.size());
+        list.push_back(convert(value.substr(begin, end - begin)));
+        begin = end + 1;
+    }
+    return list;
+}
+
+int
+main(int argc, char** argv) {
+    Config config;
+    auto to_size = [](std::string const& s) -> std::size_t {
+        return std::strtoull(s.c_str(), nullptr, 10);
+    };
+    auto to_string = [](std::string const& s) { return s; };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        auto value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "policy") {
+            config.policies = parse_list<std::string>(value, +to_string);
+        } else if (key == "producers") {
+            config.producers = parse_list<std::size_t>(value, +to_size);
+        } else if (key == "machines") {
+            config.machines = parse_list<std::size_t>(value, +to_size);
+        } else if (key == "events") {
+            config.events = to_size(value);
+        } else if (key == "rate") {
+            config.rate = std::strtod(value.c_str(), nullptr);
+        } else if (key == "mix") {
+            config.mix = static_cast<unsigned>(std::min<std::size_t>(
+              to_size(value), 100));
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    char rate[32] = "unthrottled";
+    if (config.rate > 0) {
+        std::snprintf(rate, sizeof(rate), "%.0f events/s", config.rate);
+    }
+    std::printf("%u cores, %zu events per producer, %s, %u%% socket "
+                "events\n",
+                std::thread::hardware_concurrency(),
+                config.events,
+                rate,
+                config.mix);
+    std::printf("%-10s %4s %4s %12s %9s %6s %6s %9s %9s %9s %9s\n",
+                "policy", "prod", "mach", "events/s", "dropped", "lost",
+                "order", "q p50 us", "q p99 us", "q p999 us", "h p99 us");
+    for (auto const& policy : config.policies) {
+        for (auto producers : config.producers) {
+            for (auto machines : config.machines) {
+                if (producers == 0 || machines == 0) {
+                    continue;
+                }
+                if (policy == "threaded") {
+                    run<Pair<ThreadedExecutionPolicy>>(
+                      "threaded", config, producers, machines);
+                } else if (policy == "realtime") {
+                    run<Pair<Realtime>>(
+                      "realtime", config, producers, machines);
+                } else if (policy == "concurrent") {
+                    run<Concurrent>(
+                      "concurrent", config, producers, machines);
+                } else {
+                    std::fprintf(stderr, "unknown policy %s\n",
+                                 policy.c_str());
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
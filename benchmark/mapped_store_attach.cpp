@@ -0,0 +1,78 @@
+// Attach time of a MappedStore holding the state of a large fleet.
+// Usage: mapped_store_attach [machines] [path]
+#include "contexts.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace tsm::detail;
+using SocketHsm = make_hsm_t<bench::SocketContext>;
+
+namespace {
+double
+ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+}
+
+int
+main(int argc, char** argv) {
+    std::size_t machines =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/tsm_mapped_store.bin";
+
+    {
+        MappedStore<SocketHsm> store;
+        auto start = std::chrono::steady_clock::now();
+        if (!store.create(path.c_str(), machines)) {
+            std::perror("create");
+            return 1;
+        }
+        // Spread the fleet over the socket life cycle
+        SocketHsm listening;
+        listening.handle(bench::SocketContext::Open{});
+        listening.handle(bench::SocketContext::Bind{});
+        listening.handle(bench::SocketContext::Listen{});
+        for (std::size_t i = 0; i < machines; i += 2) {
+            store.save(i, listening);
+        }
+        double populate = ms_since(start);
+        start = std::chrono::steady_clock::now();
+        store.checkpoint();
+        std::printf("populate %zu machines: %.1f ms, checkpoint: %.1f ms\n",
+                    machines, populate, ms_since(start));
+    }
+
+    MappedStore<SocketHsm> store;
+    auto start = std::chrono::steady_clock::now();
+    if (!store.attach(path.c_str())) {
+        std::perror("attach");
+        return 1;
+    }
+    double attach = ms_since(start);
+
+    // Resume a slice of the fleet straight from the mapping
+    std::vector<SocketHsm> active(1024);
+    start = std::chrono::steady_clock::now();
+    std::size_t listening = 0;
+    for (std::size_t i = 0; i < active.size() && i < store.size(); ++i) {
+        store.load(i, active[i]);
+        listening +=
+          std::holds_alternative<bench::SocketContext::Listening*>(
+            active[i].current_state_);
+    }
+    double resume = ms_since(start);
+
+    std::printf("attach %zu machines (%zu bytes each): %.3f ms\n",
+                store.size(), sizeof(MappedStore<SocketHsm>::Record), attach);
+    std::printf("resume %zu machines: %.3f ms (%zu listening)\n",
+                active.size(), resume, listening);
+    store.close();
+    std::remove(path.c_str());
+    return 0;
+}
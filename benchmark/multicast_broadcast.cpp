@@ -0,0 +1,80 @@
+// Broadcast a large event to a growing number of machines through the
+// multicast ring and report the cost per broadcast.
+// Usage: multicast_broadcast [events]
+#include "tsm.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <utility>
+
+using namespace tsm::detail;
+
+namespace bench {
+// Market data fan-out: every subscriber sees every quote
+struct Subscriber {
+    struct Quote {
+        std::uint64_t sequence;
+        double levels[30];
+    };
+    struct Halt {};
+
+    struct Trading {};
+    struct Halted {};
+
+    void on_quote() { quotes_++; }
+
+    using transitions =
+      std::tuple<Transition<Trading, Quote, Trading, &Subscriber::on_quote>,
+                 Transition<Trading, Halt, Halted>>;
+
+    std::uint64_t quotes_{};
+};
+}
+
+using SubscriberHsm = make_hsm_t<bench::Subscriber>;
+
+template<std::size_t>
+using subscriber_t = SubscriberHsm;
+
+template<std::size_t... Is>
+void
+run(std::size_t events, std::index_sequence<Is...>) {
+    using Fanout = MulticastExecutionPolicy<1024, subscriber_t<Is>...>;
+    auto fanout = std::make_unique<Fanout>();
+    fanout->start();
+    auto begin = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < events; ++i) {
+        fanout->send_event(bench::Subscriber::Quote{ i, {} });
+    }
+    auto published = std::chrono::steady_clock::now();
+    while (fanout->lag() != 0) {
+        std::this_thread::yield();
+    }
+    auto consumed = std::chrono::steady_clock::now();
+    fanout->stop();
+
+    std::chrono::duration<double, std::nano> produce = published - begin;
+    std::chrono::duration<double, std::nano> total = consumed - begin;
+    std::printf("%2zu machines: %6.1f ns/broadcast to publish, %6.1f ns/"
+                "broadcast end to end\n",
+                sizeof...(Is),
+                produce.count() / events,
+                total.count() / events);
+}
+
+int
+main(int argc, char** argv) {
+    std::size_t events =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2'000'000;
+    std::printf("%zu-byte event, %zu broadcasts\n",
+                sizeof(bench::Subscriber::Quote),
+                events);
+    run(events, std::make_index_sequence<1>{});
+    run(events, std::make_index_sequence<2>{});
+    run(events, std::make_index_sequence<4>{});
+    run(events, std::make_index_sequence<8>{});
+    return 0;
+}
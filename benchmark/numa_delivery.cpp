@@ -0,0 +1,94 @@
+// Event delivery latency between a producer and a machine on the same NUMA
+// node and on different nodes. Each machine's thread, queue and state are
+// placed on its node; the producer waits for every event to be handled
+// before sending the next one.
+// Usage: numa_delivery [events]
+#include "tsm.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace tsm::detail;
+
+namespace bench {
+struct Echo {
+    struct Ping {};
+    struct Ready {};
+
+    void on_ping() { handled_.fetch_add(1, std::memory_order_release); }
+
+    using transitions =
+      std::tuple<Transition<Ready, Ping, Ready, &Echo::on_ping>>;
+
+    std::atomic<std::size_t> handled_{};
+};
+}
+
+using EchoHsm = ThreadedExecutionPolicy<bench::Echo>;
+
+// Returns the mean delivery latency in ns, or a negative value on failure
+double
+run(int producer_node, int machine_node, std::size_t events) {
+    auto machine_placement = ThreadPlacement::on_node(machine_node);
+    auto hsm = place<EchoHsm>(machine_placement);
+    if (hsm == nullptr) {
+        std::perror("place");
+        return -1;
+    }
+    hsm->set_placement(machine_placement);
+    hsm->start();
+    if (auto err = hsm->placement_error()) {
+        std::fprintf(stderr, "pin machine: %s\n", err.message().c_str());
+        hsm->stop();
+        return -1;
+    }
+
+    double ns = -1;
+    std::thread producer([&] {
+        if (!ThreadPlacement::on_node(producer_node).apply()) {
+            std::perror("pin producer");
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        for (std::size_t i = 1; i <= events; ++i) {
+            hsm->send_event(bench::Echo::Ping{});
+            while (hsm->handled_.load(std::memory_order_acquire) != i) {
+                std::this_thread::yield();
+            }
+        }
+        std::chrono::duration<double, std::nano> elapsed =
+          std::chrono::steady_clock::now() - begin;
+        ns = elapsed.count() / events;
+    });
+    producer.join();
+    hsm->stop();
+    return ns;
+}
+
+int
+main(int argc, char** argv) {
+    std::size_t events =
+      argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200'000;
+    int nodes = ThreadPlacement::node_count();
+    std::printf("%d NUMA node(s), %zu events per run\n", nodes, events);
+    for (int producer = 0; producer < nodes; ++producer) {
+        for (int machine = 0; machine < nodes; ++machine) {
+            double ns = run(producer, machine, events);
+            if (ns >= 0) {
+                std::printf("producer on node %d, machine on node %d: "
+                            "%8.1f ns/event (%s)\n",
+                            producer,
+                            machine,
+                            ns,
+                            producer == machine ? "same node" : "cross node");
+            }
+        }
+    }
+    if (nodes == 1) {
+        std::printf("single node system: no cross-node result\n");
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+drain(ConveyorHsm& hsm) {
+    hsm.send_event(Conveyor::Unload{});
+    hsm.step();
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
@@ -0,0 +1,12 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+fault_and_reset(ConveyorHsm& hsm, int code) {
+    hsm.send_event(Conveyor::Fault{ code });
+    hsm.step();
+    hsm.send_event(Conveyor::Reset{});
+    hsm.step();
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
@@ -0,0 +1,12 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+feed(ConveyorHsm& hsm, std::uint32_t items) {
+    for (std::uint32_t i = 0; i < items; ++i) {
+        hsm.send_event(Conveyor::Load{ i });
+        hsm.step();
+    }
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
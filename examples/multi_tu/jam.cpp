@@ -0,0 +1,12 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+jam_and_clear(ConveyorHsm& hsm) {
+    hsm.send_event(Conveyor::Jam{});
+    hsm.step();
+    hsm.send_event(Conveyor::Clear{});
+    hsm.step();
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
@@ -0,0 +1,6 @@
+#include "machine.h"
+
+#ifdef MULTI_TU_EXTERN
+TSM_INSTANTIATE_MACHINE(tsm::detail::SingleThreadedExecutionPolicy,
+                        conveyor::Conveyor);
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+// Shared machine definition, included by every translation unit of the
+// sample. Built three ways by measure.sh:
+//   default               each TU instantiates the machine implicitly
+//   -DMULTI_TU_EXTERN     TSM_EXTERN_MACHINE here, machine.cpp instantiates
+//   -DMULTI_TU_MODULE     import tsm; instead of #include <tsm.h>
+
+#ifdef MULTI_TU_MODULE
+// GCC's module support needs the standard headers that tsm's interface
+// mentions to be reachable from the importer
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <tuple>
+#include <variant>
+import tsm;
+#else
+#include <tsm.h>
+#endif
+
+namespace conveyor {
+
+using tsm::detail::Transition;
+
+struct Conveyor {
+    // Events
+    struct Power {};
+    struct Load {
+        std::uint32_t item;
+    };
+    struct Unload {};
+    struct Jam {};
+    struct Clear {};
+    struct Pause {};
+    struct Resume {};
+    struct Fault {
+        int code;
+    };
+    struct Reset {};
+
+    // States
+    struct Off {};
+    struct Idle {};
+    struct Running {};
+    struct Paused {};
+    struct Jammed {};
+    struct Faulted {};
+
+    using transitions =
+      std::tuple<Transition<Off, Power, Idle>,
+                 Transition<Idle, Load, Running>,
+                 Transition<Running, Load, Running>,
+                 Transition<Running, Unload, Idle>,
+                 Transition<Running, Pause, Paused>,
+                 Transition<Paused, Resume, Running>,
+                 Transition<Running, Jam, Jammed>,
+                 Transition<Jammed, Clear, Running>,
+                 Transition<Idle, Fault, Faulted>,
+                 Transition<Running, Fault, Faulted>,
+                 Transition<Paused, Fault, Faulted>,
+                 Transition<Jammed, Fault, Faulted>,
+                 Transition<Faulted, Reset, Off>,
+                 Transition<Idle, Power, Off>>;
+
+    std::uint32_t loaded{};
+    int last_fault{};
+};
+
+using ConveyorHsm = tsm::SingleThreadedHsm<Conveyor>;
+
+} // namespace conveyor
+
+#ifdef MULTI_TU_EXTERN
+TSM_EXTERN_MACHINE(tsm::detail::SingleThreadedExecutionPolicy,
+                   conveyor::Conveyor);
+#endif
+
+// Entry points of the sample's other translation units
+namespace conveyor {
+int power_cycle(ConveyorHsm& hsm);
+int feed(ConveyorHsm& hsm, std::uint32_t items);
+int jam_and_clear(ConveyorHsm& hsm);
+int pause_and_resume(ConveyorHsm& hsm);
+int fault_and_reset(ConveyorHsm& hsm, int code);
+int drain(ConveyorHsm& hsm);
+} // namespace conveyor
@@ -0,0 +1,19 @@
+#include "machine.h"
+
+#include <cstdio>
+
+int
+main() {
+    using namespace conveyor;
+    ConveyorHsm hsm;
+    power_cycle(hsm);
+    hsm.send_event(Conveyor::Power{});
+    hsm.step();
+    feed(hsm, 3);
+    jam_and_clear(hsm);
+    pause_and_resume(hsm);
+    drain(hsm);
+    int state = fault_and_reset(hsm, 7);
+    std::printf("final state %d\n", state);
+    return state == 0 ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# Times a clean, serial build of the sample in each mode and prints the best
+# of N runs with the total size of the sample's objects.
+#   ./measure.sh [optimization flag] [runs]     e.g. ./measure.sh -O2 5
+set -euo pipefail
+
+here=$(cd "$(dirname "$0")" && pwd)
+include=$here/../../include
+cxx=${CXX:-g++}
+opt=${1:--O0}
+runs=${2:-3}
+sources=(machine power feed jam pause fault drain main)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+now() { date +%s.%N; }
+elapsed() { awk -v b="$1" -v e="$(now)" 'BEGIN { printf "%.2f", e - b }'; }
+
+# build <extra objects> <mode flags...>: compiles every TU and links
+build() {
+    local extra=$1
+    shift
+    for src in "${sources[@]}"; do
+        (cd "$work" && $cxx -std=c++20 "$opt" "$@" -I"$include" \
+           -c "$here/$src.cpp" -o "$src.o") || return 1
+    done
+    (cd "$work" && $cxx "${sources[@]/%/.o}" $extra -o app -pthread)
+}
+
+# measure <label> <extra objects> <mode flags...>
+measure() {
+    local label=$1 best=
+    shift
+    for _ in $(seq "$runs"); do
+        local begin
+        begin=$(now)
+        if ! build "$@" 2>"$work/errors"; then
+            printf '%-9s failed: %s\n' "$label" \
+              "$(grep -m1 -i error "$work/errors")"
+            return
+        fi
+        best=$(awk -v t="$(elapsed "$begin")" -v b="$best" \
+                 'BEGIN { print (b == "" || t < b) ? t : b }')
+    done
+    local bytes
+    bytes=$(cd "$work" && size "${sources[@]/%/.o}" |
+              awk 'NR > 1 { sum += $4 } END { print sum }')
+    local status=ok
+    { "$work"/app; } >/dev/null 2>&1 || status="sample exited with $?"
+    printf '%-9s %6.2f s %9d bytes of objects, %s\n' \
+      "$label" "$best" "$bytes" "$status"
+}
+
+echo "$($cxx --version | head -1), $opt, best of $runs"
+measure header ""
+measure extern "" -DMULTI_TU_EXTERN
+
+# The module interface is compiled once; its BMI lands in $work/gcm.cache
+begin=$(now)
+(cd "$work" && $cxx -std=c++20 "$opt" -fmodules-ts -I"$include" \
+   -x c++ -c "$include/tsm.cppm" -o tsm.cppm.o)
+printf '%-9s %6.2f s (once)\n' tsm.cppm "$(elapsed "$begin")"
+measure module tsm.cppm.o -fmodules-ts -DMULTI_TU_MODULE
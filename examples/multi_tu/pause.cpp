@@ -0,0 +1,12 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+pause_and_resume(ConveyorHsm& hsm) {
+    hsm.send_event(Conveyor::Pause{});
+    hsm.step();
+    hsm.send_event(Conveyor::Resume{});
+    hsm.step();
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
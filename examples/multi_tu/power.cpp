@@ -0,0 +1,12 @@
+#include "machine.h"
+
+namespace conveyor {
+int
+power_cycle(ConveyorHsm& hsm) {
+    hsm.send_event(Conveyor::Power{});
+    hsm.step();
+    hsm.send_event(Conveyor::Power{});
+    hsm.step();
+    return static_cast<int>(hsm.current_state_.index());
+}
+} // namespace conveyor
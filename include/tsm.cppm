@@ -0,0 +1,63 @@
+// C++20 named module for tsm. Importers write `import tsm;` and get the same
+// API as #include <tsm.h>; the header is parsed once, into the module.
+//
+// The standard and system headers tsm.h uses go in the global module
+// fragment, so the header's own includes of them are no-ops in the purview.
+// Keep this list in sync with the top of tsm.h.
+module;
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+#ifdef __FREE_RTOS__
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+#else
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#endif // __FREE_RTOS__
+#ifdef __linux__
+#include <alloca.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+export module tsm;
+
+export extern "C++" {
+#include "tsm.h"
+}
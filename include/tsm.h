@@ -1,25 +1,54 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <initializer_list>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <system_error>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #ifdef __FREE_RTOS__
 #include "FreeRTOS.h"
 #include "semphr.h"
 #include "task.h"
 #else
+#include <cerrno>
 #include <condition_variable>
+#include <cstdio>
 #include <mutex>
 #include <thread>
 #endif // __FREE_RTOS__
 
 #ifdef __linux__
-#include <cstdio> // perror
+#include <alloca.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 #endif
 
 namespace tsm {
@@ -88,6 +117,62 @@ struct unique_tuple {
 template<typename Ts>
 using unique_tuple_t = typename unique_tuple<Ts>::type;
 
+// Check if a tuple contains T
+template<typename T, typename Tuple>
+struct tuple_contains;
+
+template<typename T, typename... Ts>
+struct tuple_contains<T, std::tuple<Ts...>>
+  : std::disjunction<std::is_same<T, Ts>...> {};
+
+template<typename T, typename Tuple>
+inline constexpr bool tuple_contains_v = tuple_contains<T, Tuple>::value;
+
+// Index of T in a tuple of unique types
+template<typename T, typename Tuple>
+struct tuple_index;
+
+template<typename T, typename... Ts>
+struct tuple_index<T, std::tuple<Ts...>> {
+    static constexpr std::size_t value = [] {
+        constexpr bool matches[] = { std::is_same_v<T, Ts>... };
+        std::size_t i = 0;
+        while (!matches[i]) {
+            ++i;
+        }
+        return i;
+    }();
+};
+
+// and of an alternative in a variant
+template<typename T, typename... Ts>
+struct tuple_index<T, std::variant<Ts...>>
+  : tuple_index<T, std::tuple<Ts...>> {};
+
+template<typename T, typename Tuple>
+inline constexpr std::size_t tuple_index_v = tuple_index<T, Tuple>::value;
+
+// Check if a variant has T as an alternative
+template<typename T, typename Variant>
+struct variant_contains;
+
+template<typename T, typename... Ts>
+struct variant_contains<T, std::variant<Ts...>>
+  : std::disjunction<std::is_same<T, Ts>...> {};
+
+template<typename T, typename Variant>
+inline constexpr bool variant_contains_v =
+  variant_contains<T, Variant>::value;
+
+template<typename T>
+struct is_variant : std::false_type {};
+
+template<typename... Ts>
+struct is_variant<std::variant<Ts...>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool is_variant_v = is_variant<T>::value;
+
 // Rename tuple to variant
 template<typename Tuple>
 struct tuple_to_variant_impl;
@@ -110,7 +195,16 @@ struct wrapped_event : Event {
 };
 
 // Transition
-// Dummy action and guard - hopefully, these will be optimized away
+// Dummy action and guard - hopefully, these will be optimized away. Named
+// types rather than lambdas so that a Transition, and the machine built from
+// it, is the same type in every translation unit.
+struct NoAction {
+    constexpr void operator()() const {}
+};
+
+struct NoGuard {
+    constexpr bool operator()() const { return true; }
+};
 
 template<typename From, typename Event, typename To>
 struct BaseTransition {
@@ -122,8 +216,8 @@ struct BaseTransition {
 template<typename From,
          typename Event,
          typename To,
-         auto Action = []() {},
-         auto Guard = []() { return true; }>
+         auto Action = NoAction{},
+         auto Guard = NoGuard{}>
 struct Transition : BaseTransition<From, Event, To> {
     Transition() = default;
     ~Transition() = default;
@@ -139,8 +233,8 @@ struct ClockTickEvent {
 
 template<typename From,
          typename To,
-         auto Action = []() {},
-         auto Guard = []() { return true; }>
+         auto Action = NoAction{},
+         auto Guard = NoGuard{}>
 struct ClockedTransition
   : Transition<From, ClockTickEvent, To, Action, Guard> {};
 
@@ -380,6 +474,576 @@ struct is_clocked_hsm<T, std::void_t<decltype(T::is_clocked_hsm)>>
 template<typename T>
 inline constexpr bool is_clocked_hsm_v = is_clocked_hsm<T>::value;
 
+// Forward declarations
+template<typename HsmType, typename = void>
+struct get_events_from_hsm;
+
+template<typename Transition>
+struct get_events_from_transition;
+
+template<typename TransitionsTuple>
+struct aggregate_events;
+
+// Specialize for transitions tuple
+template<typename... Transitions>
+struct aggregate_events<std::tuple<Transitions...>> {
+    using type = decltype(std::tuple_cat(
+      typename get_events_from_transition<Transitions>::type{}...));
+};
+
+// Base case for empty tuple
+template<>
+struct aggregate_events<std::tuple<>> {
+    using type = std::tuple<>;
+};
+
+// Extract events from a single transition
+template<typename Transition>
+struct get_events_from_transition {
+    using Event = std::tuple<typename Transition::event>;
+    using FromEvents =
+      typename get_events_from_hsm<typename Transition::from>::type;
+    using ToEvents =
+      typename get_events_from_hsm<typename Transition::to>::type;
+    using type = decltype(std::tuple_cat(Event{}, FromEvents{}, ToEvents{}));
+};
+
+// Main structure for extracting events from an HSM
+template<typename HsmType>
+struct get_events_from_hsm<HsmType,
+                           std::enable_if_t<has_transitions_v<HsmType>>> {
+    using Transitions = typename HsmType::transitions;
+    using type = typename aggregate_events<Transitions>::type;
+};
+
+// Fallback for non-HSM types
+template<typename HsmType>
+struct get_events_from_hsm<HsmType,
+                           std::enable_if_t<!has_transitions_v<HsmType>>> {
+    using type = std::tuple<>;
+};
+
+// Helper alias
+template<typename HsmType>
+using get_events_t =
+  unique_tuple_t<typename get_events_from_hsm<HsmType>::type>;
+
+// Run-to-completion queue for events a machine raises on itself. Inherit the
+// context from it and call post_internal() from actions, entry or exit
+// handlers instead of calling handle() re-entrantly. The Hsm drains the queue
+// before handle() returns and before the next external event is dispatched.
+// Fixed capacity, no allocation and no locking - only the thread running the
+// machine may post.
+template<std::size_t Capacity, typename... Events>
+struct InternalEventQueue {
+    static_assert(Capacity > 0, "InternalEventQueue needs a non-zero capacity");
+    static constexpr bool has_internal_queue = true;
+    using InternalEvent = std::variant<Events...>;
+
+    // Returns false if the queue is full and the event was dropped
+    template<typename Event>
+    bool post_internal(Event&& e) {
+        if (internal_size_ == Capacity) {
+            return false;
+        }
+        internal_events_[(internal_head_ + internal_size_) % Capacity] =
+          std::forward<Event>(e);
+        ++internal_size_;
+        return true;
+    }
+
+    bool has_internal_events() const { return internal_size_ != 0; }
+
+    bool next_internal_event(InternalEvent& e) {
+        if (internal_size_ == 0) {
+            return false;
+        }
+        e = std::move(internal_events_[internal_head_]);
+        internal_head_ = (internal_head_ + 1) % Capacity;
+        --internal_size_;
+        return true;
+    }
+
+  private:
+    std::array<InternalEvent, Capacity> internal_events_{};
+    std::size_t internal_head_{};
+    std::size_t internal_size_{};
+};
+
+// Trait to check if a context carries an InternalEventQueue
+template<typename T, typename = void>
+struct has_internal_queue : std::false_type {};
+
+template<typename T>
+struct has_internal_queue<T, std::void_t<decltype(T::has_internal_queue)>>
+  : std::true_type {};
+
+template<typename T>
+inline constexpr bool has_internal_queue_v = has_internal_queue<T>::value;
+
+// Execution-time budgets. A context opts in by naming a clock, e.g.
+//     using budget_clock = AccurateClock;
+// States then declare any of entry_budget, exit_budget, guard_budget,
+// action_budget, or a catch-all budget, as static constexpr durations. A
+// transition wrapped in Budgeted<> gives its guard and action their own
+// budget. Only handlers with a budget are timed; without a budget_clock
+// nothing is.
+enum class Handler { Guard, Action, Entry, Exit };
+
+template<typename Tn, std::int64_t Nanoseconds>
+struct Budgeted : Tn {
+    static constexpr std::chrono::nanoseconds budget{ Nanoseconds };
+};
+
+template<typename Tn, std::int64_t Nanoseconds, typename From, typename Event>
+struct is_transition_match<Budgeted<Tn, Nanoseconds>, From, Event>
+  : is_transition_match<Tn, From, Event> {};
+
+template<Handler H, typename State>
+constexpr std::chrono::nanoseconds
+state_budget() {
+    if constexpr (H == Handler::Guard && requires { State::guard_budget; }) {
+        return State::guard_budget;
+    } else if constexpr (H == Handler::Action &&
+                         requires { State::action_budget; }) {
+        return State::action_budget;
+    } else if constexpr (H == Handler::Entry &&
+                         requires { State::entry_budget; }) {
+        return State::entry_budget;
+    } else if constexpr (H == Handler::Exit &&
+                         requires { State::exit_budget; }) {
+        return State::exit_budget;
+    } else if constexpr (requires { State::budget; }) {
+        return State::budget;
+    } else {
+        return std::chrono::nanoseconds::zero();
+    }
+}
+
+// A Budgeted transition's budget wins over its source state's
+template<Handler H, typename State, typename Tn>
+constexpr std::chrono::nanoseconds
+handler_budget() {
+    if constexpr ((H == Handler::Guard || H == Handler::Action) &&
+                  requires { Tn::budget; }) {
+        return Tn::budget;
+    } else {
+        return state_budget<H, State>();
+    }
+}
+
+template<typename T>
+inline constexpr bool has_budget_clock_v =
+  requires { typename T::budget_clock; };
+
+// Passed to the context's on_overrun(BudgetOverrun const&), if it has one
+struct BudgetOverrun {
+    Handler handler;
+    std::size_t state; // index into the machine's States
+    std::chrono::nanoseconds elapsed;
+    std::chrono::nanoseconds budget;
+};
+
+// Worst-case execution time of every timed handler and the number of
+// overruns. Written by the machine's thread, readable from any thread.
+template<std::size_t StateCount>
+struct BudgetMonitor {
+    static constexpr std::size_t HandlerCount = 4;
+
+    // Returns true if the handler overran its budget
+    bool record(Handler handler,
+                std::size_t state,
+                std::chrono::nanoseconds elapsed,
+                std::chrono::nanoseconds budget) {
+        auto& worst = worst_[state * HandlerCount +
+                             static_cast<std::size_t>(handler)];
+        if (elapsed.count() > worst.load(std::memory_order_relaxed)) {
+            worst.store(elapsed.count(), std::memory_order_relaxed);
+        }
+        if (elapsed <= budget) {
+            return false;
+        }
+        overruns_.store(overruns_.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+        return true;
+    }
+
+    std::chrono::nanoseconds worst_case(std::size_t state,
+                                        Handler handler) const {
+        return std::chrono::nanoseconds(
+          worst_[state * HandlerCount + static_cast<std::size_t>(handler)]
+            .load(std::memory_order_relaxed));
+    }
+
+    std::uint64_t overruns() const {
+        return overruns_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::array<std::atomic<std::int64_t>, StateCount * HandlerCount> worst_{};
+    std::atomic<std::uint64_t> overruns_{};
+};
+
+struct NoBudgetMonitor {};
+
+// Hardware events counted by PerfCounters
+enum class PerfEvent : std::size_t {
+    Cycles,
+    Instructions,
+    L1DMisses,
+    LLCMisses,
+    BranchMisses
+};
+
+inline constexpr std::size_t PerfEventCount = 5;
+using PerfValues = std::array<std::uint64_t, PerfEventCount>;
+
+// perf_event_open counters of the thread that opens them, read as one group.
+// Events the CPU or kernel cannot count are left out and read as zero. If the
+// group cannot be opened at all - no PMU, or perf_event_paranoid forbids it -
+// available() is false and error() holds the errno.
+struct PerfCounters {
+    PerfCounters() { fds_.fill(-1); }
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+    ~PerfCounters() { close(); }
+
+    bool open() {
+#ifdef __linux__
+        close();
+        static constexpr std::pair<std::uint32_t, std::uint64_t>
+          events[PerfEventCount] = {
+              { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+              { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+              { PERF_TYPE_HW_CACHE,
+                PERF_COUNT_HW_CACHE_L1D |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+              { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+              { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+          };
+        for (std::size_t i = 0; i < PerfEventCount; ++i) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.disabled = leader_ < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                               PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = static_cast<int>(
+              syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+            if (fd < 0) {
+                if (leader_ < 0) {
+                    // without cycles there is nothing to relate the rest to
+                    error_ = errno;
+                    return false;
+                }
+                continue;
+            }
+            if (leader_ < 0) {
+                leader_ = fd;
+            }
+            fds_[i] = fd;
+            position_[i] = members_++;
+        }
+        ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        error_ = 0;
+        return true;
+#else
+        error_ = ENOSYS;
+        return false;
+#endif
+    }
+
+    bool available() const { return leader_ >= 0; }
+    bool counts(PerfEvent e) const {
+        return fds_[static_cast<std::size_t>(e)] >= 0;
+    }
+    int error() const { return error_; }
+
+    // Running totals since open(). False if the group was not scheduled on
+    // the PMU, e.g. because other users took all counters.
+    bool read(PerfValues& out) const {
+#ifdef __linux__
+        struct {
+            std::uint64_t nr;
+            std::uint64_t time_enabled;
+            std::uint64_t time_running;
+            std::uint64_t values[PerfEventCount];
+        } data;
+        if (leader_ < 0 || ::read(leader_, &data, sizeof(data)) <= 0 ||
+            data.time_running == 0) {
+            return false;
+        }
+        for (std::size_t i = 0; i < PerfEventCount; ++i) {
+            out[i] = fds_[i] >= 0 ? data.values[position_[i]] : 0;
+        }
+        return true;
+#else
+        (void)out;
+        return false;
+#endif
+    }
+
+  private:
+    void close() {
+#ifdef __linux__
+        for (auto& fd : fds_) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            fd = -1;
+        }
+#endif
+        leader_ = -1;
+        members_ = 0;
+    }
+
+    int leader_{ -1 };
+    int error_{};
+    std::size_t members_{};
+    std::array<int, PerfEventCount> fds_;
+    std::array<std::size_t, PerfEventCount> position_{};
+};
+
+// Counts gathered for one transition. Rates are per thousand instructions.
+struct TransitionProfile {
+    std::uint64_t events{};   // events that reached the transition
+    std::uint64_t handled{};  // of which it took
+    std::uint64_t measured{}; // of which the counters covered
+    PerfValues totals{};
+
+    std::uint64_t total(PerfEvent e) const {
+        return totals[static_cast<std::size_t>(e)];
+    }
+
+    double ipc() const {
+        auto cycles = total(PerfEvent::Cycles);
+        return cycles ? double(total(PerfEvent::Instructions)) / cycles : 0.0;
+    }
+
+    double per_kilo_instruction(PerfEvent e) const {
+        auto instructions = total(PerfEvent::Instructions);
+        return instructions ? 1000.0 * double(total(e)) / instructions : 0.0;
+    }
+};
+
+// The calling thread's counters, opened the first time the thread asks
+inline PerfCounters& thread_perf_counters() {
+    thread_local PerfCounters counters;
+    thread_local bool opened = counters.open();
+    (void)opened;
+    return counters;
+}
+
+// Contexts that declare `static constexpr bool transition_profile = true`
+// charge every transition their machine resolves - guard, exit, action and
+// entry - to that transition, using the hardware counters of the thread that
+// handles the event. A nested machine is profiled when its own context opts
+// in. Without counters only the event counts are kept. Read the profiles
+// once the machine is idle or stopped.
+template<typename T, typename = void>
+struct has_transition_profile : std::false_type {};
+
+template<typename T>
+struct has_transition_profile<T,
+                              std::void_t<decltype(T::transition_profile)>>
+  : std::bool_constant<T::transition_profile> {};
+
+template<typename T>
+inline constexpr bool has_transition_profile_v =
+  has_transition_profile<T>::value;
+
+template<std::size_t TransitionCount>
+struct TransitionProfiler {
+    // Run a transition and charge it to the profile at index transition
+    template<typename F>
+    bool record(std::size_t transition, F&& handler) {
+        auto& counters = thread_perf_counters();
+        auto& profile = profiles_[transition];
+        PerfValues before;
+        bool counting = counters.available() && counters.read(before);
+        bool taken = handler();
+        PerfValues after;
+        if (counting && counters.read(after)) {
+            for (std::size_t i = 0; i < PerfEventCount; ++i) {
+                profile.totals[i] += after[i] - before[i];
+            }
+            ++profile.measured;
+        }
+        ++profile.events;
+        profile.handled += taken;
+        return taken;
+    }
+
+    std::array<TransitionProfile, TransitionCount> profiles_{};
+};
+
+struct NoTransitionProfiler {};
+
+// Contexts that declare `static constexpr bool lazy_states = true` keep their
+// states in a variant: a state is constructed on entry and destroyed when the
+// machine leaves it, so the machine is as large as its largest state rather
+// than all of them. State data that must outlive a visit belongs in the
+// context. A self-transition keeps the state object.
+template<typename T, typename = void>
+struct has_lazy_states : std::false_type {};
+
+template<typename T>
+struct has_lazy_states<T, std::void_t<decltype(T::lazy_states)>>
+  : std::bool_constant<T::lazy_states> {};
+
+template<typename T>
+inline constexpr bool has_lazy_states_v = has_lazy_states<T>::value;
+
+// Snapshot support. A snapshot holds the active state index of every Hsm in a
+// hierarchy (pre-order, including inactive sub-machines so their history is
+// kept) and the optional snapshot_data of every context. A context opts into
+// saving its own fields by declaring
+//     struct snapshot_data { ... };
+//     void save_snapshot(snapshot_data&) const;
+//     void restore_snapshot(snapshot_data const&);
+template<typename T, typename = void>
+struct has_snapshot_data : std::false_type {};
+
+template<typename T>
+struct has_snapshot_data<T, std::void_t<typename T::snapshot_data>>
+  : std::true_type {};
+
+template<typename T>
+inline constexpr bool has_snapshot_data_v = has_snapshot_data<T>::value;
+
+// Trivially copyable stand-in for std::tuple so snapshots can be memcpy'd
+template<typename... Ts>
+struct snapshot_pack {};
+
+template<typename T, typename... Ts>
+struct snapshot_pack<T, Ts...> {
+    [[no_unique_address]] T head;
+    [[no_unique_address]] snapshot_pack<Ts...> tail;
+};
+
+// Placeholder for contexts and leaf states without data
+struct no_snapshot_data {};
+
+// Placeholders take no space, not even a byte per leaf state
+template<typename... Ts>
+struct snapshot_pack<no_snapshot_data, Ts...> {
+    static inline no_snapshot_data head{};
+    [[no_unique_address]] snapshot_pack<Ts...> tail;
+};
+
+template<std::size_t I, typename Pack>
+constexpr auto& snapshot_get(Pack& pack) {
+    if constexpr (I == 0) {
+        return pack.head;
+    } else {
+        return snapshot_get<I - 1>(pack.tail);
+    }
+}
+
+template<typename T, typename = void>
+struct context_snapshot {
+    using type = no_snapshot_data;
+};
+
+template<typename T>
+struct context_snapshot<T, std::enable_if_t<has_snapshot_data_v<T>>> {
+    using type = typename T::snapshot_data;
+};
+
+// Leaf states do not contribute to a snapshot
+template<typename State, typename = void>
+struct state_snapshot {
+    static constexpr std::size_t size = 0;
+    static constexpr std::size_t max_states = 0;
+    using data = no_snapshot_data;
+};
+
+template<typename State>
+struct state_snapshot<State, std::enable_if_t<is_hsm_trait_v<State>>> {
+    static constexpr std::size_t size = State::snapshot_size;
+    static constexpr std::size_t max_states = State::snapshot_max_states;
+    using data = typename State::SnapshotData;
+};
+
+template<typename States>
+struct states_snapshot;
+
+template<typename... States>
+struct states_snapshot<std::tuple<States...>> {
+    static constexpr std::size_t size =
+      (std::size_t{ 0 } + ... + state_snapshot<States>::size);
+    static constexpr std::size_t max_states =
+      std::max({ sizeof...(States), state_snapshot<States>::max_states... });
+    template<typename Head>
+    using data_with =
+      snapshot_pack<Head, typename state_snapshot<States>::data...>;
+    using data = snapshot_pack<typename state_snapshot<States>::data...>;
+};
+
+// Smallest index type that can hold every state index in the hierarchy
+template<std::size_t MaxStates>
+using snapshot_index_t =
+  std::conditional_t<(MaxStates <= 256), std::uint8_t, std::uint16_t>;
+
+template<typename HsmType>
+struct Snapshot {
+    std::array<snapshot_index_t<HsmType::snapshot_max_states>,
+               HsmType::snapshot_size>
+      states{};
+    [[no_unique_address]] typename HsmType::SnapshotData data{};
+};
+
+template<typename HsmType>
+using snapshot_t = Snapshot<typename HsmType::HsmType>;
+
+template<typename State, typename Index, typename Data>
+Index* save_state_configuration(State const& state, Index* out, Data& data) {
+    if constexpr (is_hsm_trait_v<State>) {
+        return state.save_configuration(out, data);
+    } else {
+        return out;
+    }
+}
+
+template<typename State, typename Index, typename Data>
+Index const* restore_state_configuration(State& state,
+                                         Index const* in,
+                                         Data const& data) {
+    if constexpr (is_hsm_trait_v<State>) {
+        return state.restore_configuration(in, data);
+    } else {
+        return in;
+    }
+}
+
+// What became of an event. handle() reports both Refused and Taken as
+// handled: the innermost level with a transition for the event consumes it,
+// whatever its guard says.
+enum class TransitionResult {
+    NoTransition, // no level has a transition for the event
+    Refused,      // a guard or a state's handle() turned the transition down
+    Taken
+};
+
+// Handles an event; true only when a transition was taken. Machines that
+// only report whether they handled it - orthogonal regions, say - are taken
+// at their word.
+template<typename Machine, typename Event>
+constexpr bool handle_taken(Machine& machine, Event&& e) {
+    if constexpr (requires { machine.handle_result(e); }) {
+        return machine.handle_result(std::forward<Event>(e)) ==
+               TransitionResult::Taken;
+    } else {
+        return machine.handle(std::forward<Event>(e));
+    }
+}
+
 // Hsm
 template<typename T, typename transitions = typename T::transitions>
 struct Hsm : T {
@@ -388,25 +1052,88 @@ struct Hsm : T {
     using HsmType = type; // alias for policy classes
     using initial_state = typename std::tuple_element_t<0, transitions>::from;
     using States = get_states_t<transitions>;
-
-    Hsm()
+    static constexpr bool lazy_states = has_lazy_states_v<T>;
+    using StateStorage =
+      std::conditional_t<lazy_states, tuple_to_variant_t<States>, States>;
+    static_assert(!lazy_states || tuple_index_v<initial_state, States> == 0,
+                  "The variant starts out holding the first state");
+    static constexpr bool timed_handlers = has_budget_clock_v<T>;
+    using Budgets = std::conditional_t<timed_handlers,
+                                       BudgetMonitor<std::tuple_size_v<States>>,
+                                       NoBudgetMonitor>;
+    static constexpr bool profiled_transitions =
+      has_transition_profile_v<T>;
+    using Profiles =
+      std::conditional_t<profiled_transitions,
+                         TransitionProfiler<std::tuple_size_v<transitions>>,
+                         NoTransitionProfiler>;
+
+    constexpr Hsm()
       : current_state_(&std::get<initial_state>(states_)) {}
 
+    // The object of a state. With lazy_states only the active state exists
+    // and asking for another one throws std::bad_variant_access.
+    template<typename State>
+    constexpr State& state() {
+        return std::get<State>(states_);
+    }
+
+    template<std::size_t I>
+    constexpr auto& state() {
+        return std::get<I>(states_);
+    }
+
     // for rvalue reference and copy
     template<typename Event>
-    bool handle(Event&& e) {
-        // using Event = std::decay_t<Evt>;
-        // Event e = std::forward<Evt>(event);
+    constexpr bool handle(Event&& e) {
+        return handle_result(std::forward<Event>(e)) !=
+               TransitionResult::NoTransition;
+    }
+
+    // handle() that also tells a refused transition from a taken one
+    template<typename Event>
+    constexpr TransitionResult handle_result(Event&& e) {
+        if constexpr (has_internal_queue_v<T>) {
+            // events posted outside of a handler go before the external one
+            drain_internal();
+            auto result = dispatch_result(std::forward<Event>(e));
+            drain_internal();
+            return result;
+        } else {
+            return dispatch_result(std::forward<Event>(e));
+        }
+    }
+
+    // Process internal events until the queue is empty. Events posted while
+    // draining are appended and processed in order.
+    constexpr void drain_internal() {
+        if constexpr (has_internal_queue_v<T>) {
+            typename T::InternalEvent next;
+            while (T::next_internal_event(next)) {
+                std::visit([this](auto& e) { this->dispatch(e); }, next);
+            }
+        }
+    }
+
+    // Dispatch a single event to the current state without draining the
+    // internal queue
+    template<typename Event>
+    constexpr bool dispatch(Event&& e) {
+        return dispatch_result(std::forward<Event>(e)) !=
+               TransitionResult::NoTransition;
+    }
+
+    template<typename Event>
+    constexpr TransitionResult dispatch_result(Event&& e) {
         return std::visit(
           [this, &e](auto* state) {
               using State = std::decay_t<decltype(*state)>;
-              // check Event is same as decayed e
-              bool handled = false;
+              auto result = TransitionResult::NoTransition;
               // if current_state is a state machine, call handle on it
               if constexpr (is_hsm_trait_t<State>::value) {
-                  handled = state->handle(std::forward<Event>(e));
+                  result = nested_result(*state, std::forward<Event>(e));
               }
-              if (!handled) {
+              if (result == TransitionResult::NoTransition) {
                   // Does State implement handle for Event?
                   if constexpr (has_valid_transition_v<State,
                                                        std::decay_t<Event>,
@@ -414,18 +1141,34 @@ struct Hsm : T {
                       using transition = find_transition_t<State,
                                                            std::decay_t<Event>,
                                                            transitions>;
-                      this->handle_transition<transition>(
-                        state, static_cast<Event&&>(e));
-                      handled = true;
+                      bool taken = this->profiled<transition>([&] {
+                          return this->handle_transition<transition>(
+                            state, static_cast<Event&&>(e));
+                      });
+                      result = taken ? TransitionResult::Taken
+                                     : TransitionResult::Refused;
                   }
               }
-              return handled;
+              return result;
           },
           current_state_);
     }
 
+    // Nested states that are not Hsms - orthogonal regions, say - only
+    // report whether they handled the event
+    template<typename State, typename Event>
+    static constexpr TransitionResult nested_result(State& state, Event&& e) {
+        if constexpr (requires { state.handle_result(e); }) {
+            return state.handle_result(std::forward<Event>(e));
+        } else {
+            return state.handle(std::forward<Event>(e))
+                     ? TransitionResult::Taken
+                     : TransitionResult::NoTransition;
+        }
+    }
+
     template<typename Event, typename State>
-    void entry(Event&& e, State* state) noexcept {
+    constexpr void entry(Event&& e, State* state) noexcept {
         if constexpr (has_entry_v<State, Event>) {
             if constexpr (std::is_invocable_v<decltype(&State::entry),
                                               State*,
@@ -444,7 +1187,7 @@ struct Hsm : T {
     }
 
     template<typename Event, typename State>
-    void exit(Event&& e, State* state) noexcept {
+    constexpr void exit(Event&& e, State* state) noexcept {
         if constexpr (has_exit_v<State, Event>) {
             if constexpr (std::is_invocable_v<decltype(&State::exit),
                                               State*,
@@ -465,7 +1208,7 @@ struct Hsm : T {
     template<typename Tn,
              typename Event = typename Tn::event,
              typename State = typename Tn::from>
-    bool check_guard(Event&& e, State* state) {
+    constexpr bool check_guard(Event&& e, State* state) {
         if constexpr (has_guard_v<State, Event>) {
             if constexpr (std::is_invocable_v<decltype(&State::guard),
                                               State*,
@@ -492,7 +1235,7 @@ struct Hsm : T {
     template<typename Tn,
              typename Event = typename Tn::event,
              typename State = typename Tn::from>
-    void perform_action(Event&& e, State* state) {
+    constexpr void perform_action(Event&& e, State* state) {
         if constexpr (has_action_v<State, Event>) {
             if constexpr (std::is_invocable_v<decltype(&State::action),
                                               State*,
@@ -517,53 +1260,248 @@ struct Hsm : T {
     template<typename transition,
              typename State = typename transition::from,
              typename Event = typename transition::event>
-    std::enable_if_t<!has_handle_method_v<State, Event, T>, void>
+    constexpr std::enable_if_t<!has_handle_method_v<State, Event, T>, bool>
     handle_transition(typename transition::from* state, Event&& e) {
         // Assume TransitionMap provides the matching transition
-        if (!this->check_guard<transition>(std::forward<Event>(e), state)) {
-            return;
+        if (!timed<Handler::Guard, State, transition>([&] {
+                return this->check_guard<transition>(std::forward<Event>(e),
+                                                     state);
+            })) {
+            return false;
         }
 
-        this->template exit<Event, State>(std::forward<Event>(e), state);
+        timed<Handler::Exit, State, transition>([&] {
+            this->template exit<Event, State>(std::forward<Event>(e), state);
+        });
 
         // Optional Action
-        this->perform_action<transition>(std::forward<Event>(e), state);
+        timed<Handler::Action, State, transition>([&] {
+            this->perform_action<transition>(std::forward<Event>(e), state);
+        });
 
         using to = typename transition::to;
 
         // switch to the new state
-        current_state_ = &std::get<to>(states_);
+        current_state_ = &enter_state<to>();
 
-        this->template entry<Event, to>(std::forward<Event>(e),
-                                        *std::get_if<to*>(&current_state_));
+        timed<Handler::Entry, to, transition>([&] {
+            this->template entry<Event, to>(
+              std::forward<Event>(e), *std::get_if<to*>(&current_state_));
+        });
+        return true;
     }
 
     template<typename transition,
              typename State = typename transition::from,
              typename Event = typename transition::event>
-    std::enable_if_t<has_handle_method_v<State, Event, T>, void>
+    constexpr std::enable_if_t<has_handle_method_v<State, Event, T>, bool>
     handle_transition(State* state, Event&& e) {
 
         // A true gives permission to transition
         if (!state->handle(static_cast<T&>(*this), std::forward<Event>(e))) {
-            return;
+            return false;
         }
 
         using to = typename transition::to;
 
         // switch to the new state
-        current_state_ = &std::get<to>(states_);
+        current_state_ = &enter_state<to>();
 
-        this->template entry<Event, to>(std::forward<Event>(e),
-                                        *std::get_if<to*>(&current_state_));
-    }
+        timed<Handler::Entry, to, transition>([&] {
+            this->template entry<Event, to>(
+              std::forward<Event>(e), *std::get_if<to*>(&current_state_));
+        });
+        return true;
+    }
+
+    // Run a handler, timing it if it has a budget and the context a
+    // budget_clock. Compiles down to the plain call otherwise.
+    template<Handler H, typename State, typename Tn, typename F>
+    constexpr auto timed(F&& handler) {
+        constexpr auto budget = handler_budget<H, State, Tn>();
+        if constexpr (!timed_handlers || budget.count() <= 0) {
+            return handler();
+        } else {
+            using Clock = typename T::budget_clock;
+            auto begin = Clock::now();
+            if constexpr (std::is_void_v<decltype(handler())>) {
+                handler();
+                overran<H, State>(Clock::now() - begin, budget);
+            } else {
+                auto result = handler();
+                overran<H, State>(Clock::now() - begin, budget);
+                return result;
+            }
+        }
+    }
+
+    // Run a transition, charging it to its profile if the context profiles
+    // transitions. Compiles down to the plain call otherwise.
+    template<typename Tn, typename F>
+    constexpr bool profiled(F&& handler) {
+        if constexpr (!profiled_transitions) {
+            return handler();
+        } else {
+            return profiles_.record(tuple_index_v<Tn, transitions>, handler);
+        }
+    }
+
+    // Profile of the transition State takes on Event
+    template<typename State, typename Event>
+    TransitionProfile const& profile() const
+        requires profiled_transitions
+    {
+        using Tn = find_transition_t<State, Event, transitions>;
+        return profiles_.profiles_[tuple_index_v<Tn, transitions>];
+    }
+
+    // f(transition_index, profile) for every transition that saw events
+    template<typename F>
+    void for_each_profile(F&& f) const
+        requires profiled_transitions
+    {
+        auto const& profiles = profiles_.profiles_;
+        for (std::size_t i = 0; i < profiles.size(); ++i) {
+            if (profiles[i].events != 0) {
+                f(i, profiles[i]);
+            }
+        }
+    }
+
+    template<Handler H, typename State, typename Duration>
+    void overran(Duration elapsed, std::chrono::nanoseconds budget) {
+        BudgetOverrun overrun{
+            H,
+            tuple_index_v<State, States>,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed),
+            budget
+        };
+        if (budgets_.record(
+              overrun.handler, overrun.state, overrun.elapsed, budget)) {
+            if constexpr (requires(T& t) { t.on_overrun(overrun); }) {
+                static_cast<T&>(*this).on_overrun(overrun);
+            }
+        }
+    }
+
+    // Worst-case execution time seen for a timed handler of State
+    template<typename State>
+    std::chrono::nanoseconds worst_case(Handler handler) const
+        requires timed_handlers
+    {
+        return budgets_.worst_case(tuple_index_v<State, States>, handler);
+    }
+
+    std::uint64_t overruns() const
+        requires timed_handlers
+    {
+        return budgets_.overruns();
+    }
+
+    template<typename State>
+    constexpr void current_state() {
+        current_state_ = &enter_state<State>();
+    }
 
+    // The object of a state the machine is switching to. Lazy machines
+    // replace the state they leave with a fresh one.
     template<typename State>
-    void current_state() {
-        current_state_ = &std::get<State>(states_);
+    constexpr State& enter_state() {
+        if constexpr (lazy_states) {
+            if (auto* active = std::get_if<State>(&states_)) {
+                return *active;
+            }
+            return states_.template emplace<State>();
+        } else {
+            return std::get<State>(states_);
+        }
+    }
+
+    static constexpr std::size_t snapshot_size =
+      1 + states_snapshot<States>::size;
+    static constexpr std::size_t snapshot_max_states =
+      states_snapshot<States>::max_states;
+    // context data followed by the data of each state
+    using SnapshotData = typename states_snapshot<
+      States>::template data_with<typename context_snapshot<T>::type>;
+
+    // Capture the active configuration of this machine and all sub-machines
+    Snapshot<type> snapshot() const {
+        Snapshot<type> s;
+        save_configuration(s.states.data(), s.data);
+        return s;
+    }
+
+    // Reinstate a configuration taken with snapshot(). No entry or exit
+    // handlers are run. Returns false if the snapshot holds an index that is
+    // out of range, in which case the machine is partially restored.
+    bool restore(Snapshot<type> const& s) {
+        return restore_configuration(s.states.data(), s.data) != nullptr;
+    }
+
+    template<typename Index>
+    Index* save_configuration(Index* out, SnapshotData& data) const {
+        *out++ = static_cast<Index>(current_state_.index());
+        if constexpr (has_snapshot_data_v<T>) {
+            T::save_snapshot(snapshot_get<0>(data));
+        }
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((out = save_state<Is>(out, snapshot_get<Is + 1>(data))), ...);
+        }(std::make_index_sequence<std::tuple_size_v<States>>{});
+        return out;
+    }
+
+    template<typename Index>
+    Index const* restore_configuration(Index const* in,
+                                       SnapshotData const& data) {
+        if (in == nullptr || *in >= std::tuple_size_v<States>) {
+            return nullptr;
+        }
+        std::size_t index = *in++;
+        if constexpr (has_snapshot_data_v<T>) {
+            T::restore_snapshot(snapshot_get<0>(data));
+        }
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((index == Is ? (void)(current_state_ = &enter_state<
+                                     std::tuple_element_t<Is, States>>())
+                          : void()),
+             ...);
+            ((in = in ? restore_state<Is>(in, snapshot_get<Is + 1>(data))
+                      : nullptr),
+             ...);
+        }(std::make_index_sequence<std::tuple_size_v<States>>{});
+        return in;
+    }
+
+    // A lazy machine's inactive states do not exist. Their sub-machines are
+    // saved as if just entered and skipped on restore.
+    template<std::size_t I, typename Index, typename Data>
+    Index* save_state(Index* out, Data& data) const {
+        if constexpr (lazy_states) {
+            constexpr std::size_t size =
+              state_snapshot<std::tuple_element_t<I, States>>::size;
+            if (states_.index() != I) {
+                return std::fill_n(out, size, Index{ 0 });
+            }
+        }
+        return save_state_configuration(std::get<I>(states_), out, data);
     }
 
-    States states_;
+    template<std::size_t I, typename Index, typename Data>
+    Index const* restore_state(Index const* in, Data const& data) {
+        if constexpr (lazy_states) {
+            constexpr std::size_t size =
+              state_snapshot<std::tuple_element_t<I, States>>::size;
+            if (states_.index() != I) {
+                return in + size;
+            }
+        }
+        return restore_state_configuration(std::get<I>(states_), in, data);
+    }
+
+    StateStorage states_;
+    [[no_unique_address]] Budgets budgets_;
+    [[no_unique_address]] Profiles profiles_;
     transitions transitions_;
     tuple_to_variant_t<wrap_type<std::add_pointer, States>> current_state_;
 };
@@ -579,6 +1517,18 @@ struct make_hsm<T, std::enable_if_t<!is_state_trait_v<T>>> {
 template<typename T>
 using make_hsm_t = typename make_hsm<T>::type;
 
+// Carry a Budgeted transition's budget over to its wrapped form
+template<typename T, typename Wrapped>
+struct rebudget {
+    using type = Wrapped;
+};
+
+template<typename T, typename Wrapped>
+    requires requires { T::budget; }
+struct rebudget<T, Wrapped> {
+    using type = Budgeted<Wrapped, T::budget.count()>;
+};
+
 // Recursively wrap states in HSMs if they are state traits
 template<typename T>
 struct wrap_transition {
@@ -591,7 +1541,8 @@ struct wrap_transition {
     using wrap_to =
       std::conditional_t<is_state_trait_v<to>, make_hsm_t<to>, to>;
 
-    using type = Transition<wrap_from, event, wrap_to, T::action, T::guard>;
+    using wrapped = Transition<wrap_from, event, wrap_to, T::action, T::guard>;
+    using type = typename rebudget<T, wrapped>::type;
 };
 
 template<typename T>
@@ -617,17 +1568,31 @@ struct ClockedHsm : Policy<T> {
 
     constexpr static bool is_clocked_hsm = true;
 
-    bool tick() { return this->handle(tick_event_); }
+    constexpr bool tick() { return this->handle(tick_event_); }
 
     template<typename Event>
-    bool handle(Event e = Event()) {
+    constexpr bool handle(Event e = Event()) {
         return HsmType::handle(e);
     }
 
-    bool handle(ClockTickEvent& e) {
+    constexpr bool handle(ClockTickEvent& e) {
         ++tick_event_.ticks_;
         return HsmType::handle(e);
     }
+
+    template<typename Event>
+    constexpr TransitionResult handle_result(Event e = Event())
+        requires requires(HsmType& hsm) { hsm.handle_result(e); }
+    {
+        return HsmType::handle_result(e);
+    }
+
+    constexpr TransitionResult handle_result(ClockTickEvent& e)
+        requires requires(HsmType& hsm) { hsm.handle_result(e); }
+    {
+        ++tick_event_.ticks_;
+        return HsmType::handle_result(e);
+    }
     ClockTickEvent tick_event_{};
 };
 
@@ -641,6 +1606,26 @@ struct make_hsm<T, std::enable_if_t<is_state_trait_v<T>>> {
     using type = Hsm<T, transitions>;
 };
 
+// A region reacts to an event if some transition in its hierarchy takes it.
+// Clocked regions also count ticks, and nested orthogonal regions react if one
+// of their regions does. The events of any other region without a transitions
+// table - a custom wrapper, say - are unknown, so it is offered every event.
+template<typename Event, typename Region>
+constexpr bool region_accepts() {
+    if constexpr (requires { Region::template accepts_event<Event>; }) {
+        return Region::template accepts_event<Event>;
+    } else if constexpr (!has_transitions_v<Region>) {
+        return true;
+    } else {
+        return tuple_contains_v<std::decay_t<Event>, get_events_t<Region>> ||
+               (is_clocked_hsm_v<Region> &&
+                std::is_same_v<std::decay_t<Event>, ClockTickEvent>);
+    }
+}
+
+template<typename Event, typename Region>
+inline constexpr bool region_accepts_v = region_accepts<Event, Region>();
+
 // Orthogonal HSM
 template<typename... Hsms>
 struct OrthogonalExecutionPolicy {
@@ -657,794 +1642,4039 @@ struct OrthogonalExecutionPolicy {
         std::apply([e](auto&... hsm) { (hsm.exit(e), ...); }, hsms_);
     }
 
+    static constexpr std::size_t region_count = sizeof...(Hsms);
+    using RegionResults = std::bitset<region_count>;
+
+    // Can some region react to Event?
+    template<typename Event>
+    static constexpr bool accepts_event =
+      (region_accepts_v<Event, Hsms> || ...);
+
+    // Regions that have a transition for Event somewhere in their hierarchy
+    template<typename Event>
+    static constexpr RegionResults relevant_regions() {
+        return []<std::size_t... Is>(std::index_sequence<Is...>) {
+            return RegionResults{ (
+              0ULL | ... |
+              (static_cast<unsigned long long>(
+                 region_accepts_v<Event, std::tuple_element_t<
+                                           Is, std::tuple<Hsms...>>>)
+               << Is)) };
+        }(std::index_sequence_for<Hsms...>{});
+    }
+
+    // Returns true if every region that can react to the event handled it,
+    // false if one of them did not or no region can react at all. Regions
+    // known to have no transition for the event are neither called nor
+    // counted; use handle_regions() to see the outcome per region.
     template<typename Event>
     bool handle(Event e = Event()) {
-        return std::apply([e](auto&... hsm) { return (hsm.handle(e) && ...); },
-                          hsms_);
+        constexpr RegionResults relevant = relevant_regions<Event>();
+        return relevant.any() && handle_regions(e) == relevant;
+    }
+
+    // Dispatch to every relevant region in order and report which of them
+    // handled the event. Regions see the same event object, so changes one
+    // region makes to it are visible to the next.
+    template<typename Event>
+    RegionResults handle_regions(Event& e) {
+        RegionResults handled;
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            (handle_region<Is>(e, handled), ...);
+        }(std::index_sequence_for<Hsms...>{});
+        return handled;
+    }
+
+    template<std::size_t I, typename Event>
+    void handle_region(Event& e, RegionResults& handled) {
+        using Region = std::tuple_element_t<I, std::tuple<Hsms...>>;
+        if constexpr (region_accepts_v<Event, Region>) {
+            handled[I] = std::get<I>(hsms_).handle(e);
+        }
+    }
+
+    using HsmType = type;
+    static constexpr std::size_t snapshot_size =
+      states_snapshot<std::tuple<Hsms...>>::size;
+    static constexpr std::size_t snapshot_max_states =
+      states_snapshot<std::tuple<Hsms...>>::max_states;
+    using SnapshotData = typename states_snapshot<std::tuple<Hsms...>>::data;
+
+    Snapshot<type> snapshot() const {
+        Snapshot<type> s;
+        save_configuration(s.states.data(), s.data);
+        return s;
+    }
+
+    bool restore(Snapshot<type> const& s) {
+        return restore_configuration(s.states.data(), s.data) != nullptr;
+    }
+
+    // Regions are stored one after the other
+    template<typename Index>
+    Index* save_configuration(Index* out, SnapshotData& data) const {
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((out = std::get<Is>(hsms_).save_configuration(
+                out, snapshot_get<Is>(data))),
+             ...);
+        }(std::index_sequence_for<Hsms...>{});
+        return out;
+    }
+
+    template<typename Index>
+    Index const* restore_configuration(Index const* in,
+                                       SnapshotData const& data) {
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((in = in ? std::get<Is>(hsms_).restore_configuration(
+                          in, snapshot_get<Is>(data))
+                      : nullptr),
+             ...);
+        }(std::index_sequence_for<Hsms...>{});
+        return in;
     }
 
     std::tuple<Hsms...> hsms_;
 };
 
-// A thread safe event queue. Any thread can call add_event if it has a pointer
-// to the event queue. The call to nextEvent is a blocking call
-template<typename Event, typename LockType, typename ConditionVarType>
-struct EventQueueT {
-    using EventType = Event;
+// Bulk snapshot of a contiguous array of machines. The snapshot type is
+// trivially copyable when every context's snapshot_data is, so the result can
+// be memcpy'd or written out as one block.
+template<typename HsmType>
+void snapshot_all(HsmType const* hsms,
+                  std::size_t count,
+                  snapshot_t<HsmType>* out) {
+    for (std::size_t i = 0; i < count; ++i) {
+        hsms[i].save_configuration(out[i].states.data(), out[i].data);
+    }
+}
 
-    virtual ~EventQueueT() { stop(); }
+// Bulk restore. Returns the number of machines that were fully restored.
+template<typename HsmType>
+std::size_t restore_all(HsmType* hsms,
+                        std::size_t count,
+                        snapshot_t<HsmType> const* in) {
+    std::size_t restored = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        restored += hsms[i].restore_configuration(in[i].states.data(),
+                                                  in[i].data) != nullptr;
+    }
+    return restored;
+}
+
+// Hierarchy flattening. Every leaf state of a nested machine is identified by
+// its path - the state index at each level from the root down. FlatHsm keeps
+// the index of the active leaf and, for each event type, a table with one
+// handler per leaf. A handler knows its path at compile time: it picks the
+// innermost level that has a transition for the event (the same priority
+// Hsm::handle gives nested machines) and runs that level's exit, action and
+// entry directly. Finding the transition costs one table lookup whatever the
+// nesting depth. The nested Hsm objects still hold the states and their
+// history, so snapshots and current_state_ checks keep working.
+template<typename State, typename = void>
+struct is_composite_state : std::false_type {};
+
+template<typename State>
+struct is_composite_state<State, std::void_t<typename State::States>>
+  : std::bool_constant<is_hsm_trait_v<State>> {};
+
+template<typename State>
+inline constexpr bool is_composite_state_v = is_composite_state<State>::value;
+
+template<typename State>
+constexpr std::size_t count_leaves();
+
+// Number of leaves in the first N states of HsmType
+template<typename HsmType, std::size_t N>
+constexpr std::size_t leaf_offset() {
+    using States = typename HsmType::States;
+    return []<std::size_t... Is>(std::index_sequence<Is...>) {
+        return (std::size_t{ 0 } + ... +
+                count_leaves<std::tuple_element_t<Is, States>>());
+    }(std::make_index_sequence<N>{});
+}
+
+template<typename State>
+constexpr std::size_t count_leaves() {
+    if constexpr (is_composite_state_v<State>) {
+        return leaf_offset<State,
+                           std::tuple_size_v<typename State::States>>();
+    } else {
+        static_assert(!is_hsm_trait_v<State>,
+                      "only nested Hsm states can be flattened");
+        return 1;
+    }
+}
 
-  public:
-    // Block until you get an event
-    Event next_event() {
-        std::unique_lock<LockType> lock(eventQueueMutex_);
-        cvEventAvailable_.wait(
-          lock, [this] { return (!this->empty() || this->interrupt_); });
-        if (interrupt_) {
-            return Event();
-        }
-        const Event e = std::move(front());
-        pop_front();
-        return e;
+// Leaf index of the active configuration below hsm
+template<typename HsmType>
+std::size_t active_leaf(HsmType const& hsm) {
+    return std::visit(
+      [](auto* state) -> std::size_t {
+          using State = std::decay_t<decltype(*state)>;
+          constexpr std::size_t offset =
+            leaf_offset<HsmType,
+                        tuple_index_v<State, typename HsmType::States>>();
+          if constexpr (is_composite_state_v<State>) {
+              return offset + active_leaf(*state);
+          } else {
+              return offset;
+          }
+      },
+      hsm.current_state_);
+}
+
+// Collect the paths to all leaves below HsmType
+template<typename HsmType, typename Prefix, typename = void>
+struct leaf_paths {
+    using type = std::tuple<Prefix>;
+};
+
+template<typename HsmType, std::size_t... Ps>
+struct leaf_paths<HsmType,
+                  std::index_sequence<Ps...>,
+                  std::enable_if_t<is_composite_state_v<HsmType>>> {
+    using States = typename HsmType::States;
+
+    template<std::size_t... Is>
+    static auto collect(std::index_sequence<Is...>)
+      -> decltype(std::tuple_cat(
+        typename leaf_paths<std::tuple_element_t<Is, States>,
+                            std::index_sequence<Ps..., Is>>::type{}...));
+
+    using type = decltype(collect(
+      std::make_index_sequence<std::tuple_size_v<States>>{}));
+};
+
+// Type of the machine at level J of a path
+template<typename HsmType, typename Path, std::size_t J>
+struct path_level;
+
+template<typename HsmType, std::size_t P, std::size_t... Ps>
+struct path_level<HsmType, std::index_sequence<P, Ps...>, 0> {
+    using type = HsmType;
+};
+
+template<typename HsmType, std::size_t P, std::size_t... Ps, std::size_t J>
+struct path_level<HsmType, std::index_sequence<P, Ps...>, J> {
+    using type = typename path_level<
+      std::tuple_element_t<P, typename HsmType::States>,
+      std::index_sequence<Ps...>,
+      J - 1>::type;
+};
+
+template<typename HsmType, typename Path, std::size_t J>
+using path_level_t = typename path_level<HsmType, Path, J>::type;
+
+template<std::size_t J, std::size_t... Ps>
+constexpr std::size_t path_index(std::index_sequence<Ps...>) {
+    constexpr std::array<std::size_t, sizeof...(Ps)> path{ Ps... };
+    return path[J];
+}
+
+// FlatHsm replaces handle() of the machine it derives from without it being
+// virtual, so it can only wrap the root Hsm itself or a ClockedHsm around it.
+// A policy wrapped around it would call the nested machines' handle() and
+// leave the active leaf stale.
+template<typename HsmType>
+struct FlatHsm : HsmType {
+    using type = FlatHsm<HsmType>;
+    // The root machine
+    using Root = typename HsmType::HsmType;
+    static_assert(std::is_same_v<HsmType, Root> || is_clocked_hsm_v<HsmType>,
+                  "FlatHsm wraps a plain or clocked Hsm; put execution "
+                  "policies around the FlatHsm instead");
+    using Leaves = typename leaf_paths<Root, std::index_sequence<>>::type;
+    static constexpr std::size_t leaf_count = std::tuple_size_v<Leaves>;
+
+    FlatHsm()
+      : leaf_(active_leaf(static_cast<Root&>(*this))) {}
+
+    template<typename Event>
+    bool handle(Event&& e) {
+        return handle_result(std::forward<Event>(e)) !=
+               TransitionResult::NoTransition;
     }
 
-    void add_event(Event&& e) {
-        if (interrupt_) {
-            return;
+    template<typename Event>
+    TransitionResult handle_result(Event&& e) {
+        if constexpr (is_clocked_hsm_v<HsmType> &&
+                      std::is_same_v<Event, ClockTickEvent&>) {
+            ++this->tick_event_.ticks_;
+        }
+        if constexpr (has_internal_queue_v<Root>) {
+            drain_internal();
+            auto result = dispatch_result(std::forward<Event>(e));
+            drain_internal();
+            return result;
+        } else {
+            return dispatch_result(std::forward<Event>(e));
         }
-        std::lock_guard<LockType> lock(eventQueueMutex_);
-        push_back(std::forward<Event>(e));
-        cvEventAvailable_.notify_all();
     }
 
-    void stop() {
-        interrupt_ = true;
-        cvEventAvailable_.notify_all();
-        // Log the events that are going to get dumped if the queue is not
-        // empty
+    bool tick()
+        requires is_clocked_hsm_v<HsmType>
+    {
+        return handle(this->tick_event_);
     }
 
-    bool interrupted() { return interrupt_; }
-
-  protected:
-    bool empty() { return push_index_ == pop_index_; }
+    template<typename Event>
+    bool dispatch(Event&& e) {
+        return dispatch_result(std::forward<Event>(e)) !=
+               TransitionResult::NoTransition;
+    }
 
-    Event const& front() { return data_[pop_index_]; }
+    template<typename Event>
+    TransitionResult dispatch_result(Event&& e) {
+        return dispatch_table<Event>(
+          std::make_index_sequence<leaf_count>{})[leaf_](
+          *this, std::forward<Event>(e));
+    }
 
-    void pop_front() {
-        if (!empty()) {
-            pop_index_ = (pop_index_ + 1) % data_.size();
+    void drain_internal() {
+        if constexpr (has_internal_queue_v<Root>) {
+            typename Root::InternalEvent next;
+            while (Root::next_internal_event(next)) {
+                std::visit([this](auto& e) { this->dispatch(e); }, next);
+            }
         }
     }
 
-    bool push_back(Event const& e) {
-        if ((push_index_ + 1) % data_.size() != pop_index_) {
-            data_[push_index_] = e;
-            push_index_ = (push_index_ + 1) % data_.size();
-            return true;
-        }
-        return false;
+    bool restore(Snapshot<Root> const& s) {
+        bool restored = Root::restore(s);
+        resync();
+        return restored;
     }
 
-  private:
-    LockType eventQueueMutex_;
-    ConditionVarType cvEventAvailable_;
-    bool interrupt_{};
-    size_t push_index_{ 0 };
-    size_t pop_index_{ 0 };
-    std::array<Event, 50> data_;
-};
+    // Recompute the active leaf after the nested machines were changed
+    // directly
+    void resync() { leaf_ = active_leaf(static_cast<Root&>(*this)); }
 
-#ifdef __FREE_RTOS__
-constexpr int MaxEvents = 10; // Define your own queue size
+    std::size_t leaf_index() const { return leaf_; }
 
-class FreeRTOSMutex {
-  public:
-    FreeRTOSMutex() {
-        // Create the FreeRTOS mutex
-        this->mutex = xSemaphoreCreateMutex();
+  private:
+    template<typename Event, std::size_t... Ls>
+    static auto const& dispatch_table(std::index_sequence<Ls...>) {
+        using Handler = TransitionResult (*)(FlatHsm&, Event&&);
+        static constexpr std::array<Handler, leaf_count> table{
+            &dispatch_leaf<std::tuple_element_t<Ls, Leaves>, Event>...
+        };
+        return table;
     }
 
-    ~FreeRTOSMutex() {
-        // Delete the FreeRTOS mutex
-        vSemaphoreDelete(this->mutex);
+    // Innermost level on Path with a transition for Event, or -1
+    template<typename Path, typename Event>
+    static constexpr int handling_level() {
+        int level = -1;
+        [&]<std::size_t... Js>(std::index_sequence<Js...>) {
+            ((level = has_valid_transition_v<
+                        std::tuple_element_t<
+                          path_index<Js>(Path{}),
+                          typename path_level_t<Root, Path, Js>::States>,
+                        std::decay_t<Event>,
+                        decltype(path_level_t<Root, Path, Js>::transitions_)>
+                        ? static_cast<int>(Js)
+                        : level),
+             ...);
+        }(std::make_index_sequence<Path::size()>{});
+        return level;
     }
 
-    void lock() {
-        // Wait forever for the mutex to become available
-        xSemaphoreTake(this->mutex, portMAX_DELAY);
+    // The machine at level J, reached through compile-time offsets
+    template<typename Path, std::size_t J>
+    path_level_t<Root, Path, J>& level() {
+        if constexpr (J == 0) {
+            return static_cast<Root&>(*this);
+        } else {
+            return level<Path, J - 1>()
+              .template state<path_index<J - 1>(Path{})>();
+        }
     }
 
-    bool try_lock() {
-        // Try to take the mutex without blocking
-        return xSemaphoreTake(this->mutex, 0) == pdTRUE;
+    // Leaf offset of the machine at level J
+    template<typename Path, std::size_t J>
+    static constexpr std::size_t level_offset() {
+        return []<std::size_t... Js>(std::index_sequence<Js...>) {
+            return (std::size_t{ 0 } + ... +
+                    leaf_offset<path_level_t<Root, Path, Js>,
+                                path_index<Js>(Path{})>());
+        }(std::make_index_sequence<J>{});
     }
 
-    void unlock() {
-        // Release the mutex
-        xSemaphoreGive(this->mutex);
+    // The innermost level with a transition for the event consumes it, even
+    // when its guard refuses, as the nested machines do
+    template<typename Path, typename Event>
+    static TransitionResult dispatch_leaf(FlatHsm& self, Event&& e) {
+        constexpr int J = handling_level<Path, Event>();
+        if constexpr (J < 0) {
+            return TransitionResult::NoTransition;
+        } else {
+            auto& hsm = self.template level<Path, J>();
+            using Level = std::decay_t<decltype(hsm)>;
+            constexpr std::size_t index = path_index<J>(Path{});
+            using State = std::tuple_element_t<index, typename Level::States>;
+            using Tn = find_transition_t<State,
+                                         std::decay_t<Event>,
+                                         decltype(Level::transitions_)>;
+            bool taken = hsm.template profiled<Tn>([&] {
+                return hsm.template handle_transition<Tn>(
+                  &hsm.template state<index>(), std::forward<Event>(e));
+            });
+            if constexpr (J > 0) {
+                // events the nested context raised on itself, whether the
+                // transition was taken or not; the root drains in handle()
+                hsm.drain_internal();
+            }
+            // the levels above J are unchanged, so Path still leads here
+            self.leaf_ = level_offset<Path, J>() + active_leaf(hsm);
+            return taken ? TransitionResult::Taken : TransitionResult::Refused;
+        }
     }
 
-    // Return the native handle of the mutex
-    SemaphoreHandle_t native_handle() { return this->mutex; }
+    std::size_t leaf_{};
+};
 
-  private:
-    SemaphoreHandle_t mutex;
+template<typename Context>
+using make_flat_hsm_t = FlatHsm<make_hsm_t<Context>>;
+
+// Wire ids. An event declaring `static constexpr std::uint32_t id` keeps
+// that id; any other event is numbered by its position in the machine's
+// event list, which is stable as long as the transition table is.
+template<typename E, typename Events, typename = void>
+struct event_id {
+    static constexpr std::uint32_t value =
+      static_cast<std::uint32_t>(tuple_index_v<E, Events>);
 };
 
-class FreeRTOSConditionVariable {
-  public:
-    FreeRTOSConditionVariable()
-      : semaphore_(xSemaphoreCreateBinary())
-      , waitersCount_(0) {
-        // Ensure the semaphore is in a non-signalled state initially.
-        xSemaphoreTake(semaphore_, 0);
-    }
+template<typename E, typename Events>
+struct event_id<E, Events, std::void_t<decltype(E::id)>> {
+    static constexpr std::uint32_t value = E::id;
+};
 
-    ~FreeRTOSConditionVariable() { vSemaphoreDelete(semaphore_); }
+template<typename E, typename Events>
+inline constexpr std::uint32_t event_id_v = event_id<E, Events>::value;
 
-    template<typename Lock>
-    void wait(Lock& lock) {
-        // Increment the count of waiters.
-        UBaseType_t oldISRState = taskENTER_CRITICAL_FROM_ISR();
-        ++waitersCount_;
-        taskEXIT_CRITICAL_FROM_ISR(oldISRState);
+// Event types that hold views into the frame are built from the payload
+// span; trivially copyable ones are copied out of it
+template<typename E>
+inline constexpr bool is_view_event_v =
+  std::is_constructible_v<E, std::span<std::byte const>>;
 
-        // Unlock the external mutex and wait for notification.
-        lock.unlock();
-        xSemaphoreTake(semaphore_, portMAX_DELAY);
+template<typename E>
+inline constexpr bool is_wire_event_v =
+  is_view_event_v<E> || std::is_trivially_copyable_v<E>;
 
-        // Decrement the count of waiters.
-        oldISRState = taskENTER_CRITICAL_FROM_ISR();
-        --waitersCount_;
-        taskEXIT_CRITICAL_FROM_ISR(oldISRState);
+enum class DispatchResult {
+    Handled,
+    Rejected,   // the machine did not take the event
+    UnknownId,  // no event has this id
+    BadPayload  // the payload size does not match the event
+};
 
-        // Re-acquire the mutex before exiting.
-        lock.lock();
+// Compile-time map from wire id to a decode-and-handle function for every
+// event Machine takes
+template<typename Machine>
+struct EventRegistry {
+    using Events = get_events_t<Machine>;
+    using Handler = DispatchResult (*)(Machine&, std::span<std::byte const>);
+    static constexpr std::size_t count = std::tuple_size_v<Events>;
+
+    template<typename E>
+    static constexpr std::uint32_t id = event_id_v<E, Events>;
+
+    static constexpr auto ids = []<std::size_t... Is>(
+                                  std::index_sequence<Is...>) {
+        return std::array<std::uint32_t, count>{
+            event_id_v<std::tuple_element_t<Is, Events>, Events>...
+        };
+    }(std::make_index_sequence<count>{});
+
+    static constexpr std::uint32_t max_id =
+      count == 0 ? 0 : *std::max_element(ids.begin(), ids.end());
+
+    static_assert(
+      [] {
+          for (std::size_t i = 0; i < count; ++i) {
+              for (std::size_t j = i + 1; j < count; ++j) {
+                  if (ids[i] == ids[j]) {
+                      return false;
+                  }
+              }
+          }
+          return true;
+      }(),
+      "Two events share a wire id");
+
+    // Ids up to this bound are looked up in a direct table, sparser ids by
+    // binary search
+    static constexpr bool dense = max_id < 4 * count + 64;
+
+    static DispatchResult dispatch(Machine& machine,
+                                   std::uint32_t id,
+                                   std::span<std::byte const> payload) {
+        if constexpr (dense) {
+            static constexpr auto table = make_dense_table();
+            Handler handler = id <= max_id ? table[id] : nullptr;
+            return handler != nullptr ? handler(machine, payload)
+                                      : DispatchResult::UnknownId;
+        } else {
+            static constexpr auto table = make_sorted_table();
+            auto it = std::lower_bound(
+              table.begin(), table.end(), id, [](auto const& entry, auto id) {
+                  return entry.first < id;
+              });
+            // events that cannot come off the wire have no handler
+            return it != table.end() && it->first == id &&
+                       it->second != nullptr
+                     ? it->second(machine, payload)
+                     : DispatchResult::UnknownId;
+        }
     }
 
-    void notify_one() {
-        if (waitersCount_ > 0) {        // Check if there are any waiters.
-            xSemaphoreGive(semaphore_); // Wake up one waiter.
+  private:
+    template<typename E>
+    static DispatchResult decode(Machine& machine,
+                                 std::span<std::byte const> payload) {
+        if constexpr (is_view_event_v<E>) {
+            E e(payload);
+            return handle_taken(machine, e) ? DispatchResult::Handled
+                                            : DispatchResult::Rejected;
+        } else {
+            // empty events are sent without a payload
+            constexpr std::size_t size = std::is_empty_v<E> ? 0 : sizeof(E);
+            if (payload.size() != size) {
+                return DispatchResult::BadPayload;
+            }
+            E e;
+            if constexpr (size > 0) {
+                std::memcpy(&e, payload.data(), size);
+            }
+            return handle_taken(machine, e) ? DispatchResult::Handled
+                                            : DispatchResult::Rejected;
         }
     }
 
-    void notify_all() {
-        while (waitersCount_ > 0) { // Keep waking all waiters.
-            xSemaphoreGive(semaphore_);
-            // Small delay to allow other tasks to respond to the semaphore.
-            vTaskDelay(pdMS_TO_TICKS(10));
+    template<typename E>
+    static constexpr Handler handler_for() {
+        if constexpr (is_wire_event_v<E>) {
+            return &decode<E>;
+        } else {
+            return nullptr;
         }
     }
 
-  private:
-    SemaphoreHandle_t semaphore_;
-    volatile UBaseType_t waitersCount_;
+    static constexpr auto make_dense_table() {
+        std::array<Handler, max_id + 1> table{};
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((table[ids[Is]] = handler_for<std::tuple_element_t<Is, Events>>()),
+             ...);
+        }(std::make_index_sequence<count>{});
+        return table;
+    }
+
+    static constexpr auto make_sorted_table() {
+        using Entry = std::pair<std::uint32_t, Handler>;
+        std::array<Entry, count> table{};
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((table[Is] =
+                Entry{ ids[Is],
+                       handler_for<std::tuple_element_t<Is, Events>>() }),
+             ...);
+        }(std::make_index_sequence<count>{});
+        std::sort(table.begin(), table.end(), [](auto const& a, auto const& b) {
+            return a.first < b.first;
+        });
+        return table;
+    }
 };
 
-// C++ 11 compatible clock with FreeRTOS tick count.
-struct FreeRTOSClock {
-    using duration = std::chrono::milliseconds;
-    using period = duration::period;
-    using rep = duration::rep;
-    using time_point = std::chrono::time_point<FreeRTOSClock>;
+// Decode a binary frame straight into the event its id names and handle it
+// - no variant is built and nothing is visited. Works for Hsm, ClockedHsm
+// and FlatHsm alike.
+template<typename Machine>
+DispatchResult
+handle_by_id(Machine& machine,
+             std::uint32_t id,
+             std::span<std::byte const> payload) {
+    return EventRegistry<Machine>::dispatch(machine, id, payload);
+}
+
+// Pads shared indices against false sharing
+inline constexpr std::size_t CacheLineSize = 64;
+
+// Per-event outcome of a batch: bit i is set if the i-th event was handled
+template<std::size_t MaxBatch>
+struct BatchResult {
+    std::bitset<MaxBatch> handled;
+    std::size_t size{}; // events dispatched, at most MaxBatch
+
+    bool all() const { return handled.count() == size; }
+};
 
-    static constexpr bool is_steady = true;
+// Dispatch up to MaxBatch events in order with no per-event synchronization.
+// Event is either one event type or a variant of them. Callers with longer
+// batches advance by result.size and call again. This is a convenience for
+// collecting per-event results, not a fast path: benchmark/batch_handle
+// measures it no faster than calling handle in a loop.
+template<std::size_t MaxBatch = 64, typename Machine, typename Event>
+BatchResult<MaxBatch>
+handle_batch(Machine& machine, std::span<Event> events) {
+    BatchResult<MaxBatch> result;
+    result.size = std::min(events.size(), MaxBatch);
+    // collect the bits in plain words and touch the bitset once at the end
+    std::array<std::uint64_t, (MaxBatch + 63) / 64> words{};
+    for (std::size_t i = 0; i < result.size; ++i) {
+        bool handled;
+        if constexpr (is_variant_v<std::remove_const_t<Event>>) {
+            handled = std::visit(
+              [&machine](auto& e) -> bool { return machine.handle(e); },
+              events[i]);
+        } else {
+            handled = machine.handle(events[i]);
+        }
+        words[i / 64] |= std::uint64_t{ handled } << (i % 64);
+    }
+    for (std::size_t w = 0; w < words.size(); ++w) {
+        result.handled |= std::bitset<MaxBatch>(words[w]) << (w * 64);
+    }
+    return result;
+}
+
+// Point-in-time view of a queue's counters. depth is derived from the
+// counters, so it can be off by the events in flight while it is read.
+struct QueueStatsSnapshot {
+    std::uint64_t enqueued{};
+    std::uint64_t dequeued{};
+    std::uint64_t dropped{}; // queue full or stopped
+    std::size_t depth{};
+    std::size_t high_water{};
+    std::uint64_t lock_contended{}; // acquisitions that had to wait
+    std::chrono::nanoseconds lock_wait{};
+    std::uint64_t wakeups{}; // times a blocked consumer woke up
+};
 
-    static time_point now() noexcept {
-        TickType_t ticks = xTaskGetTickCount();
-        // Convert ticks to milliseconds (note: configTICK_RATE_HZ is the number
-        // of ticks per second)
-        auto durationSinceEpoch =
-          std::chrono::milliseconds(ticks * (1000 / configTICK_RATE_HZ));
-        return time_point(duration(durationSinceEpoch));
+// Default queue instrumentation: nothing is recorded
+struct NoQueueStats {
+    static constexpr bool enabled = false;
+
+    template<typename Lock>
+    void lock(Lock& lock) {
+        lock.lock();
     }
+    void enqueued(std::size_t) {}
+    void dequeued() {}
+    void dropped() {}
+    void woke_up() {}
 };
 
-template<typename Event>
-using EventQueue = EventQueueT<Event, FreeRTOSMutex, FreeRTOSConditionVariable>;
+// Counters are only written with the queue's lock held and read with relaxed
+// loads, so snapshot() never takes the lock. The lock is timed only when
+// try_lock fails, keeping uncontended operations free of clock reads.
+struct QueueStats {
+    static constexpr bool enabled = true;
+
+    template<typename Lock>
+    void lock(Lock& lock) {
+        if (lock.try_lock()) {
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        lock.lock();
+        auto waited = std::chrono::steady_clock::now() - begin;
+        bump(lock_contended_);
+        lock_wait_ns_.store(
+          lock_wait_ns_.load(std::memory_order_relaxed) +
+            std::chrono::duration_cast<std::chrono::nanoseconds>(waited)
+              .count(),
+          std::memory_order_relaxed);
+    }
+
+    void enqueued(std::size_t depth) {
+        bump(enqueued_);
+        if (depth > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(depth, std::memory_order_relaxed);
+        }
+    }
+    void dequeued() { bump(dequeued_); }
+    void dropped() { dropped_.fetch_add(1, std::memory_order_relaxed); }
+    void woke_up() { bump(wakeups_); }
+
+    QueueStatsSnapshot snapshot() const {
+        QueueStatsSnapshot s;
+        // dequeued first so depth never goes negative
+        s.dequeued = dequeued_.load(std::memory_order_relaxed);
+        s.enqueued = enqueued_.load(std::memory_order_relaxed);
+        s.dropped = dropped_.load(std::memory_order_relaxed);
+        s.depth = static_cast<std::size_t>(s.enqueued - s.dequeued);
+        s.high_water = high_water_.load(std::memory_order_relaxed);
+        s.lock_contended = lock_contended_.load(std::memory_order_relaxed);
+        s.lock_wait = std::chrono::nanoseconds(
+          lock_wait_ns_.load(std::memory_order_relaxed));
+        s.wakeups = wakeups_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+  private:
+    // single writer at a time (the lock holder), so no read-modify-write
+    static void bump(std::atomic<std::uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    }
+
+    // kept off the queue's own cache lines
+    alignas(CacheLineSize) std::atomic<std::uint64_t> enqueued_{};
+    std::atomic<std::uint64_t> dequeued_{};
+    std::atomic<std::uint64_t> dropped_{};
+    std::atomic<std::size_t> high_water_{};
+    std::atomic<std::uint64_t> lock_contended_{};
+    std::atomic<std::uint64_t> lock_wait_ns_{};
+    std::atomic<std::uint64_t> wakeups_{};
+};
+
+// Contexts opt their machine's queue into instrumentation with
+// `static constexpr bool queue_stats = true`
+template<typename T, typename = void>
+struct has_queue_stats : std::false_type {};
+
+template<typename T>
+struct has_queue_stats<T, std::void_t<decltype(T::queue_stats)>>
+  : std::bool_constant<T::queue_stats> {};
+
+template<typename T>
+inline constexpr bool has_queue_stats_v = has_queue_stats<T>::value;
+
+template<typename T>
+using queue_stats_t =
+  std::conditional_t<has_queue_stats_v<T>, QueueStats, NoQueueStats>;
+
+// Latency distribution in power-of-two nanosecond buckets: bucket i holds
+// samples below 2^i ns. Single writer; any thread may read.
+struct LatencyHistogram {
+    static constexpr std::size_t Buckets = 64;
+
+    void record(std::chrono::nanoseconds latency) {
+        auto ns = static_cast<std::uint64_t>(
+          std::max<std::int64_t>(latency.count(), 0));
+        auto& bucket = buckets_[std::min<std::size_t>(std::bit_width(ns),
+                                                      Buckets - 1)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
+        if (ns > max_.load(std::memory_order_relaxed)) {
+            max_.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    std::uint64_t count() const {
+        std::uint64_t total = 0;
+        for (auto const& bucket : buckets_) {
+            total += bucket.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    std::uint64_t bucket(std::size_t i) const {
+        return buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket that holds the given fraction of samples
+    std::chrono::nanoseconds percentile(double fraction) const {
+        auto total = count();
+        if (total == 0) {
+            return {};
+        }
+        auto rank = static_cast<std::uint64_t>(fraction * (total - 1)) + 1;
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < Buckets; ++i) {
+            seen += bucket(i);
+            if (seen >= rank) {
+                return std::min(std::chrono::nanoseconds((1ULL << i) - 1),
+                                max());
+            }
+        }
+        return max();
+    }
+
+    std::chrono::nanoseconds max() const {
+        return std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    }
+
+    // Add another histogram's samples, e.g. to summarize several machines
+    void merge(LatencyHistogram const& other) {
+        for (std::size_t i = 0; i < Buckets; ++i) {
+            buckets_[i].store(bucket(i) + other.bucket(i),
+                              std::memory_order_relaxed);
+        }
+        if (other.max() > max()) {
+            max_.store(static_cast<std::uint64_t>(other.max().count()),
+                       std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    std::array<std::atomic<std::uint64_t>, Buckets> buckets_{};
+    std::atomic<std::uint64_t> max_{};
+};
+
+// Queue latency tracking, off by default
+struct NoEventLatency {
+    static constexpr bool enabled = false;
+
+    template<typename Event, std::size_t Slots>
+    struct tracker {
+        struct stamp {};
+        stamp now() const { return {}; }
+        void enqueued(std::size_t, stamp) {}
+        void dequeued(std::size_t, std::size_t) {}
+        void done() {}
+    };
+};
+
+// Stamps each queue slot when its event is sent and records, per event type,
+// the time spent queued (send to dequeue) and being handled (dequeue to
+// done). Stamps live beside the queue's slots, not in the events.
+template<typename Clock = std::chrono::steady_clock>
+struct EventLatency {
+    static constexpr bool enabled = true;
+
+    template<typename Event, std::size_t Slots>
+    struct tracker {
+        static constexpr std::size_t types = std::variant_size_v<Event>;
+        using stamp = typename Clock::time_point;
+
+        stamp now() const { return Clock::now(); }
+
+        // producer, with the queue locked
+        void enqueued(std::size_t slot, stamp sent) { sent_[slot] = sent; }
+
+        // consumer, with the queue locked
+        void dequeued(std::size_t slot, std::size_t type) {
+            dequeued_ = Clock::now();
+            type_ = type;
+            queued_[type].record(dequeued_ - sent_[slot]);
+        }
+
+        // consumer, once the dequeued event has been handled
+        void done() { handling_[type_].record(Clock::now() - dequeued_); }
+
+        std::array<LatencyHistogram, types> queued_;
+        std::array<LatencyHistogram, types> handling_;
+
+      private:
+        std::array<stamp, Slots> sent_{};
+        stamp dequeued_{};
+        std::size_t type_{};
+    };
+};
+
+// Contexts opt their machine's queue into latency tracking with
+// `static constexpr bool event_latency = true`
+template<typename T, typename = void>
+struct has_event_latency : std::false_type {};
+
+template<typename T>
+struct has_event_latency<T, std::void_t<decltype(T::event_latency)>>
+  : std::bool_constant<T::event_latency> {};
+
+template<typename T>
+inline constexpr bool has_event_latency_v = has_event_latency<T>::value;
+
+template<typename T>
+using event_latency_t =
+  std::conditional_t<has_event_latency_v<T>, EventLatency<>, NoEventLatency>;
+
+// A thread safe event queue. Any thread can call add_event if it has a pointer
+// to the event queue. The call to nextEvent is a blocking call
+template<typename Event,
+         typename LockType,
+         typename ConditionVarType,
+         typename Stats = NoQueueStats,
+         typename Latency = NoEventLatency>
+struct EventQueueT {
+    using EventType = Event;
+    static constexpr std::size_t Slots = 50;
+    using LatencyTracker = typename Latency::template tracker<Event, Slots>;
+
+    virtual ~EventQueueT() { stop(); }
 
-template<typename HsmType, typename Events>
-class ThreadedExecutionPolicy : public HsmType {
   public:
-    using Event = tuple_to_variant_t<Events>;
-    // using EventQueue = FreeRTOSEventQueue<Event>; // Adapted for FreeRTOS
-    using TaskCallback = void (*)(ThreadedExecutionPolicy*);
+    // Block until you get an event
+    Event next_event() {
+        std::unique_lock<LockType> lock(eventQueueMutex_, std::defer_lock);
+        stats_.lock(lock);
+        bool slept = false;
+        cvEventAvailable_.wait(lock, [this, &slept] {
+            if (slept) {
+                stats_.woke_up();
+            }
+            slept = true;
+            return (!this->empty() || this->interrupt_);
+        });
+        if (interrupt_) {
+            return Event();
+        }
+        latency_.dequeued(pop_index_, front().index());
+        const Event e = std::move(front());
+        pop_front();
+        stats_.dequeued();
+        return e;
+    }
 
-    ThreadedExecutionPolicy()
-      : taskCallback(ThreadedExecutionPolicy::StepTask) {
-        interrupt_ = pdFALSE;
-        xTaskCreate(reinterpret_cast<TaskFunction_t>(taskCallback),
-                    "ThreadedPolicyTask",
-                    configMINIMAL_STACK_SIZE,
-                    this,
-                    tskIDLE_PRIORITY,
-                    &smTaskHandle);
+    // Returns the event's sequence number - the n-th event queued is the n-th
+    // event next_event() returns - or 0 if the queue is full or stopped
+    std::uint64_t add_event(Event&& e) {
+        if (interrupt_) {
+            stats_.dropped();
+            return 0;
+        }
+        // stamped before locking, so time waiting for the lock counts as
+        // queueing time
+        auto sent = latency_.now();
+        std::unique_lock<LockType> lock(eventQueueMutex_, std::defer_lock);
+        stats_.lock(lock);
+        std::size_t slot = push_index_;
+        if (!push_back(std::forward<Event>(e))) {
+            stats_.dropped();
+            return 0;
+        }
+        latency_.enqueued(slot, sent);
+        stats_.enqueued(size());
+        cvEventAvailable_.notify_all();
+        return ++pushed_;
     }
 
-    virtual ~ThreadedExecutionPolicy() {
-        interrupt_ = pdTRUE;
-        // Proper FreeRTOS task deletion if needed, ensuring clean-up.
-        if (smTaskHandle != nullptr) {
-            vTaskDelete(smTaskHandle);
-            smTaskHandle = nullptr;
+    void stop() {
+        interrupt_ = true;
+        cvEventAvailable_.notify_all();
+        // Log the events that are going to get dumped if the queue is not
+        // empty
+    }
+
+    // Take the next event if there is one, without blocking
+    bool try_next_event(Event& e) {
+        std::unique_lock<LockType> lock(eventQueueMutex_, std::defer_lock);
+        stats_.lock(lock);
+        if (interrupt_ || empty()) {
+            return false;
         }
+        latency_.dequeued(pop_index_, data_[pop_index_].index());
+        e = std::move(data_[pop_index_]);
+        pop_front();
+        stats_.dequeued();
+        return true;
     }
 
-    void send_event(const Event& event) { eventQueue.add_event(event); }
+    // The consumer finished handling the event it took last
+    void done() { latency_.done(); }
+
+    // Per event type latency histograms; only with EventLatency
+    template<typename E>
+    LatencyHistogram const& queued_latency() const
+        requires Latency::enabled
+    {
+        return latency_.queued_[tuple_index_v<E, Event>];
+    }
+
+    template<typename E>
+    LatencyHistogram const& handling_latency() const
+        requires Latency::enabled
+    {
+        return latency_.handling_[tuple_index_v<E, Event>];
+    }
+
+    bool interrupted() { return interrupt_; }
+
+    // Lock-free read of the queue's counters; only with QueueStats
+    QueueStatsSnapshot stats() const
+        requires Stats::enabled
+    {
+        return stats_.snapshot();
+    }
 
   protected:
-    TaskCallback taskCallback{};
-    TaskHandle_t smTaskHandle{};
-    EventQueue eventQueue;
-    BaseType_t interrupt_;
+    bool empty() { return push_index_ == pop_index_; }
 
-    static void StepTask(void* pvParameters) {
-        auto* policy = static_cast<ThreadedExecutionPolicy*>(pvParameters);
-        policy->step();
+    std::size_t size() {
+        return (push_index_ + data_.size() - pop_index_) % data_.size();
     }
 
-    void step() {
-        while (!interrupt_) {
-            processEvent();
+    Event const& front() { return data_[pop_index_]; }
+
+    void pop_front() {
+        if (!empty()) {
+            pop_index_ = (pop_index_ + 1) % data_.size();
+        }
+    }
+
+    bool push_back(Event const& e) {
+        if ((push_index_ + 1) % data_.size() != pop_index_) {
+            data_[push_index_] = e;
+            push_index_ = (push_index_ + 1) % data_.size();
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    LockType eventQueueMutex_;
+    ConditionVarType cvEventAvailable_;
+    bool interrupt_{};
+    size_t push_index_{ 0 };
+    size_t pop_index_{ 0 };
+    std::uint64_t pushed_{ 0 };
+    std::array<Event, Slots> data_;
+    [[no_unique_address]] Stats stats_;
+    [[no_unique_address]] LatencyTracker latency_;
+};
+
+// Lock-free single producer, single consumer ring. Capacity must be a power
+// of two. Neither side ever blocks: try_push fails when the ring is full and
+// try_pop fails when it is empty.
+template<typename T, std::size_t Capacity>
+struct SpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "SpscRing capacity must be a power of two");
+
+    bool try_push(T const& value) {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_cache_ == Capacity) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head - tail_cache_ == Capacity) {
+                return false;
+            }
+        }
+        slots_[head & (Capacity - 1)] = value;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_cache_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail == head_cache_) {
+                return false;
+            }
+        }
+        value = slots_[tail & (Capacity - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called concurrently with push or pop
+    std::size_t size() const {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+  private:
+    // producer side
+    alignas(CacheLineSize) std::atomic<std::size_t> head_{};
+    std::size_t tail_cache_{};
+    // consumer side
+    alignas(CacheLineSize) std::atomic<std::size_t> tail_{};
+    std::size_t head_cache_{};
+    alignas(CacheLineSize) std::array<T, Capacity> slots_{};
+};
+
+// SpscRing with a blocking consumer. The producer only signals when the
+// consumer is asleep, so a busy pipeline hands events over without system
+// calls.
+template<typename T, std::size_t Capacity>
+struct SpscChannel {
+    using value_type = T;
+
+    bool try_push(T const& value) {
+        if (!ring_.try_push(value)) {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            signal_.fetch_add(1, std::memory_order_release);
+            signal_.notify_one();
+        }
+        return true;
+    }
+
+    // Block until there is something to pop. Returns false once stopped.
+    bool wait() {
+        for (;;) {
+            if (stopped_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (!ring_.empty()) {
+                return true;
+            }
+            auto signal = signal_.load(std::memory_order_acquire);
+            sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring_.empty() && !stopped_.load(std::memory_order_acquire)) {
+                signal_.wait(signal, std::memory_order_acquire);
+            }
+            sleeping_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Pop up to max values and pass each to f. Returns how many were popped.
+    template<typename F>
+    std::size_t drain(std::size_t max, F&& f) {
+        std::size_t n = 0;
+        while (n < max && ring_.try_pop(value_)) {
+            f(value_);
+            ++n;
+        }
+        return n;
+    }
+
+    void stop() {
+        stopped_.store(true, std::memory_order_release);
+        signal_.fetch_add(1, std::memory_order_release);
+        signal_.notify_all();
+    }
+
+    // Let wait() block again after stop(). Only while nobody waits.
+    void restart() { stopped_.store(false, std::memory_order_release); }
+
+    std::size_t size() const { return ring_.size(); }
+    static constexpr std::size_t capacity() { return Capacity; }
+
+  private:
+    SpscRing<T, Capacity> ring_;
+    alignas(CacheLineSize) std::atomic<std::uint32_t> signal_{};
+    std::atomic<bool> sleeping_{};
+    std::atomic<bool> stopped_{};
+    // consumer side scratch, reused so drain() does not construct a T
+    alignas(CacheLineSize) T value_{};
+};
+
+// Disruptor style broadcast ring. Producers claim a sequence number, write the
+// event into its slot once and publish it; each of the Consumers reads every
+// slot in place through its own cursor. A producer waits while the slowest
+// consumer is a full ring behind, so no event is dropped and no consumer ever
+// sees a copy. Capacity must be a power of two.
+template<typename T, std::size_t Capacity, std::size_t Consumers>
+struct MulticastRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "MulticastRing capacity must be a power of two");
+    static constexpr std::size_t Mask = Capacity - 1;
+
+    // Write value into the next slot. Safe to call from several threads.
+    // Returns false if the ring is stopped.
+    template<typename U>
+    bool publish(U&& value) {
+        if (stopped_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        auto seq = claim_.fetch_add(1, std::memory_order_relaxed);
+        while (seq - gate_.load(std::memory_order_acquire) >= Capacity) {
+            if (stopped_.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            if (seq - update_gate() >= Capacity) {
+                std::this_thread::yield();
+            }
+        }
+        auto& slot = slots_[seq & Mask];
+        slot.value = std::forward<U>(value);
+        slot.sequence.store(seq + 1, std::memory_order_release);
+        wake_.fetch_add(1, std::memory_order_release);
+        wake_.notify_all();
+        return true;
+    }
+
+    // Block until the slot at the consumer's cursor is published and return
+    // it. Returns nullptr once the ring is stopped and the consumer has
+    // caught up with everything published before.
+    T const* next(std::size_t consumer) {
+        auto cursor = cursors_[consumer].value.load(std::memory_order_relaxed);
+        auto& slot = slots_[cursor & Mask];
+        for (;;) {
+            auto wake = wake_.load(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_acquire) == cursor + 1) {
+                return &slot.value;
+            }
+            if (stopped_.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            wake_.wait(wake, std::memory_order_acquire);
+        }
+    }
+
+    // Release the slot returned by next() back to the producers
+    void release(std::size_t consumer) {
+        cursors_[consumer].value.fetch_add(1, std::memory_order_release);
+    }
+
+    void stop() {
+        stopped_.store(true, std::memory_order_release);
+        wake_.fetch_add(1, std::memory_order_release);
+        wake_.notify_all();
+    }
+
+    // Events claimed but not yet consumed by the slowest consumer
+    std::size_t lag() const {
+        return claim_.load(std::memory_order_acquire) - min_cursor();
+    }
+
+    static constexpr std::size_t capacity() { return Capacity; }
+
+  private:
+    std::size_t min_cursor() const {
+        auto min = cursors_[0].value.load(std::memory_order_acquire);
+        for (std::size_t i = 1; i < Consumers; ++i) {
+            min = std::min(min,
+                           cursors_[i].value.load(std::memory_order_acquire));
         }
+        return min;
+    }
+
+    // The gate caches the slowest cursor so producers only scan the cursors
+    // when the ring looks full
+    std::size_t update_gate() {
+        auto min = min_cursor();
+        gate_.store(min, std::memory_order_release);
+        return min;
+    }
+
+    struct Slot {
+        std::atomic<std::size_t> sequence{};
+        T value{};
+    };
+
+    struct alignas(CacheLineSize) Cursor {
+        std::atomic<std::size_t> value{};
+    };
+
+    // producer side
+    alignas(CacheLineSize) std::atomic<std::size_t> claim_{};
+    std::atomic<std::size_t> gate_{};
+    alignas(CacheLineSize) std::atomic<std::uint32_t> wake_{};
+    std::atomic<bool> stopped_{};
+    std::array<Cursor, Consumers> cursors_{};
+    alignas(CacheLineSize) std::array<Slot, Capacity> slots_{};
+};
+
+#ifdef __FREE_RTOS__
+inline constexpr int MaxEvents = 10; // Define your own queue size
+
+class FreeRTOSMutex {
+  public:
+    FreeRTOSMutex() {
+        // Create the FreeRTOS mutex
+        this->mutex = xSemaphoreCreateMutex();
+    }
+
+    ~FreeRTOSMutex() {
+        // Delete the FreeRTOS mutex
+        vSemaphoreDelete(this->mutex);
+    }
+
+    void lock() {
+        // Wait forever for the mutex to become available
+        xSemaphoreTake(this->mutex, portMAX_DELAY);
+    }
+
+    bool try_lock() {
+        // Try to take the mutex without blocking
+        return xSemaphoreTake(this->mutex, 0) == pdTRUE;
+    }
+
+    void unlock() {
+        // Release the mutex
+        xSemaphoreGive(this->mutex);
+    }
+
+    // Return the native handle of the mutex
+    SemaphoreHandle_t native_handle() { return this->mutex; }
+
+  private:
+    SemaphoreHandle_t mutex;
+};
+
+class FreeRTOSConditionVariable {
+  public:
+    FreeRTOSConditionVariable()
+      : semaphore_(xSemaphoreCreateBinary())
+      , waitersCount_(0) {
+        // Ensure the semaphore is in a non-signalled state initially.
+        xSemaphoreTake(semaphore_, 0);
+    }
+
+    ~FreeRTOSConditionVariable() { vSemaphoreDelete(semaphore_); }
+
+    template<typename Lock>
+    void wait(Lock& lock) {
+        // Increment the count of waiters.
+        UBaseType_t oldISRState = taskENTER_CRITICAL_FROM_ISR();
+        ++waitersCount_;
+        taskEXIT_CRITICAL_FROM_ISR(oldISRState);
+
+        // Unlock the external mutex and wait for notification.
+        lock.unlock();
+        xSemaphoreTake(semaphore_, portMAX_DELAY);
+
+        // Decrement the count of waiters.
+        oldISRState = taskENTER_CRITICAL_FROM_ISR();
+        --waitersCount_;
+        taskEXIT_CRITICAL_FROM_ISR(oldISRState);
+
+        // Re-acquire the mutex before exiting.
+        lock.lock();
+    }
+
+    void notify_one() {
+        if (waitersCount_ > 0) {        // Check if there are any waiters.
+            xSemaphoreGive(semaphore_); // Wake up one waiter.
+        }
+    }
+
+    void notify_all() {
+        while (waitersCount_ > 0) { // Keep waking all waiters.
+            xSemaphoreGive(semaphore_);
+            // Small delay to allow other tasks to respond to the semaphore.
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+
+  private:
+    SemaphoreHandle_t semaphore_;
+    volatile UBaseType_t waitersCount_;
+};
+
+// C++ 11 compatible clock with FreeRTOS tick count.
+struct FreeRTOSClock {
+    using duration = std::chrono::milliseconds;
+    using period = duration::period;
+    using rep = duration::rep;
+    using time_point = std::chrono::time_point<FreeRTOSClock>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept {
+        TickType_t ticks = xTaskGetTickCount();
+        // Convert ticks to milliseconds (note: configTICK_RATE_HZ is the number
+        // of ticks per second)
+        auto durationSinceEpoch =
+          std::chrono::milliseconds(ticks * (1000 / configTICK_RATE_HZ));
+        return time_point(duration(durationSinceEpoch));
+    }
+};
+
+template<typename Event,
+         typename Stats = NoQueueStats,
+         typename Latency = NoEventLatency>
+using EventQueue = EventQueueT<Event,
+                               FreeRTOSMutex,
+                               FreeRTOSConditionVariable,
+                               Stats,
+                               Latency>;
+
+template<typename Event,
+         typename Stats = NoQueueStats,
+         typename Latency = NoEventLatency>
+using ConstinitEventQueue = EventQueue<Event, Stats, Latency>;
+
+template<typename HsmType, typename Events>
+class ThreadedExecutionPolicy : public HsmType {
+  public:
+    using Event = tuple_to_variant_t<Events>;
+    // using EventQueue = FreeRTOSEventQueue<Event>; // Adapted for FreeRTOS
+    using TaskCallback = void (*)(ThreadedExecutionPolicy*);
+
+    ThreadedExecutionPolicy()
+      : taskCallback(ThreadedExecutionPolicy::StepTask) {
+        interrupt_ = pdFALSE;
+        xTaskCreate(reinterpret_cast<TaskFunction_t>(taskCallback),
+                    "ThreadedPolicyTask",
+                    configMINIMAL_STACK_SIZE,
+                    this,
+                    tskIDLE_PRIORITY,
+                    &smTaskHandle);
+    }
+
+    virtual ~ThreadedExecutionPolicy() {
+        interrupt_ = pdTRUE;
+        // Proper FreeRTOS task deletion if needed, ensuring clean-up.
+        if (smTaskHandle != nullptr) {
+            vTaskDelete(smTaskHandle);
+            smTaskHandle = nullptr;
+        }
+    }
+
+    void send_event(const Event& event) { eventQueue.add_event(event); }
+
+  protected:
+    TaskCallback taskCallback{};
+    TaskHandle_t smTaskHandle{};
+    EventQueue eventQueue;
+    BaseType_t interrupt_;
+
+    static void StepTask(void* pvParameters) {
+        auto* policy = static_cast<ThreadedExecutionPolicy*>(pvParameters);
+        policy->step();
+    }
+
+    void step() {
+        while (!interrupt_) {
+            processEvent();
+        }
+    }
+
+    void process_event() {
+        Event const& nextEvent = eventQueue.next_event();
+        if (!eventQueue.interrupted()) {
+            std::visit([this](auto const& e) { return this->handle(e); },
+                       nextEvent);
+        }
+    }
+};
+
+#else // __FREE_RTOS__ is not defined
+
+template<typename Event,
+         typename Stats = NoQueueStats,
+         typename Latency = NoEventLatency>
+using EventQueue = EventQueueT<Event,
+                               std::mutex,
+                               std::condition_variable_any,
+                               Stats,
+                               Latency>;
+
+// Condition variable with a constexpr constructor, so a queue holding one can
+// be constant-initialized. Waiters sleep on a generation counter that every
+// notify bumps. The counter is read under the caller's lock, so a notify that
+// follows a state change made under the same lock is never missed.
+struct AtomicConditionVariable {
+    constexpr AtomicConditionVariable() = default;
+
+    template<typename Lock, typename Predicate>
+    void wait(Lock& lock, Predicate pred) {
+        while (!pred()) {
+            auto seen = generation_.load(std::memory_order_acquire);
+            lock.unlock();
+            generation_.wait(seen, std::memory_order_acquire);
+            lock.lock();
+        }
+    }
+
+    void notify_one() {
+        generation_.fetch_add(1, std::memory_order_release);
+        generation_.notify_one();
+    }
+
+    void notify_all() {
+        generation_.fetch_add(1, std::memory_order_release);
+        generation_.notify_all();
+    }
+
+  private:
+    std::atomic<std::uint32_t> generation_{ 0 };
+};
+
+// Event queue that can live in a constinit machine
+template<typename Event,
+         typename Stats = NoQueueStats,
+         typename Latency = NoEventLatency>
+using ConstinitEventQueue =
+  EventQueueT<Event, std::mutex, AtomicConditionVariable, Stats, Latency>;
+
+// C++ 11 compatible accurate clock (nanosecond precision). This is a drop-in
+// replacement for Clock types in std::chrono
+struct AccurateClock {
+    using duration = std::chrono::nanoseconds;
+    using period = duration::period;
+    using rep = duration::rep;
+    using time_point = std::chrono::time_point<AccurateClock>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        auto durationSinceEpoch = std::chrono::seconds(ts.tv_sec) +
+                                  std::chrono::nanoseconds(ts.tv_nsec);
+        return time_point(duration(durationSinceEpoch));
+    }
+};
+
+// Clock that only moves when told to, for simulating periodic machines in
+// fast-forward. Time is shared by every user of the same Tag, so independent
+// simulations use their own tags. Timers built on it block on the clock
+// instead of sleeping.
+template<typename Tag = void>
+struct VirtualClock {
+    using duration = std::chrono::nanoseconds;
+    using period = duration::period;
+    using rep = duration::rep;
+    using time_point = std::chrono::time_point<VirtualClock>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept {
+        return time_point(duration(now_.load(std::memory_order_acquire)));
+    }
+
+    static void advance(duration d) {
+        now_.fetch_add(d.count(), std::memory_order_acq_rel);
+        wake();
+    }
+
+    // Block until now() reaches t or wake() is called. Callers re-check.
+    static void wait_until(time_point t) {
+        auto seen = epoch_.load(std::memory_order_acquire);
+        if (now() < t) {
+            epoch_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    static void wake() {
+        epoch_.fetch_add(1, std::memory_order_release);
+        epoch_.notify_all();
+    }
+
+  private:
+    static inline std::atomic<rep> now_{};
+    static inline std::atomic<std::uint32_t> epoch_{};
+};
+
+template<typename T>
+struct is_virtual_clock : std::false_type {};
+
+template<typename Tag>
+struct is_virtual_clock<VirtualClock<Tag>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool is_virtual_clock_v = is_virtual_clock<T>::value;
+
+
+// Where a machine's thread runs and where its memory lives. An empty CPU set
+// leaves the thread unpinned. `node` selects a NUMA node for memory; -1 means
+// memory follows the pinned CPUs through first touch.
+struct ThreadPlacement {
+    static constexpr std::size_t MaxCpus = 1024;
+
+    std::bitset<MaxCpus> cpus;
+    int node{ -1 };
+
+    ThreadPlacement() = default;
+    ThreadPlacement(std::initializer_list<int> cpu_list) {
+        for (auto cpu : cpu_list) {
+            cpus.set(static_cast<std::size_t>(cpu));
+        }
+    }
+
+    bool pinned() const { return cpus.any(); }
+
+#ifdef __linux__
+    // All CPUs of a NUMA node; memory is bound to the node
+    static ThreadPlacement on_node(int node) {
+        ThreadPlacement placement;
+        placement.node = node;
+        char path[64];
+        std::snprintf(
+          path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        read_cpu_list(path, placement.cpus);
+        return placement;
+    }
+
+    // Number of NUMA nodes, 1 on machines without NUMA support
+    static int node_count() {
+        std::bitset<MaxCpus> nodes;
+        read_cpu_list("/sys/devices/system/node/online", nodes);
+        return nodes.any() ? static_cast<int>(nodes.count()) : 1;
+    }
+
+    // NUMA node of a CPU, 0 if unknown
+    static int node_of_cpu(int cpu) {
+        for (int node = 0; node < node_count(); ++node) {
+            if (on_node(node).cpus.test(static_cast<std::size_t>(cpu))) {
+                return node;
+            }
+        }
+        return 0;
+    }
+
+    // Node memory should be placed on: the explicit node, else the node of the
+    // first pinned CPU, else -1
+    int memory_node() const {
+        if (node >= 0 || !pinned()) {
+            return node;
+        }
+        for (std::size_t cpu = 0; cpu < MaxCpus; ++cpu) {
+            if (cpus.test(cpu)) {
+                return node_of_cpu(static_cast<int>(cpu));
+            }
+        }
+        return -1;
+    }
+
+    // Pin the calling thread. Returns false and sets errno on failure.
+    bool apply() const { return apply(pthread_self()); }
+
+    // Pin another thread, e.g. one just started
+    bool apply(std::thread& thread) const {
+        return apply(thread.native_handle());
+    }
+
+    bool apply(pthread_t thread) const {
+        if (!pinned()) {
+            return true;
+        }
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (std::size_t cpu = 0; cpu < MaxCpus && cpu < CPU_SETSIZE; ++cpu) {
+            if (cpus.test(cpu)) {
+                CPU_SET(cpu, &cpuset);
+            }
+        }
+        int err = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+        if (err != 0) {
+            errno = err;
+            return false;
+        }
+        return true;
+    }
+
+    // Bind whole pages in [addr, addr + len) to the memory node and move
+    // pages already touched elsewhere. Returns false and sets errno if the
+    // kernel has no NUMA support or the node is invalid.
+    bool bind_memory(void* addr, std::size_t len) const {
+        int target = memory_node();
+        if (target < 0) {
+            return true;
+        }
+        constexpr int MPOL_BIND_ = 2;
+        constexpr unsigned MPOL_MF_MOVE_ = 1U << 1;
+        constexpr std::size_t bits = 8 * sizeof(unsigned long);
+        std::array<unsigned long, MaxCpus / bits> mask{};
+        mask[static_cast<std::size_t>(target) / bits] |=
+          1UL << (static_cast<std::size_t>(target) % bits);
+        auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+        auto begin = reinterpret_cast<std::uintptr_t>(addr) & ~(page - 1);
+        auto end = reinterpret_cast<std::uintptr_t>(addr) + len;
+        return syscall(SYS_mbind,
+                       begin,
+                       end - begin,
+                       MPOL_BIND_,
+                       mask.data(),
+                       MaxCpus,
+                       MPOL_MF_MOVE_) == 0;
+    }
+
+  private:
+    // Parse the kernel's list format, e.g. "0-3,8,10-11"
+    static void read_cpu_list(char const* path, std::bitset<MaxCpus>& out) {
+        FILE* file = std::fopen(path, "r");
+        if (file == nullptr) {
+            return;
+        }
+        unsigned first = 0;
+        unsigned last = 0;
+        char sep = 0;
+        while (std::fscanf(file, "%u", &first) == 1) {
+            last = first;
+            if (std::fscanf(file, "%c", &sep) == 1 && sep == '-') {
+                if (std::fscanf(file, "%u", &last) != 1) {
+                    break;
+                }
+                std::fscanf(file, "%c", &sep);
+            }
+            for (auto i = first; i <= last && i < MaxCpus; ++i) {
+                out.set(i);
+            }
+            if (sep != ',') {
+                break;
+            }
+        }
+        std::fclose(file);
+    }
+#else
+    bool apply() const { return !pinned(); }
+    bool apply(std::thread&) const { return !pinned(); }
+    bool bind_memory(void*, std::size_t) const { return node < 0; }
+#endif // __linux__
+};
+
+#ifdef __linux__
+template<typename T>
+struct PlacedDeleter {
+    void operator()(T* t) const {
+        t->~T();
+        munmap(t, size);
+    }
+    std::size_t size;
+};
+
+template<typename T>
+using placed_ptr = std::unique_ptr<T, PlacedDeleter<T>>;
+
+// Allocate a machine - its state, queue and context - on the placement's
+// NUMA node. The pages are bound with mbind where the kernel supports it and
+// are always first touched by a thread pinned to the placement, so memory
+// lands on the right node either way. Returns nullptr and sets errno if
+// mapping or pinning fails. Start the machine with the same placement.
+template<typename T, typename... Args>
+placed_ptr<T>
+place(ThreadPlacement const& placement, Args&&... args) {
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t size = (sizeof(T) + page - 1) / page * page;
+    void* mem = mmap(nullptr,
+                     size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    // best effort: first touch below still places the pages
+    placement.bind_memory(mem, size);
+
+    T* t = nullptr;
+    int err = 0;
+    std::thread([&] {
+        if (!placement.apply()) {
+            err = errno;
+            return;
+        }
+        std::memset(mem, 0, size);
+        t = new (mem) T(std::forward<Args>(args)...);
+    }).join();
+    if (t == nullptr) {
+        munmap(mem, size);
+        errno = err;
+        return nullptr;
+    }
+    return placed_ptr<T>(t, PlacedDeleter<T>{ size });
+}
+#endif // __linux__
+
+// Monotonic arena over one preallocated region. Allocation bumps an offset
+// and deallocation is a no-op, so machines, observers and event payloads
+// allocated from it never call into the system allocator after start-up.
+// Allocation is lock-free and may be used from several threads. Use it as
+// the upstream of std::pmr::unsynchronized_pool_resource or
+// synchronized_pool_resource when memory has to be reused.
+struct ArenaResource : std::pmr::memory_resource {
+    enum class Pages { Normal, Huge };
+
+    ArenaResource() = default;
+    ArenaResource(std::size_t capacity, Pages pages = Pages::Normal) {
+        reserve(capacity, pages);
+    }
+    ArenaResource(ArenaResource const&) = delete;
+    ArenaResource& operator=(ArenaResource const&) = delete;
+    ~ArenaResource() override { free_region(); }
+
+    // Map and prefault the region. Huge pages fall back to transparent huge
+    // pages, then to normal pages. Returns false and sets errno on failure.
+    bool reserve(std::size_t capacity, Pages pages = Pages::Normal) {
+        free_region();
+#ifdef __linux__
+        constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+        void* mem = MAP_FAILED;
+        if (pages == Pages::Huge) {
+            capacity =
+              (capacity + HugePageSize - 1) / HugePageSize * HugePageSize;
+            mem = mmap(nullptr,
+                       capacity,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                       -1,
+                       0);
+            huge_pages_ = mem != MAP_FAILED;
+        }
+        if (mem == MAP_FAILED) {
+            mem = mmap(nullptr,
+                       capacity,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+            if (mem == MAP_FAILED) {
+                return false;
+            }
+            if (pages == Pages::Huge) {
+                madvise(mem, capacity, MADV_HUGEPAGE);
+            }
+        }
+        base_ = static_cast<std::byte*>(mem);
+#else
+        (void)pages;
+        base_ = static_cast<std::byte*>(
+          ::operator new(capacity, std::align_val_t{ CacheLineSize },
+                         std::nothrow));
+        if (base_ == nullptr) {
+            errno = ENOMEM;
+            return false;
+        }
+#endif
+        capacity_ = capacity;
+        // fault every page in now rather than on the event path
+        std::memset(base_, 0, capacity_);
+        return true;
+    }
+
+    // Forget every allocation. Only safe once nothing uses the memory.
+    void release() { offset_.store(0, std::memory_order_relaxed); }
+
+    std::size_t used() const {
+        return std::min(offset_.load(std::memory_order_relaxed), capacity_);
+    }
+    std::size_t capacity() const { return capacity_; }
+    bool huge_pages() const { return huge_pages_; }
+
+  private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        auto offset = offset_.load(std::memory_order_relaxed);
+        std::size_t begin = 0;
+        do {
+            auto address = reinterpret_cast<std::uintptr_t>(base_) + offset;
+            begin = offset + (alignment - address % alignment) % alignment;
+            if (base_ == nullptr || begin + bytes > capacity_) {
+                throw std::bad_alloc();
+            }
+        } while (!offset_.compare_exchange_weak(
+          offset, begin + bytes, std::memory_order_relaxed));
+        return base_ + begin;
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(
+      std::pmr::memory_resource const& other) const noexcept override {
+        return this == &other;
+    }
+
+    void free_region() {
+        if (base_ == nullptr) {
+            return;
+        }
+#ifdef __linux__
+        munmap(base_, capacity_);
+#else
+        ::operator delete(base_, std::align_val_t{ CacheLineSize });
+#endif
+        base_ = nullptr;
+        capacity_ = 0;
+        huge_pages_ = false;
+        release();
+    }
+
+    std::byte* base_{};
+    std::size_t capacity_{};
+    bool huge_pages_{};
+    std::atomic<std::size_t> offset_{};
+};
+
+template<typename T>
+struct ResourceDeleter {
+    void operator()(T* t) const {
+        t->~T();
+        resource->deallocate(t, sizeof(T), alignof(T));
+    }
+    std::pmr::memory_resource* resource;
+};
+
+template<typename T>
+using resource_ptr = std::unique_ptr<T, ResourceDeleter<T>>;
+
+// Construct a machine - context, states and event queue - in memory from
+// resource. Combined with std::pmr::set_default_resource this puts a whole
+// machine graph, including observers, in one arena. std::thread keeps using
+// the global allocator for its internal state.
+template<typename T, typename... Args>
+resource_ptr<T>
+make_in(std::pmr::memory_resource* resource, Args&&... args) {
+    void* mem = resource->allocate(sizeof(T), alignof(T));
+    return resource_ptr<T>(new (mem) T(std::forward<Args>(args)...),
+                           ResourceDeleter<T>{ resource });
+}
+
+#endif // __FREE_RTOS__
+
+// Single threaded execution policy
+template<typename Context, template<typename> class Policy = make_hsm_t>
+struct SingleThreadedExecutionPolicy : Policy<Context> {
+    using type = SingleThreadedExecutionPolicy<Context, Policy>;
+    using HsmType = typename Policy<Context>::type;
+    using Event = tuple_to_variant_t<get_events_t<HsmType>>;
+
+    bool step() {
+        // This is a blocking wait
+        Event const& nextEvent = eventQueue_.next_event();
+        // go down the Hsm hierarchy to handle the event as that is the
+        // "most active state"
+        return std::visit(
+          [this](auto&& e) -> bool { return HsmType::handle(e); }, nextEvent);
+    }
+
+    void send_event(Event&& event) {
+        eventQueue_.add_event(std::forward<Event>(event));
+    }
+
+    // Handle events the caller already holds, bypassing the queue. Must not
+    // race with step().
+    template<std::size_t MaxBatch = 64>
+    BatchResult<MaxBatch> handle_batch(std::span<Event> events) {
+        return detail::handle_batch<MaxBatch>(static_cast<HsmType&>(*this),
+                                              events);
+    }
+
+    // Counters of the event queue, for contexts that declare queue_stats
+    QueueStatsSnapshot queue_stats() const
+        requires has_queue_stats_v<Context>
+    {
+        return eventQueue_.stats();
+    }
+
+  private:
+    ConstinitEventQueue<Event, queue_stats_t<Context>> eventQueue_;
+    bool interrupt_{};
+};
+
+// Identifies one event sent to a threaded machine. Sequence 0 means the event
+// was never queued.
+struct CompletionToken {
+    std::uint64_t sequence{};
+
+    explicit operator bool() const { return sequence != 0; }
+};
+
+enum class EventResult {
+    Handled,      // a transition was taken
+    Rejected,     // no transition or a guard refused it
+    Dropped,      // the queue was full or stopped
+    Stopped,      // the machine stopped before handling it
+    Expired,      // handled too long ago for the result to be kept
+    WouldDeadlock // waited for on the machine's own thread; not sent
+};
+
+// Asynchronous execution policy
+template<typename Context, template<typename> class Policy = make_hsm_t>
+struct ThreadedExecutionPolicy : Policy<Context> {
+    using type = ThreadedExecutionPolicy<Context, Policy>;
+    using HsmType = typename Policy<Context>::type;
+    using Event = tuple_to_variant_t<get_events_t<HsmType>>;
+
+    void start() {
+        placement_error_ = {};
+        smThread_ = std::thread([this] { this->run_machine(); });
+        place_thread(smThread_);
+    }
+
+    // Takes effect on the next start()
+    void set_placement(ThreadPlacement const& placement) {
+        placement_ = placement;
+    }
+
+    // Why a thread of the machine could not be pinned to its placement,
+    // empty if they all were. Valid once start() has returned.
+    std::error_code placement_error() const { return placement_error_; }
+
+    void stop() {
+        eventQueue_.stop();
+        interrupt_ = true;
+        if (smThread_.joinable()) {
+            smThread_.join();
+        }
+        machine_thread_.store({}, std::memory_order_release);
+        // wake up anyone waiting for an event that will not be handled
+        completed_.fetch_or(StoppedBit, std::memory_order_release);
+        completed_.notify_all();
+    }
+
+    virtual ~ThreadedExecutionPolicy() { stop(); }
+
+    CompletionToken send_event(Event&& event) {
+        return { eventQueue_.add_event(std::forward<Event>(event)) };
+    }
+
+    // Has the event been handled (or will it never be)?
+    bool done(CompletionToken token) const {
+        auto completed = completed_.load(std::memory_order_acquire);
+        return !token || (completed & StoppedBit) != 0 ||
+               completed >= token.sequence;
+    }
+
+    // Block until the event has been handled
+    EventResult wait(CompletionToken token) const {
+        if (!token) {
+            return EventResult::Dropped;
+        }
+        auto completed = completed_.load(std::memory_order_acquire);
+        while ((completed & ~StoppedBit) < token.sequence) {
+            if ((completed & StoppedBit) != 0) {
+                return EventResult::Stopped;
+            }
+            completed_.wait(completed, std::memory_order_acquire);
+            completed = completed_.load(std::memory_order_acquire);
+        }
+        auto result = results_[token.sequence % ResultHistory].load(
+          std::memory_order_acquire);
+        // The slot is reused once the event ResultHistory - 1 later is done
+        completed = completed_.load(std::memory_order_acquire) & ~StoppedBit;
+        if (completed - token.sequence >= ResultHistory - 1) {
+            return EventResult::Expired;
+        }
+        return result ? EventResult::Handled : EventResult::Rejected;
+    }
+
+    // Send an event and wait for its result. The machine's own thread - an
+    // action, say - cannot wait for an event it has yet to handle, nor handle
+    // it in the middle of a transition, so it gets WouldDeadlock and the
+    // event is not sent. Use send_event() there instead.
+    EventResult send_and_wait(Event&& event) {
+        if (std::this_thread::get_id() ==
+            machine_thread_.load(std::memory_order_acquire)) {
+            return EventResult::WouldDeadlock;
+        }
+        return wait(send_event(std::forward<Event>(event)));
+    }
+
+    // Counters of the event queue, for contexts that declare queue_stats.
+    // Safe to call from any thread while the machine runs.
+    QueueStatsSnapshot queue_stats() const
+        requires has_queue_stats_v<Context>
+    {
+        return eventQueue_.stats();
+    }
+
+    // Time events of type E spent queued and being handled, for contexts
+    // that declare event_latency. Safe to read while the machine runs.
+    template<typename E>
+    LatencyHistogram const& queued_latency() const
+        requires has_event_latency_v<Context>
+    {
+        return eventQueue_.template queued_latency<E>();
+    }
+
+    template<typename E>
+    LatencyHistogram const& handling_latency() const
+        requires has_event_latency_v<Context>
+    {
+        return eventQueue_.template handling_latency<E>();
+    }
+
+    // Called on the machine thread with every event just before it is
+    // handled. Set before start().
+    using EventObserver = void (*)(void*, Event const&);
+    void observe_events(EventObserver observer, void* arg) {
+        observer_ = observer;
+        observer_arg_ = arg;
+    }
+
+  protected:
+    static constexpr std::uint64_t StoppedBit = 1ULL << 63;
+    // Results kept for this many of the most recent events
+    static constexpr std::size_t ResultHistory = 64;
+
+    std::thread smThread_;
+    EventQueue<Event, queue_stats_t<Context>, event_latency_t<Context>>
+      eventQueue_;
+    bool interrupt_{};
+    ThreadPlacement placement_;
+    std::error_code placement_error_;
+    // events taken off the queue and handled, in queue order
+    std::atomic<std::uint64_t> completed_{};
+    std::array<std::atomic<bool>, ResultHistory> results_{};
+    EventObserver observer_{};
+    void* observer_arg_{};
+    // id of the thread running the machine, while it runs
+    std::atomic<std::thread::id> machine_thread_{};
+
+    void enter_machine_thread() {
+        machine_thread_.store(std::this_thread::get_id(),
+                              std::memory_order_release);
+    }
+
+    // Body of the machine thread, whoever creates it
+    void run_machine() {
+        enter_machine_thread();
+        while (!interrupt_) {
+            process_event();
+        }
+    }
+
+    // A refused transition consumes its event, but the token reports
+    // Rejected
+    bool handle_event(Event const& event) {
+        return std::visit(
+          [this](auto const& e) { return handle_taken(*this, e); }, event);
+    }
+
+    void complete(bool handled) {
+        eventQueue_.done();
+        auto sequence = (completed_.load(std::memory_order_relaxed) &
+                         ~StoppedBit) +
+                        1;
+        results_[sequence % ResultHistory].store(handled,
+                                                 std::memory_order_release);
+        completed_.store(sequence, std::memory_order_release);
+        completed_.notify_all();
+    }
+
+    // Queue an event, waiting for room instead of dropping it, and wait
+    // until the machine has handled it. Gives up once the machine stops.
+    EventResult deliver(Event const& event) {
+        CompletionToken token;
+        while (!(token = send_event(Event(event))) && !interrupt_) {
+            std::this_thread::yield();
+        }
+        return wait(token);
+    }
+
+    // Pin one of the machine's threads; the first failure is kept
+    void place_thread(std::thread& thread) {
+        if (!placement_.apply(thread) && !placement_error_) {
+            placement_error_ = { errno, std::system_category() };
+        }
+    }
+
+    void process_event() {
+        // This is a blocking wait
+        Event const& nextEvent = eventQueue_.next_event();
+        if (!eventQueue_.interrupted()) {
+            if (observer_ != nullptr) {
+                observer_(observer_arg_, nextEvent);
+            }
+            complete(handle_event(nextEvent));
+        }
+    }
+};
+
+// Runs one job at a time on a dedicated thread. The caller posts a job and
+// later joins it. Both sides block on atomic wait/notify, so an idle worker
+// costs nothing and no allocation or lock is involved.
+struct RegionWorker {
+    using Job = void (*)(void*);
+
+    RegionWorker()
+      : thread_([this] { this->run(); }) {}
+    RegionWorker(RegionWorker const&) = delete;
+    RegionWorker& operator=(RegionWorker const&) = delete;
+
+    ~RegionWorker() {
+        stop_ = true;
+        post(nullptr, nullptr);
+        thread_.join();
+    }
+
+    void post(Job job, void* arg) {
+        job_ = job;
+        arg_ = arg;
+        posted_.fetch_add(1, std::memory_order_release);
+        posted_.notify_one();
+    }
+
+    void join() {
+        auto target = posted_.load(std::memory_order_relaxed);
+        auto done = done_.load(std::memory_order_acquire);
+        while (done != target) {
+            done_.wait(done, std::memory_order_acquire);
+            done = done_.load(std::memory_order_acquire);
+        }
+    }
+
+  private:
+    void run() {
+        std::uint32_t seen = 0;
+        for (;;) {
+            posted_.wait(seen, std::memory_order_acquire);
+            seen = posted_.load(std::memory_order_acquire);
+            if (stop_) {
+                return;
+            }
+            job_(arg_);
+            done_.store(seen, std::memory_order_release);
+            done_.notify_one();
+        }
+    }
+
+    Job job_{};
+    void* arg_{};
+    std::atomic<bool> stop_{};
+    std::atomic<std::uint32_t> posted_{};
+    std::atomic<std::uint32_t> done_{};
+    std::thread thread_;
+};
+
+// Trait for regions that should run on their own worker thread
+template<typename T, typename = void>
+struct is_parallel_region : std::false_type {};
+
+template<typename T>
+struct is_parallel_region<T, std::void_t<decltype(T::parallel_region)>>
+  : std::bool_constant<T::parallel_region> {};
+
+template<typename T>
+inline constexpr bool is_parallel_region_v = is_parallel_region<T>::value;
+
+// Orthogonal regions where heavy regions - those whose context declares
+// `static constexpr bool parallel_region = true` - handle each event on their
+// own worker thread while the remaining regions run on the caller's thread.
+// All workers are joined before handle() returns. Every parallel region
+// handles a private copy of the event, taken on the caller's thread before any
+// inline region runs, so the outcome does not depend on scheduling.
+template<typename... Hsms>
+struct ParallelOrthogonalExecutionPolicy : OrthogonalExecutionPolicy<Hsms...> {
+    using type = ParallelOrthogonalExecutionPolicy<Hsms...>;
+    using Base = OrthogonalExecutionPolicy<Hsms...>;
+    using typename Base::RegionResults;
+    using Base::hsms_;
+    static constexpr std::size_t parallel_count =
+      (std::size_t{ 0 } + ... + is_parallel_region_v<Hsms>);
+
+    template<typename Event>
+    bool handle(Event e = Event()) {
+        constexpr RegionResults relevant =
+          Base::template relevant_regions<Event>();
+        return relevant.any() && handle_regions(e) == relevant;
+    }
+
+    template<typename Event>
+    RegionResults handle_regions(Event& e) {
+        std::array<Job<Event>, sizeof...(Hsms)> jobs{};
+        RegionResults handled;
+        [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+            (post_region<Is>(e, jobs[Is]), ...);
+            (handle_inline<Is>(e, handled), ...);
+            (join_region<Is>(jobs[Is], handled), ...);
+        }(std::index_sequence_for<Hsms...>{});
+        return handled;
+    }
+
+  private:
+    template<typename Event>
+    struct Job {
+        void* region;
+        Event event;
+        bool handled;
+    };
+
+    template<std::size_t I>
+    using region_t = std::tuple_element_t<I, std::tuple<Hsms...>>;
+
+    template<std::size_t I, typename Event>
+    static constexpr bool runs_in_parallel =
+      is_parallel_region_v<region_t<I>> && region_accepts_v<Event, region_t<I>>;
+
+    // Worker slot of region I
+    template<std::size_t I>
+    static constexpr std::size_t worker_index() {
+        return []<std::size_t... Js>(std::index_sequence<Js...>) {
+            return (std::size_t{ 0 } + ... +
+                    is_parallel_region_v<region_t<Js>>);
+        }(std::make_index_sequence<I>{});
+    }
+
+    template<std::size_t I, typename Event>
+    static void run_region(void* arg) {
+        auto* job = static_cast<Job<Event>*>(arg);
+        job->handled =
+          static_cast<region_t<I>*>(job->region)->handle(job->event);
+    }
+
+    template<std::size_t I, typename Event>
+    void handle_inline(Event& e, RegionResults& handled) {
+        if constexpr (!is_parallel_region_v<region_t<I>>) {
+            Base::template handle_region<I>(e, handled);
+        }
+    }
+
+    template<std::size_t I, typename Event>
+    void post_region(Event const& e, Job<Event>& job) {
+        if constexpr (runs_in_parallel<I, Event>) {
+            job = { &std::get<I>(hsms_), e, false };
+            workers_[worker_index<I>()].post(&run_region<I, Event>, &job);
+        }
+    }
+
+    template<std::size_t I, typename Event>
+    void join_region(Job<Event>& job, RegionResults& handled) {
+        if constexpr (runs_in_parallel<I, Event>) {
+            workers_[worker_index<I>()].join();
+            handled[I] = job.handled;
+        }
+    }
+
+    std::array<RegionWorker, parallel_count> workers_;
+};
+
+///
+/// A simple observer class. The notify method will be invoked by an
+/// AsyncExecWithObserver state machine after event processing. This observer
+/// also implements a blocking wait so that test methods can invoke the wait
+/// method to synchronize with the event processing.
+///
+template<typename LockType, typename ConditionVarType>
+struct BlockingObserverT {
+    void notify() {
+        std::unique_lock<std::mutex> lock(smBusyMutex_);
+        notified_ = true;
+        cv_.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(smBusyMutex_);
+        cv_.wait(lock, [this] { return this->notified_ == true; });
+        notified_ = false;
+    }
+
+  private:
+    LockType smBusyMutex_;
+    ConditionVarType cv_;
+    bool notified_{};
+};
+
+// Preserving for historical reasons. The callback list is allocated from a
+// memory resource - by default the one current when the observer is built.
+struct CallbackObserver {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    CallbackObserver() = default;
+    explicit CallbackObserver(allocator_type alloc)
+      : cbs_(alloc) {}
+
+    void add_callback(std::function<void()>&& cb) {
+        if (cb != nullptr) {
+            cbs_.push_back(std::move(cb));
+        }
+    }
+
+    // Reserve room for callbacks up front so add_callback does not allocate
+    void reserve(std::size_t n) { cbs_.reserve(n); }
+
+    allocator_type get_allocator() const { return cbs_.get_allocator(); }
+
+    void notify() {
+        for (auto const& cb : cbs_) {
+            cb();
+        }
+    }
+
+  private:
+    std::pmr::vector<std::function<void()>> cbs_;
+};
+
+// Callable stored in a fixed inline buffer - never allocates. Callables
+// larger than Size fail to compile.
+template<typename Signature, std::size_t Size = 32>
+struct InlineFunction;
+
+template<typename R, typename... Args, std::size_t Size>
+struct InlineFunction<R(Args...), Size> {
+    InlineFunction() = default;
+
+    template<typename F>
+        requires(!std::is_same_v<std::decay_t<F>, InlineFunction> &&
+                 std::is_invocable_r_v<R, std::decay_t<F>&, Args...>)
+    InlineFunction(F&& f) {
+        using Fn = std::decay_t<F>;
+        static_assert(sizeof(Fn) <= Size,
+                      "Callable does not fit in the InlineFunction buffer");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t));
+        new (storage_) Fn(std::forward<F>(f));
+        invoke_ = [](void* fn, Args... args) -> R {
+            return (*static_cast<Fn*>(fn))(std::forward<Args>(args)...);
+        };
+        manage_ = [](void* dst, void* src) {
+            if (dst != nullptr) {
+                new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            }
+            static_cast<Fn*>(src)->~Fn();
+        };
+    }
+
+    InlineFunction(InlineFunction&& other) noexcept { take(other); }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~InlineFunction() { reset(); }
+
+    R operator()(Args... args) const {
+        return invoke_(storage_, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const { return invoke_ != nullptr; }
+
+    void reset() {
+        if (manage_ != nullptr) {
+            manage_(nullptr, storage_);
+        }
+        invoke_ = nullptr;
+        manage_ = nullptr;
+    }
+
+  private:
+    void take(InlineFunction& other) {
+        if (other.manage_ != nullptr) {
+            other.manage_(storage_, other.storage_);
+        }
+        invoke_ = std::exchange(other.invoke_, nullptr);
+        manage_ = std::exchange(other.manage_, nullptr);
+    }
+
+    alignas(std::max_align_t) mutable std::byte storage_[Size];
+    R (*invoke_)(void*, Args...){};
+    // move into dst (if not null) and destroy src
+    void (*manage_)(void*, void*){};
+};
+
+// When ThreadedExecWithObserver calls an observer that declares a
+// notify_mode. Observers without one are notified before every event.
+enum class NotifyMode {
+    PerEvent,      // after each event
+    PerBatch,      // once the queue is drained, before blocking again
+    PerStateChange // after events that changed the active leaf state
+};
+
+template<typename T, typename = void>
+struct has_notify_mode : std::false_type {};
+
+template<typename T>
+struct has_notify_mode<T, std::void_t<decltype(T::notify_mode)>>
+  : std::true_type {};
+
+template<typename T>
+inline constexpr bool has_notify_mode_v = has_notify_mode<T>::value;
+
+// Observer with a fixed number of inline callbacks. subscribe() is lock-free
+// and may be called from any thread while the machine runs; it returns false
+// once Capacity subscribers are registered. Nothing allocates.
+template<NotifyMode Mode = NotifyMode::PerBatch,
+         std::size_t Capacity = 8,
+         std::size_t CallableSize = 32>
+struct InlineObserver {
+    static constexpr NotifyMode notify_mode = Mode;
+    using Callback = InlineFunction<void(), CallableSize>;
+
+    template<typename F>
+    bool subscribe(F&& f) {
+        auto i = claimed_.fetch_add(1, std::memory_order_relaxed);
+        if (i >= Capacity) {
+            return false;
+        }
+        slots_[i].callback = Callback(std::forward<F>(f));
+        slots_[i].ready.store(true, std::memory_order_release);
+        return true;
+    }
+
+    void notify() const {
+        auto n = std::min(claimed_.load(std::memory_order_acquire), Capacity);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (slots_[i].ready.load(std::memory_order_acquire)) {
+                slots_[i].callback();
+            }
+        }
+    }
+
+    std::size_t subscribers() const {
+        return std::min(claimed_.load(std::memory_order_acquire), Capacity);
+    }
+
+  private:
+    struct Slot {
+        Callback callback;
+        std::atomic<bool> ready{};
+    };
+
+    std::array<Slot, Capacity> slots_{};
+    std::atomic<std::size_t> claimed_{};
+};
+
+#ifdef __FREE_RTOS__
+using BlockingObserver =
+  BlockingObserverT<FreeRTOSMutex, FreeRTOSConditionVariable>;
+#else
+using BlockingObserver = BlockingObserverT<std::mutex, std::condition_variable>;
+#endif
+
+///
+/// Another Threaded execution policy. The only difference with
+/// ThreadedExecutionPolicy is that an Observer's notify method will be invoked
+/// at the end of processing each event - specifically, right before the
+/// blocking wait for the next event.
+///
+template<typename Observer,
+         typename Context,
+         template<typename> class Policy = ThreadedExecutionPolicy>
+struct ThreadedExecWithObserver
+  : public Policy<Context>
+  , public Observer {
+    using type = ThreadedExecWithObserver<Observer, Context, Policy>;
+    using HsmType = typename Policy<Context>::type;
+    using HsmType::interrupt_;
+    using HsmType::place_thread;
+    using HsmType::process_event;
+    using HsmType::smThread_;
+
+    void start() {
+        this->placement_error_ = {};
+        smThread_ = std::thread([this] {
+            this->enter_machine_thread();
+            if constexpr (has_notify_mode_v<Observer>) {
+                this->run_notifying();
+            } else {
+                while (!interrupt_) {
+                    Observer::notify();
+                    process_event();
+                }
+            }
+        });
+        place_thread(smThread_);
+    }
+    virtual ~ThreadedExecWithObserver() = default;
+
+  protected:
+    using Event = typename HsmType::Event;
+
+    void run_notifying() {
+        while (!interrupt_) {
+            // This is a blocking wait
+            handle_notifying(this->eventQueue_.next_event());
+            if constexpr (Observer::notify_mode == NotifyMode::PerBatch) {
+                Event e;
+                while (this->eventQueue_.try_next_event(e)) {
+                    handle_notifying(e);
+                }
+                if (!this->eventQueue_.interrupted()) {
+                    Observer::notify();
+                }
+            }
+        }
+    }
+
+    void handle_notifying(Event const& event) {
+        if (this->eventQueue_.interrupted()) {
+            return;
+        }
+        using Machine = typename HsmType::HsmType;
+        constexpr auto mode = Observer::notify_mode;
+        std::size_t before = 0;
+        if constexpr (mode == NotifyMode::PerStateChange) {
+            before = active_leaf(static_cast<Machine const&>(*this));
+        }
+        this->complete(this->handle_event(event));
+        if constexpr (mode == NotifyMode::PerEvent) {
+            Observer::notify();
+        } else if constexpr (mode == NotifyMode::PerStateChange) {
+            if (active_leaf(static_cast<Machine const&>(*this)) != before) {
+                Observer::notify();
+            }
+        }
+    }
+};
+
+///
+/// Execution policy that uses a BlockingObserver.
+/// This is illustrative of chaining policies together.
+///
+template<typename Context>
+using ThreadedBlockingObserver =
+  ThreadedExecWithObserver<Context, BlockingObserver>;
+
+/// Helper to implement a Timed Execution Policy
+template<typename Clock = std::chrono::steady_clock,
+         typename Duration = typename Clock::duration>
+struct Timer {
+    using ClockType = Clock;
+    using DurationType = Duration;
+    void start() {
+        start_time_ = Clock::now();
+        started_ = true;
+    }
+
+    Duration elapsed() const {
+        if (!started_) {
+            return Duration(0);
+        }
+        auto now = Clock::now();
+        auto interval = now - start_time_;
+        return std::chrono::duration_cast<Duration>(interval);
+    }
+
+    template<typename ToDuration = Duration>
+    Duration elapsed(ToDuration since) const {
+        auto now = Clock::now();
+        if constexpr (std::is_same<ToDuration, Duration>::value) {
+            return std::chrono::duration_cast<Duration>(now - since);
+        } else {
+            return std::chrono::duration_cast<ToDuration>(now - since);
+        }
+    }
+    // template function to convert to a different Duration
+    template<typename ToDuration>
+    ToDuration elapsed() const {
+        return std::chrono::duration_cast<ToDuration>(elapsed());
+    }
+
+    bool started() const { return started_; }
+    void reset() { start_time_ = Clock::now(); }
+    void stop() { started_ = false; }
+
+  protected:
+    typename Clock::time_point start_time_;
+    bool started_{ false };
+};
+
+// useful for profiling
+template<typename Clock = std::chrono::steady_clock,
+         typename Duration = typename Clock::duration>
+struct IntervalTimer : public Timer<Clock, Duration> {
+    // Return the interval since the previous call to this function, typecast
+    // to the Duration type
+    Duration interval() {
+        if (!this->started()) {
+            this->start();
+            return Duration(0);
+        }
+        auto now = Clock::now();
+        auto interval = now - this->start_time_;
+        this->start_time_ = now;
+        return std::chrono::duration_cast<Duration>(interval);
+    }
+};
+
+// Drop-in for PeriodicSleepTimer on a VirtualClock. wait() returns once the
+// clock has passed the next period boundary; boundaries are a fixed period
+// apart, so a single large advance is worked off one period per call.
+template<typename Clock = VirtualClock<>,
+         typename Duration = std::chrono::milliseconds>
+struct VirtualPeriodicTimer : public Timer<Clock, Duration> {
+    static_assert(is_virtual_clock_v<Clock>,
+                  "VirtualPeriodicTimer needs a VirtualClock");
+
+    VirtualPeriodicTimer(Duration period = Duration(1))
+      : period_(period) {}
+
+    void start() {
+        interrupted_.store(false, std::memory_order_relaxed);
+        Timer<Clock, Duration>::start();
+    }
+
+    void wait() {
+        auto deadline = this->start_time_ + period_;
+        while (!interrupted_.load(std::memory_order_acquire) &&
+               Clock::now() < deadline) {
+            Clock::wait_until(deadline);
+        }
+        this->start_time_ = deadline;
+    }
+
+    // A period boundary has passed that wait() has not yet returned for
+    bool expired() const { return Clock::now() >= this->start_time_ + period_; }
+
+    // Release a thread blocked in wait()
+    void interrupt() {
+        interrupted_.store(true, std::memory_order_release);
+        Clock::wake();
+    }
+
+    Duration get_period() const { return period_; }
+
+  protected:
+    Duration period_;
+    std::atomic<bool> interrupted_{};
+};
+
+// Periodic execution in virtual time, without threads. advance() moves the
+// timer's clock and hands the machine a ClockTickEvent, as
+// PeriodicExecutionPolicy would, for every period that passed. Runs are
+// deterministic and as fast as the machine handles ticks.
+template<typename Context,
+         template<typename> class Policy = make_hsm_t,
+         typename PeriodicTimer = VirtualPeriodicTimer<>>
+struct VirtualPeriodicExecutionPolicy
+  : Policy<Context>
+  , PeriodicTimer {
+    using type = VirtualPeriodicExecutionPolicy<Context, Policy, PeriodicTimer>;
+    using HsmType = typename Policy<Context>::type;
+    using TimerType = PeriodicTimer;
+    using Clock = typename PeriodicTimer::ClockType;
+
+    void start() { PeriodicTimer::start(); }
+    void stop() { PeriodicTimer::stop(); }
+
+    // Move the clock forward and deliver the ticks that fell due. Returns
+    // the number of ticks delivered.
+    std::size_t advance(typename Clock::duration by) {
+        Clock::advance(by);
+        return poll();
+    }
+
+    // Deliver the ticks due at the clock's current time, e.g. after another
+    // machine on the same clock advanced it
+    std::size_t poll() {
+        std::size_t delivered = 0;
+        while (this->started() && PeriodicTimer::expired()) {
+            PeriodicTimer::wait();
+            ++tick_event_.ticks_;
+            // a const copy, as the threaded policies dequeue one
+            ClockTickEvent const tick = tick_event_;
+            this->handle(tick);
+            ++delivered;
+        }
+        return delivered;
+    }
+
+    int get_ticks() { return tick_event_.ticks_; }
+
+  protected:
+    ClockTickEvent tick_event_;
+};
+
+#ifdef __linux__
+// Periodic Timer
+// Lock up the calling thread for a period of time. Accuracy is determined by
+// real-time scheduler settings and OS scheduling policies
+template<typename Clock = AccurateClock,
+         typename Duration = typename Clock::duration>
+struct PeriodicSleepTimer : public Timer<Clock, Duration> {
+    PeriodicSleepTimer(Duration period = Duration(1))
+      : period_(period) {}
+    void start() { Timer<Clock, Duration>::start(); }
+
+    void wait() {
+        // calculate time elapsed since last callback
+        auto remaining = period_ - Timer<Clock, Duration>::elapsed();
+        // nanosleep for remaining time
+        // Convert duration to timespec
+        struct timespec ts;
+        ts.tv_sec =
+          std::chrono::duration_cast<std::chrono::seconds>(remaining).count();
+        ts.tv_nsec =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(remaining)
+            .count();
+        // remaining time if -1
+        struct timespec remaining_ts;
+        while (nanosleep(&ts, &remaining_ts) == EINTR) {
+            ts = remaining_ts;
+        }
+        // ensure that callback finishes within the period
+        Timer<Clock, Duration>::reset();
+    }
+
+    Duration get_period() const { return period_; }
+
+  protected:
+    Duration period_;
+};
+
+// Scheduling classes for real-time threads
+enum class SchedulingPolicy { Other, Fifo, RoundRobin, Deadline };
+
+// How real-time threads keep their memory resident. Locking every page of
+// the process is a process-wide decision; see prepare_realtime_process().
+enum class MemoryLock {
+    None,   // prefault only
+    Regions // mlock the thread stacks and the machine
+};
+
+struct RealtimeParams {
+    SchedulingPolicy policy{ SchedulingPolicy::RoundRobin };
+    // SCHED_FIFO and SCHED_RR priority
+    int priority{ 95 };
+    // SCHED_DEADLINE reservation: runtime <= deadline <= period
+    std::chrono::nanoseconds runtime{};
+    std::chrono::nanoseconds deadline{};
+    std::chrono::nanoseconds period{};
+    MemoryLock lock{ MemoryLock::Regions };
+    // Stack each real-time thread touches before it handles events, capped
+    // at what is left of the thread's stack
+    std::size_t stack_prefault{ 64 * 1024 };
+};
+
+// Outcome of configuring real-time threads. A failed step records its errno
+// and the remaining steps still run. Errors from several threads are kept in
+// the order they happened; only the first one per step is stored.
+struct RealtimeStatus {
+    std::error_code affinity;
+    std::error_code scheduling;
+    std::error_code memory_lock;
+
+    bool ok() const { return !affinity && !scheduling && !memory_lock; }
+
+    void merge(RealtimeStatus const& other) {
+        affinity = affinity ? affinity : other.affinity;
+        scheduling = scheduling ? scheduling : other.scheduling;
+        memory_lock = memory_lock ? memory_lock : other.memory_lock;
+    }
+};
+
+// Real-time execution policy
+struct RealtimeConfigurator {
+    RealtimeConfigurator() = default;
+    RealtimeConfigurator(int priority, std::array<int, 4> affinity)
+      : CPU_AFFINITY({ affinity[0], affinity[1], affinity[2], affinity[3] }) {
+        params_.priority = priority - 3;
+    }
+    RealtimeConfigurator(int priority, ThreadPlacement placement)
+      : CPU_AFFINITY(placement) {
+        params_.priority = priority - 3;
+    }
+    RealtimeConfigurator(RealtimeParams params,
+                         ThreadPlacement placement = { 0, 1, 2, 3 })
+      : params_(params)
+      , CPU_AFFINITY(placement) {}
+
+    // Take effect on the next start()
+    void set_placement(ThreadPlacement const& placement) {
+        CPU_AFFINITY = placement;
+    }
+    void set_params(RealtimeParams const& params) { params_ = params; }
+
+    // Valid once start() has returned
+    RealtimeStatus const& status() const { return status_; }
+
+    // Configure the calling thread. The kernel only admits a SCHED_DEADLINE
+    // thread whose affinity spans its whole root domain, so Deadline threads
+    // are not pinned and keep the affinity they inherit; confine them with an
+    // exclusive cpuset instead.
+    RealtimeStatus config_realtime_thread() {
+        RealtimeStatus status;
+        if (params_.policy != SchedulingPolicy::Deadline &&
+            !CPU_AFFINITY.apply()) {
+            status.affinity = last_error();
+        }
+        status.scheduling = set_scheduling(params_);
+        status.memory_lock = prefault_stack(
+          params_.stack_prefault, params_.lock == MemoryLock::Regions);
+        return status;
+    }
+
+    // Touch (and lock, for MemoryLock::Regions) memory a real-time thread
+    // will use, e.g. the machine with its event queue
+    void prefault(void const* addr, std::size_t len) {
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto const volatile* bytes = static_cast<char const volatile*>(addr);
+        for (std::size_t i = 0; i < len; i += page) {
+            (void)bytes[i];
+        }
+        if (params_.lock == MemoryLock::Regions && mlock(addr, len) != 0) {
+            status_.merge({ {}, {}, last_error() });
+        }
+    }
+
+    // The thread is configured when this returns; see status()
+    template<typename Fn>
+    std::thread real_time_thread(Fn fn) {
+        auto configured = configured_.load(std::memory_order_relaxed);
+        std::thread thread([this, fn] {
+            auto status = this->config_realtime_thread();
+            status_.merge(status);
+            configured_.fetch_add(1, std::memory_order_release);
+            configured_.notify_all();
+            fn();
+        });
+        configured_.wait(configured, std::memory_order_acquire);
+        return thread;
+    }
+
+    std::thread make_real_time(std::thread&& t) {
+        status_.merge(config_realtime_thread());
+        return std::move(t);
+    }
+
+  protected:
+    RealtimeParams params_;
+    ThreadPlacement CPU_AFFINITY{ 0, 1, 2, 3 };
+    RealtimeStatus status_;
+    std::atomic<std::uint32_t> configured_{};
+
+  private:
+    static std::error_code last_error() {
+        return { errno, std::system_category() };
+    }
+
+    static std::error_code set_scheduling(RealtimeParams const& params) {
+        if (params.policy == SchedulingPolicy::Deadline) {
+#ifdef SYS_sched_setattr
+            // struct sched_attr from the kernel uapi
+            struct {
+                std::uint32_t size;
+                std::uint32_t sched_policy;
+                std::uint64_t sched_flags;
+                std::int32_t sched_nice;
+                std::uint32_t sched_priority;
+                std::uint64_t sched_runtime;
+                std::uint64_t sched_deadline;
+                std::uint64_t sched_period;
+            } attr{};
+            constexpr std::uint32_t SchedDeadline = 6;
+            attr.size = sizeof(attr);
+            attr.sched_policy = SchedDeadline;
+            attr.sched_runtime =
+              static_cast<std::uint64_t>(params.runtime.count());
+            attr.sched_deadline =
+              static_cast<std::uint64_t>(params.deadline.count());
+            attr.sched_period =
+              static_cast<std::uint64_t>(params.period.count());
+            if (syscall(SYS_sched_setattr, 0, &attr, 0) != 0) {
+                return last_error();
+            }
+            return {};
+#else
+            return std::make_error_code(std::errc::function_not_supported);
+#endif
+        }
+        struct sched_param param {};
+        int policy = SCHED_OTHER;
+        if (params.policy == SchedulingPolicy::Fifo) {
+            policy = SCHED_FIFO;
+        } else if (params.policy == SchedulingPolicy::RoundRobin) {
+            policy = SCHED_RR;
+        }
+        if (policy != SCHED_OTHER) {
+            param.sched_priority = params.priority;
+        }
+        int err = pthread_setschedparam(pthread_self(), policy, &param);
+        return { err, std::system_category() };
+    }
+
+    // Touch the stack below the caller's frame so later calls do not fault.
+    // Never more than the thread's stack has left, minus room for the calls
+    // made while touching it.
+    [[gnu::noinline]] static std::error_code prefault_stack(std::size_t size,
+                                                            bool lock) {
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void* base = nullptr;
+            std::size_t stack_size = 0;
+            pthread_attr_getstack(&attr, &base, &stack_size);
+            pthread_attr_destroy(&attr);
+            constexpr std::size_t Headroom = 16 * 1024;
+            char here;
+            auto left = reinterpret_cast<std::uintptr_t>(&here) -
+                        reinterpret_cast<std::uintptr_t>(base);
+            size = std::min<std::size_t>(size,
+                                         left > Headroom ? left - Headroom : 0);
+        }
+        if (size == 0) {
+            return {};
+        }
+        auto* stack = static_cast<char*>(alloca(size));
+        touch(stack, size);
+        if (lock && mlock(stack, size) != 0) {
+            return last_error();
+        }
+        return {};
+    }
+
+    static void touch(char* addr, std::size_t len) {
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto volatile* bytes = addr;
+        for (std::size_t i = 0; i < len; i += page) {
+            bytes[i] = 0;
+        }
+    }
+};
+
+// Process-wide memory setup for real-time use. It changes how every thread
+// of the process uses memory, not just the machines', so it is never done
+// implicitly: call it once from main() before starting real-time machines.
+// - lock_all: mlockall(MCL_CURRENT | MCL_FUTURE), keeping every page resident
+// - heap_reserve: tell glibc never to trim the heap or to serve large blocks
+//   with mmap, then grow the heap by this many bytes and touch them
+// Every step runs; the first failure is returned.
+inline std::error_code
+prepare_realtime_process(bool lock_all, std::size_t heap_reserve = 0) {
+    std::error_code result;
+    if (lock_all && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        result = { errno, std::system_category() };
+    }
+    if (heap_reserve > 0) {
+#ifdef __GLIBC__
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+#endif
+        auto* heap = static_cast<char volatile*>(std::malloc(heap_reserve));
+        if (heap == nullptr) {
+            return result ? result
+                          : std::make_error_code(std::errc::not_enough_memory);
+        }
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        for (std::size_t i = 0; i < heap_reserve; i += page) {
+            heap[i] = 0;
+        }
+        std::free(const_cast<char*>(heap));
+    }
+    return result;
+}
+
+// Real-time execution policy - set cpu isolation in grub
+template<typename Context,
+         template<typename> class Policy = ThreadedExecutionPolicy>
+struct RealtimeExecutionPolicy
+  : Policy<Context>
+  , RealtimeConfigurator {
+    using type = RealtimeExecutionPolicy<Context, Policy>;
+    using HsmType = typename Policy<Context>::type;
+    using HsmType::interrupt_;
+    using HsmType::process_event;
+    using HsmType::smThread_;
+    using RealtimeConfigurator::set_placement;
+
+    void start() {
+        RealtimeConfigurator::prefault(this, sizeof(*this));
+        smThread_ = RealtimeConfigurator::real_time_thread(
+          [this] { this->run_machine(); });
+    }
+
+    virtual ~RealtimeExecutionPolicy() = default;
+};
+
+// Tick thread of the threaded periodic policies. Derived is the policy; it
+// provides the machine's interrupt_, send_event and deliver.
+template<typename Derived, typename PeriodicTimer>
+struct PeriodicTicker : PeriodicTimer {
+    int get_ticks() { return tick_event_.ticks_; }
+
+  protected:
+    std::thread eventThread_;
+    ClockTickEvent tick_event_;
+
+    // Body of the tick thread: one tick per period until the machine stops
+    void run_ticks() {
+        auto& self = static_cast<Derived&>(*this);
+        while (!self.interrupt_) {
+            PeriodicTimer::wait();
+            if (self.interrupt_) {
+                break;
+            }
+            ++tick_event_.ticks_;
+            send_tick();
+        }
+    }
+
+    // A virtual clock can pass many periods at once. Its ticks wait for the
+    // machine rather than overflow the queue, so fast-forwarding loses no
+    // time.
+    void send_tick() {
+        auto& self = static_cast<Derived&>(*this);
+        if constexpr (is_virtual_clock_v<typename PeriodicTimer::ClockType>) {
+            self.deliver(tick_event_);
+        } else {
+            self.send_event(tick_event_);
+        }
+    }
+
+    // Wake the tick thread and join it, once the machine is interrupted
+    void stop_ticks() {
+        // a virtual timer only wakes when its clock moves
+        if constexpr (requires(PeriodicTimer& t) { t.interrupt(); }) {
+            PeriodicTimer::interrupt();
+        }
+        if (eventThread_.joinable()) {
+            eventThread_.join();
+        }
+    }
+};
+
+// Periodic execution policy
+template<typename Context,
+         template<typename> class Policy = ThreadedExecutionPolicy,
+         typename PeriodicTimer = PeriodicSleepTimer<std::chrono::steady_clock,
+                                                     std::chrono::milliseconds>>
+struct PeriodicExecutionPolicy
+  : Policy<Context>
+  , PeriodicTicker<PeriodicExecutionPolicy<Context, Policy, PeriodicTimer>,
+                   PeriodicTimer> {
+    using type = PeriodicExecutionPolicy<Context, Policy, PeriodicTimer>;
+    using HsmType = typename Policy<Context>::type;
+    using TimerType = PeriodicTimer;
+    using HsmType::interrupt_;
+    using HsmType::send_event;
+
+    void start() {
+        PeriodicTimer::start();
+        ThreadedExecutionPolicy<Context>::start();
+        this->eventThread_ = std::thread([this] { this->run_ticks(); });
+        this->place_thread(this->eventThread_);
+    }
+
+    void stop() {
+        ThreadedExecutionPolicy<Context>::stop();
+        this->stop_ticks();
+    }
+    virtual ~PeriodicExecutionPolicy() { stop(); }
+
+  private:
+    friend PeriodicTicker<type, PeriodicTimer>;
+};
+
+// Periodic Real-time execution policy
+template<typename Context,
+         template<typename> class Policy = ThreadedExecutionPolicy,
+         typename PeriodicTimer = PeriodicSleepTimer<std::chrono::steady_clock,
+                                                     std::chrono::milliseconds>>
+struct RealtimePeriodicExecutionPolicy
+  : RealtimeConfigurator
+  , Policy<Context>
+  , PeriodicTicker<
+      RealtimePeriodicExecutionPolicy<Context, Policy, PeriodicTimer>,
+      PeriodicTimer> {
+    using type =
+      RealtimePeriodicExecutionPolicy<Context, Policy, PeriodicTimer>;
+    using TimerType = PeriodicTimer;
+    using HsmType = typename Policy<Context>::type;
+    using HsmType::interrupt_;
+    using HsmType::process_event;
+    using HsmType::send_event;
+    using HsmType::smThread_;
+    using RealtimeConfigurator::set_placement;
+
+    void start() {
+        RealtimeConfigurator::prefault(this, sizeof(*this));
+        PeriodicTimer::start();
+        smThread_ = RealtimeConfigurator::real_time_thread(
+          [this] { this->run_machine(); });
+
+        this->eventThread_ = RealtimeConfigurator::real_time_thread(
+          [this] { this->run_ticks(); });
+    }
+
+    void stop() {
+        ThreadedExecutionPolicy<Context>::stop();
+        this->stop_ticks();
+    }
+    virtual ~RealtimePeriodicExecutionPolicy() { stop(); }
+
+  private:
+    friend PeriodicTicker<type, PeriodicTimer>;
+};
+
+// Concurrent HSMs
+template<typename... Hsms>
+struct ConcurrentExecutionPolicy {
+    static constexpr bool is_hsm = true;
+    using type = ConcurrentExecutionPolicy<Hsms...>;
+
+    template<typename Event>
+    void entry(Event e = Event()) {
+        std::apply([e](auto&... hsm) { (hsm.entry(e), ...); }, hsms_);
+    }
+
+    template<typename Event>
+    void exit(Event&& e) {
+        std::apply([e](auto&... hsm) { (hsm.exit(e), ...); }, hsms_);
+    }
+
+    // Does the child machine's event variant take Event?
+    template<typename Event, typename Hsm>
+    static constexpr bool accepts =
+      variant_contains_v<std::decay_t<Event>, typename Hsm::Event>;
+
+    // Number of machines an event of this type is delivered to
+    template<typename Event>
+    static constexpr std::size_t receivers =
+      (std::size_t{ 0 } + ... + accepts<Event, Hsms>);
+
+    // Route the event only to the machines that can handle it
+    template<typename Event>
+    void send_event(Event&& e) {
+        static_assert(receivers<Event> > 0,
+                      "No machine in the ConcurrentHsm handles this event");
+        std::apply([&e](auto&... hsm) { (route(hsm, e), ...); }, hsms_);
+    }
+
+    // assume hsms can be `tick`ed
+
+    void tick() {
+        std::apply([](auto&... hsm) { (hsm.tick(), ...); }, hsms_);
     }
 
-    void process_event() {
-        Event const& nextEvent = eventQueue.next_event();
-        if (!eventQueue.interrupted()) {
-            std::visit([this](auto const& e) { return this->handle(e); },
-                       nextEvent);
+    std::tuple<Hsms...> hsms_;
+
+  private:
+    template<typename Hsm, typename Event>
+    static void route(Hsm& hsm, Event const& e) {
+        if constexpr (accepts<Event, Hsm>) {
+            hsm.send_event(typename Hsm::Event{ e });
         }
     }
 };
 
-#else // __FREE_RTOS__ is not defined
+// Each HSM in the concurrent HSM is wrapped with a ThreadedExecutionPolicy
+template<template<typename> class Policy = ThreadedExecutionPolicy,
+         typename... Ts>
+struct make_concurrent_hsm {
+    using type = ConcurrentExecutionPolicy<Policy<Ts>...>;
+};
 
-template<typename Event>
-using EventQueue = EventQueueT<Event, std::mutex, std::condition_variable_any>;
+template<template<typename> class Policy = ThreadedExecutionPolicy,
+         typename... Ts>
+using make_concurrent_hsm_t = typename make_concurrent_hsm<Policy, Ts...>::type;
 
-// C++ 11 compatible accurate clock (nanosecond precision). This is a drop-in
-// replacement for Clock types in std::chrono
-struct AccurateClock {
-    using duration = std::chrono::nanoseconds;
-    using period = duration::period;
-    using rep = duration::rep;
-    using time_point = std::chrono::time_point<AccurateClock>;
+// Concurrent HSMs fed from a single MulticastRing. A broadcast is written
+// once and every machine reads it in place on its own thread, so the cost of
+// send_event does not grow with the number of machines. Each machine only
+// handles the event types its transitions take; clocked machines are ticked
+// by a ClockTickEvent broadcast.
+template<std::size_t Capacity, typename... Hsms>
+struct MulticastExecutionPolicy {
+    static constexpr bool is_hsm = true;
+    using type = MulticastExecutionPolicy<Capacity, Hsms...>;
+    static constexpr bool any_clocked = (is_clocked_hsm_v<Hsms> || ...);
+    using Event = tuple_to_variant_t<unique_tuple_t<decltype(std::tuple_cat(
+      std::declval<get_events_t<Hsms>>()...,
+      std::declval<std::conditional_t<any_clocked,
+                                      std::tuple<ClockTickEvent>,
+                                      std::tuple<>>>()))>>;
 
-    static constexpr bool is_steady = true;
+    void start() {
+        [this]<std::size_t... Is>(std::index_sequence<Is...>) {
+            ((threads_[Is] = std::thread(&type::consume<Is>, this)), ...);
+        }(std::index_sequence_for<Hsms...>{});
+        for (std::size_t i = 0; i < threads_.size(); ++i) {
+            placement_errors_[i] = {};
+            if (!placements_[i].apply(threads_[i])) {
+                placement_errors_[i] = { errno, std::system_category() };
+            }
+        }
+    }
 
-    static time_point now() noexcept {
-        struct timespec ts;
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        auto durationSinceEpoch = std::chrono::seconds(ts.tv_sec) +
-                                  std::chrono::nanoseconds(ts.tv_nsec);
-        return time_point(duration(durationSinceEpoch));
+    // Placement of machine I's thread. Takes effect on the next start()
+    template<std::size_t I>
+    void set_placement(ThreadPlacement const& placement) {
+        placements_[I] = placement;
     }
-};
 
-#endif
+    // Why machine I's thread could not be pinned, empty if it was. Valid
+    // once start() has returned.
+    template<std::size_t I>
+    std::error_code placement_error() const {
+        return placement_errors_[I];
+    }
 
-// Forward declarations
-template<typename HsmType, typename = void>
-struct get_events_from_hsm;
+    // Machines finish the events published before stop() and then exit
+    void stop() {
+        ring_.stop();
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
 
-template<typename Transition>
-struct get_events_from_transition;
+    virtual ~MulticastExecutionPolicy() { stop(); }
 
-template<typename TransitionsTuple>
-struct aggregate_events;
+    // Blocks while the slowest machine is a full ring behind
+    template<typename E>
+    bool send_event(E&& e) {
+        return ring_.publish(std::forward<E>(e));
+    }
 
-// Specialize for transitions tuple
-template<typename... Transitions>
-struct aggregate_events<std::tuple<Transitions...>> {
-    using type = decltype(std::tuple_cat(
-      typename get_events_from_transition<Transitions>::type{}...));
-};
+    bool tick()
+        requires any_clocked
+    {
+        return send_event(ClockTickEvent{});
+    }
 
-// Base case for empty tuple
-template<>
-struct aggregate_events<std::tuple<>> {
-    using type = std::tuple<>;
-};
+    // Broadcasts not yet handled by the slowest machine
+    std::size_t lag() const { return ring_.lag(); }
 
-// Extract events from a single transition
-template<typename Transition>
-struct get_events_from_transition {
-    using Event = std::tuple<typename Transition::event>;
-    using FromEvents =
-      typename get_events_from_hsm<typename Transition::from>::type;
-    using ToEvents =
-      typename get_events_from_hsm<typename Transition::to>::type;
-    using type = decltype(std::tuple_cat(Event{}, FromEvents{}, ToEvents{}));
-};
+    std::tuple<Hsms...> hsms_;
 
-// Main structure for extracting events from an HSM
-template<typename HsmType>
-struct get_events_from_hsm<HsmType,
-                           std::enable_if_t<has_transitions_v<HsmType>>> {
-    using Transitions = typename HsmType::transitions;
-    using type = typename aggregate_events<Transitions>::type;
+  private:
+    template<std::size_t I>
+    void consume() {
+        using HsmType = std::tuple_element_t<I, std::tuple<Hsms...>>;
+        auto& hsm = std::get<I>(hsms_);
+        while (Event const* next = ring_.next(I)) {
+            std::visit(
+              [&hsm](auto const& e) {
+                  using E = std::decay_t<decltype(e)>;
+                  if constexpr (is_clocked_hsm_v<HsmType> &&
+                                std::is_same_v<E, ClockTickEvent>) {
+                      hsm.tick();
+                  } else if constexpr (region_accepts_v<E, HsmType>) {
+                      hsm.handle(e);
+                  }
+              },
+              *next);
+            ring_.release(I);
+        }
+    }
+
+    MulticastRing<Event, Capacity, sizeof...(Hsms)> ring_;
+    std::array<std::thread, sizeof...(Hsms)> threads_;
+    std::array<ThreadPlacement, sizeof...(Hsms)> placements_;
+    std::array<std::error_code, sizeof...(Hsms)> placement_errors_;
 };
 
-// Fallback for non-HSM types
-template<typename HsmType>
-struct get_events_from_hsm<HsmType,
-                           std::enable_if_t<!has_transitions_v<HsmType>>> {
-    using type = std::tuple<>;
+// Each context is wrapped with Policy and driven from a shared MulticastRing
+template<template<typename> class Policy = make_hsm_t,
+         std::size_t Capacity = 1024,
+         typename... Ts>
+struct make_multicast_hsm {
+    using type = MulticastExecutionPolicy<Capacity, Policy<Ts>...>;
 };
 
-// Helper alias
-template<typename HsmType>
-using get_events_t =
-  unique_tuple_t<typename get_events_from_hsm<HsmType>::type>;
+template<template<typename> class Policy = make_hsm_t,
+         std::size_t Capacity = 1024,
+         typename... Ts>
+using make_multicast_hsm_t =
+  typename make_multicast_hsm<Policy, Capacity, Ts...>::type;
+
+// Publishing end of a channel to the next stage of a pipeline. Derive the
+// context from Outlet<Events...> and call publish() from actions or state
+// handlers. When the next stage is full, publish() waits at most max_wait
+// and then drops the event, so a slow stage slows its upstream down without
+// ever stalling it for good.
+template<typename... Events>
+struct Outlet {
+    using outlet_type = Outlet<Events...>;
+
+    template<typename Channel>
+    void connect(Channel& channel) {
+        channel_ = &channel;
+        pushes_ = { &push<Channel, Events>... };
+    }
 
-// Single threaded execution policy
-template<typename Context, template<typename> class Policy = make_hsm_t>
-struct SingleThreadedExecutionPolicy : Policy<Context> {
-    using type = SingleThreadedExecutionPolicy<Context, Policy>;
-    using HsmType = typename Policy<Context>::type;
-    using Event = tuple_to_variant_t<get_events_t<HsmType>>;
+    template<typename E>
+    bool try_publish(E const& e) {
+        constexpr auto i = tuple_index_v<E, std::tuple<Events...>>;
+        return channel_ != nullptr && pushes_[i](channel_, &e);
+    }
 
-    bool step() {
-        // This is a blocking wait
-        Event const& nextEvent = eventQueue_.next_event();
-        // go down the Hsm hierarchy to handle the event as that is the
-        // "most active state"
-        return std::visit(
-          [this](auto&& e) -> bool { return HsmType::handle(e); }, nextEvent);
+    template<typename E>
+    bool publish(E const& e) {
+        if (try_publish(e)) {
+            return true;
+        }
+        auto deadline = std::chrono::steady_clock::now() + max_wait_;
+        do {
+            std::this_thread::yield();
+            if (try_publish(e)) {
+                return true;
+            }
+        } while (std::chrono::steady_clock::now() < deadline);
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
 
-    void send_event(Event&& event) {
-        eventQueue_.add_event(std::forward<Event>(event));
+    void set_max_wait(std::chrono::microseconds max_wait) {
+        max_wait_ = max_wait;
+    }
+
+    // Events the next stage had no room for
+    std::uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
     }
 
   private:
-    EventQueue<Event> eventQueue_;
-    bool interrupt_{};
+    template<typename Channel, typename E>
+    static bool push(void* channel, void const* e) {
+        return static_cast<Channel*>(channel)->try_push(
+          typename Channel::value_type{ *static_cast<E const*>(e) });
+    }
+
+    void* channel_{};
+    std::array<bool (*)(void*, void const*), sizeof...(Events)> pushes_{};
+    std::chrono::microseconds max_wait_{ 1000 };
+    std::atomic<std::uint64_t> dropped_{};
 };
 
-// Asynchronous execution policy
-template<typename Context, template<typename> class Policy = make_hsm_t>
-struct ThreadedExecutionPolicy : Policy<Context> {
-    using type = ThreadedExecutionPolicy<Context, Policy>;
+template<typename T, typename = void>
+struct has_outlet : std::false_type {};
+
+template<typename T>
+struct has_outlet<T, std::void_t<typename T::outlet_type>> : std::true_type {};
+
+template<typename T>
+inline constexpr bool has_outlet_v = has_outlet<T>::value;
+
+// A machine fed by an SpscChannel instead of a locked queue. Its thread
+// handles up to Batch events per wakeup. send_event() must only be called
+// from one thread - in a pipeline that is the upstream stage.
+template<typename Context,
+         std::size_t Capacity = 1024,
+         std::size_t Batch = 64,
+         template<typename> class Policy = make_hsm_t>
+struct ChannelExecutionPolicy : Policy<Context> {
+    using type = ChannelExecutionPolicy<Context, Capacity, Batch, Policy>;
     using HsmType = typename Policy<Context>::type;
     using Event = tuple_to_variant_t<get_events_t<HsmType>>;
+    using Channel = SpscChannel<Event, Capacity>;
 
     void start() {
-        smThread_ = std::thread([this] {
-            while (!interrupt_) {
-                this->process_event();
+        thread_ = std::thread([this] {
+            while (inbox_.wait()) {
+                inbox_.drain(Batch, [this](Event& event) {
+                    std::visit([this](auto& e) { this->handle(e); }, event);
+                });
             }
         });
+        placement_error_ = {};
+        if (!placement_.apply(thread_)) {
+            placement_error_ = { errno, std::system_category() };
+        }
     }
 
     void stop() {
-        eventQueue_.stop();
-        interrupt_ = true;
-        if (smThread_.joinable()) {
-            smThread_.join();
+        inbox_.stop();
+        if (thread_.joinable()) {
+            thread_.join();
         }
     }
 
-    virtual ~ThreadedExecutionPolicy() { stop(); }
+    virtual ~ChannelExecutionPolicy() { stop(); }
 
-    void send_event(Event&& event) {
-        eventQueue_.add_event(std::forward<Event>(event));
+    // Returns false if the channel is full
+    bool send_event(Event const& event) { return inbox_.try_push(event); }
+
+    // Takes effect on the next start()
+    void set_placement(ThreadPlacement const& placement) {
+        placement_ = placement;
     }
 
-  protected:
-    std::thread smThread_;
-    EventQueue<Event> eventQueue_;
-    bool interrupt_{};
+    // Why the thread could not be pinned, empty if it was. Valid once
+    // start() has returned.
+    std::error_code placement_error() const { return placement_error_; }
 
-    void process_event() {
-        // This is a blocking wait
-        Event const& nextEvent = eventQueue_.next_event();
-        if (!eventQueue_.interrupted()) {
-            std::visit([this](auto const& e) { return this->handle(e); },
-                       nextEvent);
-        }
-    }
+    Channel& inbox() { return inbox_; }
+
+  protected:
+    Channel inbox_;
+    std::thread thread_;
+    ThreadPlacement placement_;
+    std::error_code placement_error_;
 };
 
-///
-/// A simple observer class. The notify method will be invoked by an
-/// AsyncExecWithObserver state machine after event processing. This observer
-/// also implements a blocking wait so that test methods can invoke the wait
-/// method to synchronize with the event processing.
-///
-template<typename LockType, typename ConditionVarType>
-struct BlockingObserverT {
-    void notify() {
-        std::unique_lock<std::mutex> lock(smBusyMutex_);
-        notified_ = true;
-        cv_.notify_all();
-    }
+// Stages connected in order: the Outlet of each stage's context publishes
+// into the channel of the next one. Every event an Outlet declares has to be
+// one the next stage takes.
+template<typename... Stages>
+struct PipelineExecutionPolicy {
+    static constexpr bool is_hsm = true;
+    using type = PipelineExecutionPolicy<Stages...>;
+    static constexpr std::size_t stage_count = sizeof...(Stages);
 
-    void wait() {
-        std::unique_lock<std::mutex> lock(smBusyMutex_);
-        cv_.wait(lock, [this] { return this->notified_ == true; });
-        notified_ = false;
+    PipelineExecutionPolicy() {
+        [this]<std::size_t... Is>(std::index_sequence<Is...>) {
+            (connect<Is>(), ...);
+        }(std::make_index_sequence<stage_count - 1>{});
     }
 
-  private:
-    LockType smBusyMutex_;
-    ConditionVarType cv_;
-    bool notified_{};
-};
+    PipelineExecutionPolicy(PipelineExecutionPolicy const&) = delete;
+    PipelineExecutionPolicy& operator=(PipelineExecutionPolicy const&) =
+      delete;
 
-// Preserving for historical reasons
-struct CallbackObserver {
-    void add_callback(std::function<void()>&& cb) {
-        if (cb != nullptr) {
-            cbs_.push_back(cb);
-        }
+    // Start the last stage first so every consumer runs before its producer
+    void start() {
+        [this]<std::size_t... Is>(std::index_sequence<Is...>) {
+            (std::get<stage_count - 1 - Is>(hsms_).start(), ...);
+        }(std::make_index_sequence<stage_count>{});
     }
 
-    void notify() {
-        for (auto const& cb : cbs_) {
-            cb();
-        }
+    void stop() {
+        std::apply([](auto&... stage) { (stage.stop(), ...); }, hsms_);
+    }
+
+    // Feed the first stage. Must only be called from one thread.
+    template<typename Event>
+    bool send_event(Event&& e) {
+        return std::get<0>(hsms_).send_event(std::forward<Event>(e));
     }
 
+    std::tuple<Stages...> hsms_;
+
   private:
-    std::vector<std::function<void()>> cbs_;
+    template<std::size_t I>
+    void connect() {
+        using From = std::tuple_element_t<I, std::tuple<Stages...>>;
+        using To = std::tuple_element_t<I + 1, std::tuple<Stages...>>;
+        static_assert(has_outlet_v<From>,
+                      "Every stage but the last needs an Outlet");
+        check_outlet<To>(static_cast<typename From::outlet_type*>(nullptr));
+        static_cast<typename From::outlet_type&>(std::get<I>(hsms_))
+          .connect(std::get<I + 1>(hsms_).inbox());
+    }
+
+    template<typename To, typename... Events>
+    static constexpr void check_outlet(Outlet<Events...>*) {
+        static_assert(
+          (variant_contains_v<Events, typename To::Event> && ...),
+          "The next stage does not take every event the Outlet publishes");
+    }
 };
 
-#ifdef __FREE_RTOS__
-using BlockingObserver =
-  BlockingObserverT<FreeRTOSMutex, FreeRTOSConditionVariable>;
+template<typename... Contexts>
+using make_pipeline_hsm_t =
+  PipelineExecutionPolicy<ChannelExecutionPolicy<Contexts>...>;
+
+// FNV-1a hash of the compiler's spelling of T. For a machine this names every
+// state and event of its transition table, so adding, removing or renaming one
+// changes the hash.
+template<typename T>
+constexpr std::uint64_t type_fingerprint(std::uint64_t seed) {
+#if defined(_MSC_VER)
+    constexpr char const* name = __FUNCSIG__;
 #else
-using BlockingObserver = BlockingObserverT<std::mutex, std::condition_variable>;
+    constexpr char const* name = __PRETTY_FUNCTION__;
 #endif
-
-///
-/// Another Threaded execution policy. The only difference with
-/// ThreadedExecutionPolicy is that an Observer's notify method will be invoked
-/// at the end of processing each event - specifically, right before the
-/// blocking wait for the next event.
-///
-template<typename Observer,
-         typename Context,
-         template<typename> class Policy = ThreadedExecutionPolicy>
-struct ThreadedExecWithObserver
-  : public Policy<Context>
-  , public Observer {
-    using type = ThreadedExecWithObserver<Observer, Context, Policy>;
-    using HsmType = typename Policy<Context>::type;
-    using HsmType::interrupt_;
-    using HsmType::process_event;
-    using HsmType::smThread_;
-
-    void start() {
-        smThread_ = std::thread([this] {
-            while (!interrupt_) {
-                Observer::notify();
-                process_event();
-            }
-        });
+    std::uint64_t hash = 0xcbf29ce484222325ull ^ seed;
+    for (std::size_t i = 0; name[i] != '\0'; ++i) {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 0x100000001b3ull;
     }
-    virtual ~ThreadedExecWithObserver() = default;
+    return hash;
+}
+
+// Persistent machine store. Snapshots of a fleet of machines live in a
+// file-backed shared mapping laid out as a versioned header followed by one
+// record per machine. The records are plain bytes: a restarted process
+// attaches to the file and reads or updates them in place, without parsing.
+// load() copies a record back into a machine's states. Writes go to the page
+// cache immediately; call checkpoint() to force them to disk.
+struct MappedStoreHeader {
+    static constexpr char Magic[8] = { 't', 's', 'm', 's',
+                                       't', 'o', 'r', 'e' };
+    static constexpr std::uint32_t Version = 2;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+    std::uint32_t snapshot_size;
+    std::uint32_t max_states;
+    std::uint64_t capacity;
+    // type_fingerprint of the machine and Version
+    std::uint64_t fingerprint;
 };
 
-///
-/// Execution policy that uses a BlockingObserver.
-/// This is illustrative of chaining policies together.
-///
-template<typename Context>
-using ThreadedBlockingObserver =
-  ThreadedExecWithObserver<Context, BlockingObserver>;
+template<typename HsmType>
+struct MappedStore {
+    using Record = snapshot_t<HsmType>;
+    static_assert(std::is_trivially_copyable_v<Record>,
+                  "context snapshot_data must be trivially copyable");
+
+    // Records start on a cache line boundary
+    static constexpr std::size_t RecordOffset = 64;
+    static_assert(sizeof(MappedStoreHeader) <= RecordOffset);
+    static_assert(alignof(Record) <= RecordOffset);
+
+    static constexpr std::uint64_t Fingerprint =
+      type_fingerprint<typename HsmType::HsmType>(MappedStoreHeader::Version);
+
+    MappedStore() = default;
+    MappedStore(MappedStore const&) = delete;
+    MappedStore& operator=(MappedStore const&) = delete;
+    ~MappedStore() { close(); }
+
+    // Create (or truncate) a store for `capacity` machines. Every record
+    // starts out as the snapshot of a freshly constructed machine, context
+    // data included. Returns false and sets errno on failure.
+    bool create(char const* path, std::size_t capacity) {
+        close();
+        if (capacity > (SIZE_MAX - RecordOffset) / sizeof(Record)) {
+            errno = EINVAL;
+            return false;
+        }
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        std::size_t length = RecordOffset + capacity * sizeof(Record);
+        if (::ftruncate(fd, static_cast<off_t>(length)) != 0 ||
+            !map(fd, length)) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        ::close(fd);
+
+        auto* header = this->header();
+        std::memcpy(header->magic, MappedStoreHeader::Magic,
+                    sizeof(header->magic));
+        header->version = MappedStoreHeader::Version;
+        header->record_size = sizeof(Record);
+        header->snapshot_size = HsmType::snapshot_size;
+        header->max_states = HsmType::snapshot_max_states;
+        header->capacity = capacity;
+        header->fingerprint = Fingerprint;
+        capacity_ = capacity;
+        auto initial = std::make_unique<HsmType>();
+        Record record{};
+        initial->save_configuration(record.states.data(), record.data);
+        std::fill_n(records(), capacity, record);
+        return true;
+    }
 
-/// Helper to implement a Timed Execution Policy
-template<typename Clock = std::chrono::steady_clock,
-         typename Duration = typename Clock::duration>
-struct Timer {
-    using ClockType = Clock;
-    using DurationType = Duration;
-    void start() {
-        start_time_ = Clock::now();
-        started_ = true;
+    // Attach to an existing store. Fails with EINVAL if the header does not
+    // match this machine type or version. Machines whose records happen to
+    // have the same size are told apart by their fingerprint.
+    bool attach(char const* path) {
+        close();
+        int fd = ::open(path, O_RDWR);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        std::size_t length = static_cast<std::size_t>(st.st_size);
+        if (length < RecordOffset) {
+            ::close(fd);
+            errno = EINVAL;
+            return false;
+        }
+        if (!map(fd, length)) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        ::close(fd);
+
+        auto const* header = this->header();
+        if (std::memcmp(header->magic, MappedStoreHeader::Magic,
+                        sizeof(header->magic)) != 0 ||
+            header->version != MappedStoreHeader::Version ||
+            header->record_size != sizeof(Record) ||
+            header->snapshot_size != HsmType::snapshot_size ||
+            header->max_states != HsmType::snapshot_max_states ||
+            header->fingerprint != Fingerprint ||
+            header->capacity > (length - RecordOffset) / sizeof(Record)) {
+            close();
+            errno = EINVAL;
+            return false;
+        }
+        capacity_ = header->capacity;
+        return true;
     }
 
-    Duration elapsed() const {
-        if (!started_) {
-            return Duration(0);
+    void close() {
+        if (base_ != nullptr) {
+            ::munmap(base_, length_);
         }
-        auto now = Clock::now();
-        auto interval = now - start_time_;
-        return std::chrono::duration_cast<Duration>(interval);
+        base_ = nullptr;
+        length_ = 0;
+        capacity_ = 0;
     }
 
-    template<typename ToDuration = Duration>
-    Duration elapsed(ToDuration since) const {
-        auto now = Clock::now();
-        if constexpr (std::is_same<ToDuration, Duration>::value) {
-            return std::chrono::duration_cast<Duration>(now - since);
-        } else {
-            return std::chrono::duration_cast<ToDuration>(now - since);
+    // Flush dirty pages to the file. With `async` the call only schedules the
+    // write-back.
+    bool checkpoint(bool async = false) {
+        if (base_ == nullptr) {
+            errno = EBADF;
+            return false;
         }
-    }
-    // template function to convert to a different Duration
-    template<typename ToDuration>
-    ToDuration elapsed() const {
-        return std::chrono::duration_cast<ToDuration>(elapsed());
+        return ::msync(base_, length_, async ? MS_ASYNC : MS_SYNC) == 0;
     }
 
-    bool started() const { return started_; }
-    void reset() { start_time_ = Clock::now(); }
-    void stop() { started_ = false; }
+    bool attached() const { return base_ != nullptr; }
+    std::size_t size() const { return capacity_; }
 
-  protected:
-    typename Clock::time_point start_time_;
-    bool started_{ false };
-};
+    Record* records() {
+        return reinterpret_cast<Record*>(static_cast<char*>(base_) +
+                                         RecordOffset);
+    }
+    Record const* records() const {
+        return reinterpret_cast<Record const*>(static_cast<char const*>(base_) +
+                                               RecordOffset);
+    }
+    Record& operator[](std::size_t i) { return records()[i]; }
+    Record const& operator[](std::size_t i) const { return records()[i]; }
 
-// useful for profiling
-template<typename Clock = std::chrono::steady_clock,
-         typename Duration = typename Clock::duration>
-struct IntervalTimer : public Timer<Clock, Duration> {
-    // Return the interval since the previous call to this function, typecast
-    // to the Duration type
-    Duration interval() {
-        if (!this->started()) {
-            this->start();
-            return Duration(0);
-        }
-        auto now = Clock::now();
-        auto interval = now - this->start_time_;
-        this->start_time_ = now;
-        return std::chrono::duration_cast<Duration>(interval);
+    void save(std::size_t i, HsmType const& hsm) {
+        Record& r = records()[i];
+        hsm.save_configuration(r.states.data(), r.data);
     }
-};
 
-#ifdef __linux__
-// Periodic Timer
-// Lock up the calling thread for a period of time. Accuracy is determined by
-// real-time scheduler settings and OS scheduling policies
-template<typename Clock = AccurateClock,
-         typename Duration = typename Clock::duration>
-struct PeriodicSleepTimer : public Timer<Clock, Duration> {
-    PeriodicSleepTimer(Duration period = Duration(1))
-      : period_(period) {}
-    void start() { Timer<Clock, Duration>::start(); }
+    bool load(std::size_t i, HsmType& hsm) const {
+        Record const& r = records()[i];
+        return hsm.restore_configuration(r.states.data(), r.data) != nullptr;
+    }
 
-    void wait() {
-        // calculate time elapsed since last callback
-        auto remaining = period_ - Timer<Clock, Duration>::elapsed();
-        // nanosleep for remaining time
-        // Convert duration to timespec
-        struct timespec ts;
-        ts.tv_sec =
-          std::chrono::duration_cast<std::chrono::seconds>(remaining).count();
-        ts.tv_nsec =
-          std::chrono::duration_cast<std::chrono::nanoseconds>(remaining)
-            .count();
-        // remaining time if -1
-        struct timespec remaining_ts;
-        while (nanosleep(&ts, &remaining_ts) == EINTR) {
-            ts = remaining_ts;
+  private:
+    MappedStoreHeader* header() {
+        return static_cast<MappedStoreHeader*>(base_);
+    }
+
+    bool map(int fd, std::size_t length) {
+        void* base =
+          ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            return false;
         }
-        // ensure that callback finishes within the period
-        Timer<Clock, Duration>::reset();
+        base_ = base;
+        length_ = length;
+        return true;
     }
 
-    Duration get_period() const { return period_; }
+    void* base_{};
+    std::size_t length_{};
+    std::size_t capacity_{};
+};
 
-  protected:
-    Duration period_;
+// Event journal. Records are packed back to back as a 16-bit alternative
+// index followed by the raw bytes of the event, after a header that lists
+// the size of every alternative. Events must be trivially copyable.
+struct JournalHeader {
+    static constexpr char Magic[8] = { 't', 's', 'm', 'j',
+                                       'r', 'n', 'l', '\0' };
+    static constexpr std::uint32_t Version = 1;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t type_count;
+    // followed by type_count std::uint32_t event sizes
 };
 
-// Real-time execution policy
-struct RealtimeConfigurator {
-    RealtimeConfigurator() = default;
-    RealtimeConfigurator(int priority, std::array<int, 4> affinity)
-      : PROCESS_PRIORITY(priority)
-      , CPU_AFFINITY(affinity) {}
+template<typename Variant>
+struct journal_layout;
+
+template<typename... Events>
+struct journal_layout<std::variant<Events...>> {
+    static_assert((std::is_trivially_copyable_v<Events> && ...),
+                  "journaled events must be trivially copyable");
+    static_assert(sizeof...(Events) <= 0xFFFF);
+    // Empty events are stored as their index alone
+    static constexpr std::array<std::uint32_t, sizeof...(Events)> sizes{
+        static_cast<std::uint32_t>(std::is_empty_v<Events> ? 0
+                                                          : sizeof(Events))...
+    };
+    static constexpr std::size_t max_size = std::max({ sizeof(Events)... });
+    static constexpr std::size_t header_size =
+      sizeof(JournalHeader) + sizeof(sizes);
+};
 
-    void config_realtime_thread() {
-        // Set thread to real-time priority
-        struct sched_param param;
-        param.sched_priority = PROCESS_PRIORITY - 3;
-        if (pthread_setschedparam(pthread_self(), SCHED_RR, &param) != 0) {
-            perror("pthread_setschedparam");
+// Records events into a journal file without blocking the caller. record()
+// copies the event into a lock-free ring; a background thread sleeps until
+// there is something to drain and writes it to the file. If the writer falls
+// behind and the ring fills up, events are dropped and counted rather than
+// stalling the state machine. A failed write is latched: the journal stops
+// growing, later events count as dropped and failed()/error() report it.
+template<typename Event, std::size_t Capacity = 4096>
+struct EventRecorder {
+    using Layout = journal_layout<Event>;
+
+    EventRecorder() = default;
+    EventRecorder(EventRecorder const&) = delete;
+    EventRecorder& operator=(EventRecorder const&) = delete;
+    ~EventRecorder() { close(); }
+
+    // Start recording to path. Returns false and sets errno on failure.
+    bool open(char const* path) {
+        close();
+        fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            return false;
         }
-
-        // Set CPU affinity
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        for (auto cpu : CPU_AFFINITY) {
-            CPU_SET(cpu, &cpuset);
+        JournalHeader header{};
+        std::memcpy(header.magic, JournalHeader::Magic, sizeof(header.magic));
+        header.version = JournalHeader::Version;
+        header.type_count = static_cast<std::uint32_t>(Layout::sizes.size());
+        if (!write_all(&header, sizeof(header)) ||
+            !write_all(Layout::sizes.data(), sizeof(Layout::sizes))) {
+            int err = errno;
+            ::close(fd_);
+            fd_ = -1;
+            errno = err;
+            return false;
         }
+        error_.store(0, std::memory_order_relaxed);
+        ring_.restart();
+        writer_ = std::thread([this] { this->write_loop(); });
+        return true;
+    }
 
-        if (pthread_setaffinity_np(
-              pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
-            perror("sched_setaffinity");
+    // Flush everything recorded so far and close the file
+    void close() {
+        if (writer_.joinable()) {
+            ring_.stop();
+            writer_.join();
         }
-
-        // Lock memory
-        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
-            perror("mlockall failed");
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
         }
     }
 
-    template<typename Fn>
-    std::thread real_time_thread(Fn fn) {
-        return std::thread([this, fn] {
-            this->config_realtime_thread();
-            fn();
-        });
+    bool recording() const { return fd_ >= 0; }
+
+    // Called on the state machine thread. Never blocks.
+    void record(Event const& e) {
+        if (fd_ < 0) {
+            return;
+        }
+        Slot slot;
+        slot.index = static_cast<std::uint16_t>(e.index());
+        std::visit(
+          [&slot](auto const& ev) {
+              if constexpr (!std::is_empty_v<std::decay_t<decltype(ev)>>) {
+                  std::memcpy(slot.payload, &ev, sizeof(ev));
+              }
+          },
+          e);
+        if (!ring_.try_push(slot)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
     }
 
-    std::thread make_real_time(std::thread&& t) {
-        config_realtime_thread();
-        return std::move(t);
+    std::uint64_t dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
     }
 
-  protected:
-    int PROCESS_PRIORITY{ 98 };
-    std::array<int, 4> CPU_AFFINITY{ 0, 1, 2, 3 };
-};
+    // Events recorded but not yet handed to the writer
+    std::size_t pending() const { return ring_.size(); }
 
-// Real-time execution policy - set cpu isolation in grub
-template<typename Context,
-         template<typename> class Policy = ThreadedExecutionPolicy>
-struct RealtimeExecutionPolicy
-  : Policy<Context>
-  , RealtimeConfigurator {
-    using type = RealtimeExecutionPolicy<Context, Policy>;
-    using HsmType = typename Policy<Context>::type;
-    using HsmType::interrupt_;
-    using HsmType::process_event;
-    using HsmType::smThread_;
+    // Has a write to the journal failed? The journal then ends at the last
+    // complete buffer.
+    bool failed() const { return error_.load(std::memory_order_acquire) != 0; }
+    std::error_code error() const {
+        return { error_.load(std::memory_order_acquire),
+                 std::generic_category() };
+    }
 
-    void start() {
-        smThread_ = RealtimeConfigurator::real_time_thread([this] {
-            while (!interrupt_) {
-                process_event();
+  private:
+    struct Slot {
+        std::uint16_t index;
+        unsigned char payload[Layout::max_size];
+    };
+
+    bool write_all(void const* data, std::size_t size) {
+        auto const* p = static_cast<char const*>(data);
+        while (size > 0) {
+            auto n = ::write(fd_, p, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
             }
-        });
+            p += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
     }
 
-    virtual ~RealtimeExecutionPolicy() = default;
-};
+    void write_loop() {
+        // Batch records into one write() per buffer
+        constexpr std::size_t BufferSize = 64 * 1024;
+        std::array<unsigned char, BufferSize> buffer;
+        std::size_t used = 0;
+        auto flush = [&] {
+            if (used > 0 && !failed() && !write_all(buffer.data(), used)) {
+                error_.store(errno, std::memory_order_release);
+            }
+            used = 0;
+        };
+        auto append = [&](Slot const& slot) {
+            if (failed()) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::size_t size = Layout::sizes[slot.index];
+            if (used + sizeof(slot.index) + size > BufferSize) {
+                flush();
+            }
+            std::memcpy(buffer.data() + used, &slot.index,
+                        sizeof(slot.index));
+            std::memcpy(buffer.data() + used + sizeof(slot.index),
+                        slot.payload, size);
+            used += sizeof(slot.index) + size;
+        };
+        // wait() returns false once close() stopped the ring; whatever was
+        // recorded before that is still drained
+        for (;;) {
+            bool running = ring_.wait();
+            while (ring_.drain(Capacity, append) > 0) {
+            }
+            flush();
+            if (!running) {
+                return;
+            }
+        }
+    }
 
-// Periodic execution policy
-template<typename Context,
-         template<typename> class Policy = ThreadedExecutionPolicy,
-         typename PeriodicTimer = PeriodicSleepTimer<std::chrono::steady_clock,
-                                                     std::chrono::milliseconds>>
-struct PeriodicExecutionPolicy
-  : Policy<Context>
-  , PeriodicTimer {
-    using type = PeriodicExecutionPolicy<Context, Policy, PeriodicTimer>;
-    using HsmType = typename Policy<Context>::type;
-    using TimerType = PeriodicTimer;
-    using HsmType::interrupt_;
-    using HsmType::send_event;
+    SpscChannel<Slot, Capacity> ring_;
+    std::thread writer_;
+    std::atomic<std::uint64_t> dropped_{};
+    // errno of the first failed write
+    std::atomic<int> error_{};
+    int fd_{ -1 };
+};
 
-    void start() {
-        PeriodicTimer::start();
-        ThreadedExecutionPolicy<Context>::start();
+struct ReplayStats {
+    std::uint64_t events{};
+    std::uint64_t handled{};
+    double seconds{};
+    // false if the journal ended in a truncated or unknown record
+    bool complete{ true };
 
-        eventThread_ = std::thread([this] {
-            while (!interrupt_) {
-                PeriodicTimer::wait();
-                ++tick_event_.ticks_;
-                this->send_event(tick_event_);
-            }
-        });
+    double events_per_second() const {
+        return seconds > 0 ? static_cast<double>(events) / seconds : 0;
     }
+};
 
-    void stop() {
-        ThreadedExecutionPolicy<Context>::stop();
-        if (eventThread_.joinable()) {
-            eventThread_.join();
+// Replays a journal straight from a read-only mapping into Hsm::handle.
+// Each record is decoded with a jump table indexed by the stored alternative.
+template<typename Event>
+struct JournalReplayer {
+    using Layout = journal_layout<Event>;
+
+    JournalReplayer() = default;
+    JournalReplayer(JournalReplayer const&) = delete;
+    JournalReplayer& operator=(JournalReplayer const&) = delete;
+    ~JournalReplayer() { close(); }
+
+    // Map a journal. Fails with EINVAL if it was written for other events.
+    bool open(char const* path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
         }
+        length_ = static_cast<std::size_t>(st.st_size);
+        if (length_ < Layout::header_size) {
+            ::close(fd);
+            errno = EINVAL;
+            return false;
+        }
+        void* base = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        base_ = static_cast<unsigned char const*>(base);
+        ::madvise(base, length_, MADV_SEQUENTIAL);
+
+        JournalHeader header;
+        std::memcpy(&header, base_, sizeof(header));
+        if (std::memcmp(header.magic, JournalHeader::Magic,
+                        sizeof(header.magic)) != 0 ||
+            header.version != JournalHeader::Version ||
+            header.type_count != Layout::sizes.size() ||
+            std::memcmp(base_ + sizeof(header), Layout::sizes.data(),
+                        sizeof(Layout::sizes)) != 0) {
+            close();
+            errno = EINVAL;
+            return false;
+        }
+        return true;
     }
-    virtual ~PeriodicExecutionPolicy() { stop(); }
-
-    int get_ticks() { return tick_event_.ticks_; }
-
-  protected:
-    std::thread eventThread_;
-    ClockTickEvent tick_event_;
-};
 
-// Periodic Real-time execution policy
-template<typename Context,
-         template<typename> class Policy = ThreadedExecutionPolicy,
-         typename PeriodicTimer = PeriodicSleepTimer<std::chrono::steady_clock,
-                                                     std::chrono::milliseconds>>
-struct RealtimePeriodicExecutionPolicy
-  : RealtimeConfigurator
-  , Policy<Context>
-  , PeriodicTimer {
-    using type =
-      RealtimePeriodicExecutionPolicy<Context, Policy, PeriodicTimer>;
-    using TimerType = PeriodicTimer;
-    using HsmType = typename Policy<Context>::type;
-    using HsmType::interrupt_;
-    using HsmType::process_event;
-    using HsmType::send_event;
-    using HsmType::smThread_;
+    void close() {
+        if (base_ != nullptr) {
+            ::munmap(const_cast<unsigned char*>(base_), length_);
+        }
+        base_ = nullptr;
+        length_ = 0;
+    }
 
-    void start() {
-        PeriodicTimer::start();
-        smThread_ = RealtimeConfigurator::real_time_thread([this] {
-            while (!interrupt_) {
-                this->process_event();
-            }
-        });
+    template<typename HsmType>
+    ReplayStats replay(HsmType& hsm) const {
+        return replay(hsm, std::make_index_sequence<Layout::sizes.size()>{});
+    }
 
-        eventThread_ = RealtimeConfigurator::real_time_thread([this] {
-            while (!interrupt_) {
-                PeriodicTimer::wait();
-                ++tick_event_.ticks_;
-                this->send_event(tick_event_);
+  private:
+    template<typename HsmType, std::size_t... Is>
+    ReplayStats replay(HsmType& hsm, std::index_sequence<Is...>) const {
+        using Decoder = bool (*)(HsmType&, unsigned char const*);
+        static constexpr Decoder decoders[] = { &decode<HsmType, Is>... };
+
+        ReplayStats stats;
+        if (base_ == nullptr) {
+            stats.complete = false;
+            return stats;
+        }
+        auto const* p = base_ + Layout::header_size;
+        auto const* end = base_ + length_;
+        auto start = std::chrono::steady_clock::now();
+        while (p + sizeof(std::uint16_t) <= end) {
+            std::uint16_t index;
+            std::memcpy(&index, p, sizeof(index));
+            p += sizeof(index);
+            if (index >= Layout::sizes.size() ||
+                static_cast<std::size_t>(end - p) < Layout::sizes[index]) {
+                stats.complete = false;
+                break;
             }
-        });
+            stats.handled += decoders[index](hsm, p);
+            p += Layout::sizes[index];
+            ++stats.events;
+        }
+        if (p != end) {
+            stats.complete = false;
+        }
+        stats.seconds = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+        return stats;
     }
 
-    void stop() {
-        ThreadedExecutionPolicy<Context>::stop();
-        if (eventThread_.joinable()) {
-            eventThread_.join();
+    // Events are handed over as const lvalues, exactly like the threaded
+    // policies' process_event() does, so the replay takes the same paths
+    template<typename HsmType, std::size_t I>
+    static bool decode(HsmType& hsm, unsigned char const* p) {
+        std::variant_alternative_t<I, Event> e{};
+        if constexpr (!std::is_empty_v<decltype(e)>) {
+            std::memcpy(&e, p, sizeof(e));
         }
+        return hsm.handle(static_cast<decltype(e) const&>(e));
     }
-    virtual ~RealtimePeriodicExecutionPolicy() { stop(); }
-
-    int get_ticks() { return tick_event_.ticks_; }
 
-  protected:
-    std::thread eventThread_;
-    ClockTickEvent tick_event_;
+    unsigned char const* base_{};
+    std::size_t length_{};
 };
 
-// Concurrent HSMs
-template<typename... Hsms>
-struct ConcurrentExecutionPolicy {
-    static constexpr bool is_hsm = true;
-    using type = ConcurrentExecutionPolicy<Hsms...>;
+// Threaded execution policy that journals every event it processes, in the
+// order the machine handles them. Compose with RealtimeExecutionPolicy etc.
+// through the Policy parameter; the wrapped policy's start() runs as is, so
+// its thread setup still applies. Recording starts with start_recording().
+template<typename Context,
+         template<typename> class Policy = ThreadedExecutionPolicy>
+struct RecordingExecutionPolicy : Policy<Context> {
+    using type = RecordingExecutionPolicy<Context, Policy>;
+    using HsmType = typename Policy<Context>::type;
+    using Event = typename HsmType::Event;
 
-    template<typename Event>
-    void entry(Event e = Event()) {
-        std::apply([e](auto&... hsm) { (hsm.entry(e), ...); }, hsms_);
+    RecordingExecutionPolicy() {
+        this->observe_events(
+          [](void* recorder, Event const& e) {
+              static_cast<EventRecorder<Event>*>(recorder)->record(e);
+          },
+          &recorder_);
     }
 
-    template<typename Event>
-    void exit(Event&& e) {
-        std::apply([e](auto&... hsm) { (hsm.exit(e), ...); }, hsms_);
-    }
+    bool start_recording(char const* path) { return recorder_.open(path); }
+    void stop_recording() { recorder_.close(); }
 
-    template<typename Event>
-    void send_event(Event&& e) {
-        return std::apply(
-          // send event to all HSMs
-          [e](auto&... hsm) { (hsm.send_event(e), ...); },
-          hsms_);
+    void stop() {
+        HsmType::stop();
+        recorder_.close();
     }
 
-    // assume hsms can be `tick`ed
-
-    void tick() {
-        std::apply([](auto&... hsm) { (hsm.tick(), ...); }, hsms_);
-    }
+    virtual ~RecordingExecutionPolicy() { stop(); }
 
-    std::tuple<Hsms...> hsms_;
-};
+    EventRecorder<Event>& recorder() { return recorder_; }
 
-// Each HSM in the concurrent HSM is wrapped with a ThreadedExecutionPolicy
-template<template<typename> class Policy = ThreadedExecutionPolicy,
-         typename... Ts>
-struct make_concurrent_hsm {
-    using type = ConcurrentExecutionPolicy<Policy<Ts>...>;
+  protected:
+    EventRecorder<Event> recorder_;
 };
 
-template<template<typename> class Policy = ThreadedExecutionPolicy,
-         typename... Ts>
-using make_concurrent_hsm_t = typename make_concurrent_hsm<Policy, Ts...>::type;
-
 #endif // __linux__
 
 } // namespace detail
@@ -1526,6 +5756,16 @@ template<typename Context,
          template<class> class Policy = detail::RealtimePeriodicExecutionPolicy>
 using RealtimePeriodicHsm = Policy<Context>;
 
+/// A periodic state machine driven by a VirtualClock instead of wall time.
+/// E.g.
+/// VirtualPeriodicHsm<MyContext> sm;
+/// sm.start();
+/// sm.advance(std::chrono::hours(1)); // 3,600,000 ticks of 1ms, right now
+///
+template<typename Context,
+         template<class> class Policy = detail::VirtualPeriodicExecutionPolicy>
+using VirtualPeriodicHsm = Policy<Context>;
+
 // Real-time state machine. This state machine is driven by a periodic timer.
 template<typename Context,
          template<class> class Policy = detail::RealtimeExecutionPolicy>
@@ -1536,4 +5776,43 @@ template<template<typename> class Policy = detail::ThreadedExecutionPolicy,
          typename... Contexts>
 using ConcurrentHsm = detail::make_concurrent_hsm_t<Policy, Contexts...>;
 
+// Machines chained by SPSC channels, e.g. parser -> session -> output
+template<typename... Contexts>
+using PipelineHsm = detail::make_pipeline_hsm_t<Contexts...>;
+
+// Concurrent Hsm fed by a zero-copy broadcast ring
+template<template<typename> class Policy = detail::make_hsm_t,
+         std::size_t Capacity = 1024,
+         typename... Contexts>
+using MulticastHsm =
+  detail::make_multicast_hsm_t<Policy, Capacity, Contexts...>;
+
 } // namespace tsm
+
+// Explicit instantiation of a machine and its execution policy, so that the
+// translation units sharing a machine don't each instantiate it. Next to the
+// context definition, in its header:
+//   TSM_EXTERN_MACHINE(tsm::detail::ThreadedExecutionPolicy, Conveyor);
+// and in exactly one source file:
+//   TSM_INSTANTIATE_MACHINE(tsm::detail::ThreadedExecutionPolicy, Conveyor);
+// The non-template members (the policy's event loop and its visit over every
+// event) are then compiled once. Member templates such as handle<Event> are
+// still instantiated where they are used. A further policy around the same
+// context takes TSM_EXTERN_POLICY and TSM_INSTANTIATE_POLICY.
+#define TSM_HSM_INSTANTIATION_(Extern, Context)                                \
+    Extern template struct ::tsm::detail::Hsm<                                 \
+      Context,                                                                 \
+      ::tsm::detail::wrap_transitions_t<Context::transitions>>
+
+#define TSM_EXTERN_POLICY(Policy, Context)                                     \
+    extern template struct Policy<Context>
+
+#define TSM_INSTANTIATE_POLICY(Policy, Context) template struct Policy<Context>
+
+#define TSM_EXTERN_MACHINE(Policy, Context)                                    \
+    TSM_HSM_INSTANTIATION_(extern, Context);                                   \
+    TSM_EXTERN_POLICY(Policy, Context)
+
+#define TSM_INSTANTIATE_MACHINE(Policy, Context)                               \
+    TSM_HSM_INSTANTIATION_(, Context);                                         \
+    TSM_INSTANTIATE_POLICY(Policy, Context)
@@ -423,6 +423,99 @@ TEST_CASE("Test RealtimeExecutionPolicy") {
     hsm.stop();
 }
 
+// Notes the scheduling class of the thread that handles its events
+struct SchedulingProbe {
+    struct Toggle {};
+    struct Off {};
+    struct On {
+        void entry(SchedulingProbe& p) { p.policy_ = sched_getscheduler(0); }
+    };
+    using transitions =
+      std::tuple<Transition<Off, Toggle, On>, Transition<On, Toggle, Off>>;
+    std::atomic<int> policy_{ -1 };
+};
+
+TEST_CASE("RealtimeExecutionPolicy reports configuration errors") {
+    using SwitchRealtimeHsm = RealtimeExecutionPolicy<SwitchHsmContext>;
+    RealtimeParams params;
+    params.policy = SchedulingPolicy::Other;
+    params.lock = MemoryLock::Regions;
+    params.stack_prefault = 128 * 1024;
+
+    SwitchRealtimeHsm hsm;
+    hsm.set_params(params);
+    hsm.set_placement(ThreadPlacement{ 0 });
+    hsm.start();
+    // start() returns once the thread is configured
+    REQUIRE_FALSE(hsm.status().affinity);
+    REQUIRE_FALSE(hsm.status().scheduling);
+    hsm.send_event(SwitchHsmContext::Toggle{});
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(hsm.current_state_));
+    hsm.stop();
+
+    // runtime > deadline is rejected by the kernel, or SCHED_DEADLINE is
+    // not available at all - either way it is reported, not printed
+    params.policy = SchedulingPolicy::Deadline;
+    params.runtime = std::chrono::milliseconds(2);
+    params.deadline = std::chrono::milliseconds(1);
+    params.period = std::chrono::milliseconds(1);
+    SwitchRealtimeHsm deadline;
+    deadline.set_params(params);
+    deadline.start();
+    REQUIRE(deadline.status().scheduling);
+    REQUIRE_FALSE(deadline.status().ok());
+    deadline.stop();
+}
+
+TEST_CASE("RealtimeExecutionPolicy reaches SCHED_DEADLINE with the default "
+          "placement") {
+    using ProbeHsm = RealtimeExecutionPolicy<SchedulingProbe>;
+    RealtimeParams params;
+    params.policy = SchedulingPolicy::Deadline;
+    params.runtime = std::chrono::microseconds(500);
+    params.deadline = std::chrono::milliseconds(10);
+    params.period = std::chrono::milliseconds(10);
+
+    // The default placement pins to CPUs 0-3, which would make the kernel
+    // refuse SCHED_DEADLINE on larger machines; Deadline threads skip it
+    ProbeHsm hsm;
+    hsm.set_params(params);
+    hsm.start();
+    auto const& status = hsm.status();
+    REQUIRE_FALSE(status.affinity);
+    hsm.send_event(SchedulingProbe::Toggle{});
+    while (hsm.policy_ < 0) {
+        std::this_thread::yield();
+    }
+    constexpr int SchedDeadline = 6;
+    if (!status.scheduling) {
+        REQUIRE(hsm.policy_ == SchedDeadline);
+    } else {
+        // e.g. no privilege: reported as a structured error
+        REQUIRE(status.scheduling.category() == std::system_category());
+        REQUIRE(hsm.policy_ != SchedDeadline);
+    }
+    hsm.stop();
+}
+
+TEST_CASE("Process-wide real-time memory setup is explicit") {
+    // Locking every page needs privilege; the heap reserve always works
+    auto err = prepare_realtime_process(false, 1 << 20);
+    REQUIRE_FALSE(err);
+#ifdef __GLIBC__
+    // back to glibc's defaults for the rest of the tests
+    mallopt(M_TRIM_THRESHOLD, 128 * 1024);
+    mallopt(M_MMAP_MAX, 65536);
+#endif
+    err = prepare_realtime_process(true);
+    if (err) {
+        REQUIRE(err.category() == std::system_category());
+    } else {
+        munlockall();
+    }
+}
+
 // Test RealtimePeriodicExecutionPolicy - use traffic light HSM
 TEST_CASE("Test PeriodicExecutionPolicy") {
     // default is to send a timer tick event every 1ms
@@ -522,3 +615,1864 @@ TEST_CASE("TrafficLightAG") {
     REQUIRE(std::holds_alternative<TrafficLightAG::LightContext::G1*>(
       hsm.current_state_));
 }
+
+// Events raised from actions and entry handlers go through the internal queue
+namespace InternalEvents {
+struct Start {};
+struct Finish {};
+struct Reset {};
+
+struct Context : InternalEventQueue<4, Finish> {
+    struct Idle {};
+    struct Busy {
+        void entry(Context& c) {
+            c.trace_ += 'b';
+            c.post_internal(Finish{});
+        }
+    };
+    struct Done {
+        void entry(Context& c) { c.trace_ += 'd'; }
+    };
+
+    void on_start() { trace_ += 's'; }
+
+    using transitions =
+      std::tuple<Transition<Idle, Start, Busy, &Context::on_start>,
+                 Transition<Busy, Finish, Done>,
+                 Transition<Done, Reset, Idle>>;
+
+    std::string trace_;
+};
+}
+
+TEST_CASE("InternalEventQueue run-to-completion") {
+    using Hsm = make_hsm_t<InternalEvents::Context>;
+    Hsm hsm;
+    REQUIRE(hsm.handle(InternalEvents::Start{}));
+    // Finish is processed only after the Start transition completed
+    REQUIRE(hsm.trace_ == "sbd");
+    REQUIRE(std::holds_alternative<InternalEvents::Context::Done*>(
+      hsm.current_state_));
+    REQUIRE_FALSE(hsm.has_internal_events());
+
+    // Events posted from outside a handler are drained before the next
+    // external event
+    hsm.handle(InternalEvents::Reset{});
+    REQUIRE(hsm.post_internal(InternalEvents::Finish{}));
+    REQUIRE_FALSE(hsm.handle(InternalEvents::Reset{}));
+    REQUIRE(std::holds_alternative<InternalEvents::Context::Idle*>(
+      hsm.current_state_));
+
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(hsm.post_internal(InternalEvents::Finish{}));
+    }
+    REQUIRE_FALSE(hsm.post_internal(InternalEvents::Finish{}));
+}
+
+// Snapshot and restore
+namespace SnapshotTest {
+struct Counter {
+    struct Toggle {};
+    struct Off {};
+    struct On {
+        void entry(Counter& c) { c.entries_++; }
+    };
+
+    struct snapshot_data {
+        int entries;
+    };
+    void save_snapshot(snapshot_data& d) const { d.entries = entries_; }
+    void restore_snapshot(snapshot_data const& d) { entries_ = d.entries; }
+
+    using transitions =
+      std::tuple<Transition<Off, Toggle, On>, Transition<On, Toggle, Off>>;
+
+    int entries_{};
+};
+
+// The same layout as Counter with a different event
+struct Lookalike {
+    struct Flip {};
+    struct Off {};
+    struct On {
+        void entry(Lookalike& c) { c.entries_++; }
+    };
+
+    struct snapshot_data {
+        int entries;
+    };
+    void save_snapshot(snapshot_data& d) const { d.entries = entries_; }
+    void restore_snapshot(snapshot_data const& d) { entries_ = d.entries; }
+
+    using transitions =
+      std::tuple<Transition<Off, Flip, On>, Transition<On, Flip, Off>>;
+
+    int entries_{};
+};
+
+// Context data that does not start out as zero
+struct Limited {
+    struct Raise {};
+    struct Low {};
+    struct High {
+        void entry(Limited& l) { l.limit_ *= 2; }
+    };
+
+    struct snapshot_data {
+        int limit;
+    };
+    void save_snapshot(snapshot_data& d) const { d.limit = limit_; }
+    void restore_snapshot(snapshot_data const& d) { limit_ = d.limit; }
+
+    using transitions = std::tuple<Transition<Low, Raise, High>>;
+
+    int limit_{ 100 };
+};
+}
+
+TEST_CASE("Snapshot and restore a nested Hsm") {
+    using LightHsm = make_hsm_t<TrafficLight::LightContext>;
+    using EmergencyOverrideHsm =
+      make_hsm_t<TrafficLight::EmergencyOverrideContext>;
+    using TrafficLightHsm =
+      ClockedHsm<make_hsm_t<TrafficLight::TrafficLightHsmContext>>;
+
+    TrafficLightHsm hsm;
+    for (int i = 0; i < 30; i++) {
+        hsm.tick();
+    }
+    hsm.handle(TrafficLight::TrafficLightHsmContext::EmergencySwitchOn());
+    for (int i = 0; i < 5; i++) {
+        hsm.tick();
+    }
+    auto snapshot = hsm.snapshot();
+    STATIC_REQUIRE(std::is_trivially_copyable_v<decltype(snapshot)>);
+    STATIC_REQUIRE(sizeof(snapshot.states) == 3);
+
+    TrafficLightHsm restored;
+    REQUIRE(restored.restore(snapshot));
+    REQUIRE(std::holds_alternative<EmergencyOverrideHsm*>(
+      restored.current_state_));
+    auto* emergency = std::get<EmergencyOverrideHsm*>(restored.current_state_);
+    REQUIRE(std::holds_alternative<TrafficLight::EmergencyOverrideContext::Y1*>(
+      emergency->current_state_));
+    // The inactive sub-machine keeps its history
+    auto& light = std::get<LightHsm>(restored.states_);
+    REQUIRE(std::holds_alternative<TrafficLight::LightContext::Y1*>(
+      light.current_state_));
+
+    restored.handle(TrafficLight::TrafficLightHsmContext::EmergencySwitchOff());
+    REQUIRE(std::holds_alternative<LightHsm*>(restored.current_state_));
+
+    snapshot.states[0] = 7;
+    REQUIRE_FALSE(restored.restore(snapshot));
+}
+
+TEST_CASE("Snapshot context data and bulk restore") {
+    using CounterHsm = make_hsm_t<SnapshotTest::Counter>;
+    std::array<CounterHsm, 4> machines{};
+    for (std::size_t i = 0; i < machines.size(); i++) {
+        for (std::size_t j = 0; j <= i; j++) {
+            machines[i].handle(SnapshotTest::Counter::Toggle{});
+        }
+    }
+    std::array<snapshot_t<CounterHsm>, 4> snapshots{};
+    snapshot_all(machines.data(), machines.size(), snapshots.data());
+
+    std::array<CounterHsm, 4> restored{};
+    REQUIRE(restore_all(restored.data(), restored.size(), snapshots.data()) ==
+            4);
+    for (std::size_t i = 0; i < restored.size(); i++) {
+        REQUIRE(restored[i].current_state_.index() ==
+                machines[i].current_state_.index());
+        REQUIRE(restored[i].entries_ == machines[i].entries_);
+    }
+    // restore does not run entry handlers
+    REQUIRE(restored[0].entries_ == 1);
+
+    // Orthogonal regions are stored one after the other
+    using Regions = OrthogonalExecutionPolicy<CounterHsm, SwitchHsm>;
+    Regions regions;
+    regions.handle(SnapshotTest::Counter::Toggle{});
+    Regions regions_copy;
+    REQUIRE(regions_copy.restore(regions.snapshot()));
+    REQUIRE(std::holds_alternative<SnapshotTest::Counter::On*>(
+      std::get<0>(regions_copy.hsms_).current_state_));
+    REQUIRE(std::holds_alternative<SwitchHsmContext::Off*>(
+      std::get<1>(regions_copy.hsms_).current_state_));
+}
+
+#ifdef __linux__
+#include <cerrno>
+#include <filesystem>
+TEST_CASE("MappedStore survives a reattach") {
+    using CounterHsm = make_hsm_t<SnapshotTest::Counter>;
+    auto path =
+      (std::filesystem::temp_directory_path() / "tsm_mapped_store_test.bin")
+        .string();
+    {
+        MappedStore<CounterHsm> store;
+        REQUIRE(store.create(path.c_str(), 16));
+        REQUIRE(store.size() == 16);
+        CounterHsm hsm;
+        hsm.handle(SnapshotTest::Counter::Toggle{});
+        store.save(3, hsm);
+        REQUIRE(store.checkpoint());
+    }
+    MappedStore<CounterHsm> store;
+    REQUIRE(store.attach(path.c_str()));
+    REQUIRE(store.size() == 16);
+    CounterHsm hsm;
+    REQUIRE(store.load(3, hsm));
+    REQUIRE(std::holds_alternative<SnapshotTest::Counter::On*>(
+      hsm.current_state_));
+    REQUIRE(hsm.entries_ == 1);
+    REQUIRE(store.load(4, hsm));
+    REQUIRE(std::holds_alternative<SnapshotTest::Counter::Off*>(
+      hsm.current_state_));
+    REQUIRE(hsm.entries_ == 0);
+
+    // A store written for a different machine is rejected
+    MappedStore<make_hsm_t<TrafficLight::TrafficLightHsmContext>> other;
+    REQUIRE_FALSE(other.attach(path.c_str()));
+    REQUIRE(errno == EINVAL);
+
+    // So is one whose records have the same size but whose type differs
+    using LookalikeHsm = make_hsm_t<SnapshotTest::Lookalike>;
+    STATIC_REQUIRE(sizeof(snapshot_t<LookalikeHsm>) ==
+                   sizeof(snapshot_t<CounterHsm>));
+    MappedStore<LookalikeHsm> lookalike;
+    errno = 0;
+    REQUIRE_FALSE(lookalike.attach(path.c_str()));
+    REQUIRE(errno == EINVAL);
+    store.close();
+
+    // A capacity whose byte size wraps around does not pass for a small one
+    using Record = snapshot_t<CounterHsm>;
+    std::uint64_t capacity = ~std::uint64_t{} / sizeof(Record) + 1;
+    int fd = ::open(path.c_str(), O_RDWR);
+    REQUIRE(fd >= 0);
+    REQUIRE(::pwrite(fd,
+                     &capacity,
+                     sizeof(capacity),
+                     offsetof(MappedStoreHeader, capacity)) ==
+            sizeof(capacity));
+    ::close(fd);
+    errno = 0;
+    REQUIRE_FALSE(store.attach(path.c_str()));
+    REQUIRE(errno == EINVAL);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("MappedStore records start out as fresh machines") {
+    using LimitedHsm = make_hsm_t<SnapshotTest::Limited>;
+    auto path =
+      (std::filesystem::temp_directory_path() / "tsm_mapped_limits.bin")
+        .string();
+    MappedStore<LimitedHsm> store;
+    REQUIRE(store.create(path.c_str(), 4));
+    LimitedHsm hsm;
+    hsm.handle(SnapshotTest::Limited::Raise{});
+    REQUIRE(hsm.limit_ == 200);
+    // an unsaved record holds the context's defaults, not zeroes
+    REQUIRE(store.load(2, hsm));
+    REQUIRE(hsm.limit_ == 100);
+    REQUIRE(std::holds_alternative<SnapshotTest::Limited::Low*>(
+      hsm.current_state_));
+
+    // more machines than a size_t can count the bytes of
+    MappedStore<LimitedHsm> huge;
+    errno = 0;
+    REQUIRE_FALSE(huge.create(path.c_str(), SIZE_MAX / 2));
+    REQUIRE(errno == EINVAL);
+    store.close();
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Record a journal and replay it") {
+    using TrafficLightHsm =
+      RecordingExecutionPolicy<TrafficLight::TrafficLightHsmContext>;
+    using LightHsm = make_hsm_t<TrafficLight::LightContext>;
+    using EmergencyOverrideHsm =
+      make_hsm_t<TrafficLight::EmergencyOverrideContext>;
+    auto path =
+      (std::filesystem::temp_directory_path() / "tsm_journal_test.bin")
+        .string();
+
+    TrafficLightHsm hsm;
+    REQUIRE(hsm.start_recording(path.c_str()));
+    hsm.start();
+    for (int i = 0; i < 3; i++) {
+        hsm.send_event(ClockTickEvent{ i });
+    }
+    hsm.send_event(TrafficLight::TrafficLightHsmContext::EmergencySwitchOn());
+    CompletionToken last;
+    for (int i = 0; i < 5; i++) {
+        last = hsm.send_event(ClockTickEvent{ 1 });
+    }
+    // stop() discards queued events; wait for the last one to be handled
+    REQUIRE(last);
+    hsm.wait(last);
+    hsm.stop();
+    REQUIRE(hsm.recorder().dropped() == 0);
+    REQUIRE_FALSE(hsm.recorder().failed());
+
+    JournalReplayer<TrafficLightHsm::Event> replayer;
+    REQUIRE(replayer.open(path.c_str()));
+    make_hsm_t<TrafficLight::TrafficLightHsmContext> replayed;
+    auto stats = replayer.replay(replayed);
+    REQUIRE(stats.complete);
+    REQUIRE(stats.events == 9);
+    REQUIRE(std::holds_alternative<EmergencyOverrideHsm*>(
+      replayed.current_state_));
+    REQUIRE(std::get<EmergencyOverrideHsm*>(replayed.current_state_)
+              ->current_state_.index() ==
+            std::get<EmergencyOverrideHsm*>(hsm.current_state_)
+              ->current_state_.index());
+    REQUIRE(std::get<LightHsm>(replayed.states_).current_state_.index() ==
+            std::get<LightHsm>(hsm.states_).current_state_.index());
+
+    // A journal of different events is rejected
+    JournalReplayer<std::variant<ClockTickEvent>> other;
+    REQUIRE_FALSE(other.open(path.c_str()));
+    replayer.close();
+    std::filesystem::remove(path);
+}
+
+template<typename Context>
+using RecordedRealtimePolicy =
+  RecordingExecutionPolicy<Context, RealtimeExecutionPolicy>;
+
+TEST_CASE("Record a journal through the real-time policy") {
+    using ProbeHsm = RecordedRealtimePolicy<SchedulingProbe>;
+    auto path =
+      (std::filesystem::temp_directory_path() / "tsm_rt_journal_test.bin")
+        .string();
+
+    ProbeHsm hsm;
+    REQUIRE(hsm.start_recording(path.c_str()));
+    hsm.start();
+    hsm.send_event(SchedulingProbe::Toggle{});
+    hsm.send_event(SchedulingProbe::Toggle{});
+    auto last = hsm.send_event(SchedulingProbe::Toggle{});
+    REQUIRE(hsm.wait(last) == EventResult::Handled);
+    // the wrapped policy configured the machine thread
+    if (!hsm.status().scheduling) {
+        REQUIRE(hsm.policy_ == SCHED_RR);
+    }
+    hsm.stop();
+    REQUIRE_FALSE(hsm.recorder().failed());
+
+    JournalReplayer<ProbeHsm::Event> replayer;
+    REQUIRE(replayer.open(path.c_str()));
+    make_hsm_t<SchedulingProbe> replayed;
+    auto stats = replayer.replay(replayed);
+    REQUIRE(stats.events == 3);
+    REQUIRE(replayed.current_state_.index() == hsm.current_state_.index());
+    replayer.close();
+    std::filesystem::remove(path);
+}
+#endif // __linux__
+
+// Three level hierarchy for flattening
+namespace Flat {
+struct Next {};
+struct Up {};
+struct Down {};
+struct Stop {};
+struct Go {};
+
+struct Deep {
+    struct A {
+        void entry(Deep& d) { d.a_entries_++; }
+    };
+    struct B {
+        void exit(Deep& d) { d.b_exits_++; }
+    };
+    using transitions = std::tuple<Transition<A, Next, B>,
+                                   Transition<B, Next, A>,
+                                   // shadows the parent's Stop while in B
+                                   Transition<B, Stop, A>>;
+    int a_entries_{};
+    int b_exits_{};
+};
+
+struct Inner {
+    struct Idle {};
+    using transitions =
+      std::tuple<Transition<Deep, Up, Idle>, Transition<Idle, Down, Deep>>;
+};
+
+struct Outer {
+    struct Off {};
+    using transitions =
+      std::tuple<Transition<Inner, Stop, Off>, Transition<Off, Go, Inner>>;
+};
+
+struct Open {};
+struct Unlock {};
+
+// Refuses to open while locked and unlocks itself instead
+struct Door : InternalEventQueue<2, Unlock> {
+    struct Locked {
+        bool guard(Door& d, Open const&) {
+            d.post_internal(Unlock{});
+            return false;
+        }
+    };
+    struct Closed {};
+    struct Opened {};
+    using transitions = std::tuple<Transition<Locked, Open, Opened>,
+                                   Transition<Locked, Unlock, Closed>,
+                                   Transition<Closed, Open, Opened>>;
+};
+
+struct House {
+    struct Away {};
+    using transitions = std::tuple<Transition<Door, Stop, Away>>;
+};
+}
+
+TEST_CASE("FlatHsm matches the nested Hsm") {
+    using TreeHsm = make_hsm_t<Flat::Outer>;
+    using FlatOuter = make_flat_hsm_t<Flat::Outer>;
+    STATIC_REQUIRE(FlatOuter::leaf_count == 4);
+
+    TreeHsm tree;
+    FlatOuter flat;
+    REQUIRE(flat.leaf_index() == 0);
+
+    auto both = [&](auto e) {
+        bool handled = tree.handle(e);
+        REQUIRE(flat.handle(e) == handled);
+        REQUIRE(tree.snapshot().states == flat.snapshot().states);
+        return handled;
+    };
+    REQUIRE(both(Flat::Next{}));
+    REQUIRE(flat.leaf_index() == 1);
+    // Deep handles Stop itself while in B
+    REQUIRE(both(Flat::Stop{}));
+    REQUIRE(both(Flat::Up{}));
+    REQUIRE(flat.leaf_index() == 2);
+    REQUIRE_FALSE(both(Flat::Next{}));
+    REQUIRE(both(Flat::Down{}));
+    REQUIRE(both(Flat::Next{}));
+    // Now the parent's Stop applies
+    REQUIRE(both(Flat::Up{}));
+    REQUIRE(both(Flat::Stop{}));
+    REQUIRE(flat.leaf_index() == 3);
+    REQUIRE(both(Flat::Go{}));
+    // Deep kept its history
+    REQUIRE(flat.leaf_index() == 2);
+    REQUIRE(both(Flat::Down{}));
+    REQUIRE(flat.leaf_index() == 1);
+
+    using InnerHsm = make_hsm_t<Flat::Inner>;
+    using DeepHsm = make_hsm_t<Flat::Deep>;
+    auto& deep = std::get<DeepHsm>(std::get<InnerHsm>(flat.states_).states_);
+    auto& tree_deep =
+      std::get<DeepHsm>(std::get<InnerHsm>(tree.states_).states_);
+    REQUIRE(deep.a_entries_ == tree_deep.a_entries_);
+    REQUIRE(deep.b_exits_ == tree_deep.b_exits_);
+}
+
+TEST_CASE("FlatHsm drains nested internal events on a refusal") {
+    using TreeHsm = make_hsm_t<Flat::House>;
+    using FlatHouse = make_flat_hsm_t<Flat::House>;
+    TreeHsm tree;
+    FlatHouse flat;
+
+    auto both = [&](auto e) {
+        bool handled = tree.handle(e);
+        REQUIRE(flat.handle(e) == handled);
+        REQUIRE(tree.snapshot().states == flat.snapshot().states);
+        return handled;
+    };
+    // the guard refuses and posts Unlock, which the door handles right away.
+    // The refusal still consumes Open.
+    REQUIRE(tree.handle_result(Flat::Open{}) == TransitionResult::Refused);
+    REQUIRE(flat.handle_result(Flat::Open{}) == TransitionResult::Refused);
+    REQUIRE(tree.snapshot().states == flat.snapshot().states);
+    REQUIRE(std::holds_alternative<Flat::Door::Closed*>(
+      std::get<make_hsm_t<Flat::Door>>(flat.states_).current_state_));
+    REQUIRE(flat.leaf_index() == 2);
+    REQUIRE(both(Flat::Open{}));
+    REQUIRE(flat.leaf_index() == 1);
+    REQUIRE(both(Flat::Stop{}));
+    REQUIRE(flat.leaf_index() == 3);
+}
+
+TEST_CASE("FlatHsm with a clocked root") {
+    using LightHsm = make_hsm_t<TrafficLight::LightContext>;
+    using EmergencyOverrideHsm =
+      make_hsm_t<TrafficLight::EmergencyOverrideContext>;
+    using TrafficLightHsm =
+      FlatHsm<ClockedHsm<make_hsm_t<TrafficLight::TrafficLightHsmContext>>>;
+    TrafficLightHsm hsm;
+    for (int i = 0; i < 30; i++) {
+        hsm.tick();
+    }
+    auto& light = std::get<LightHsm>(hsm.states_);
+    REQUIRE(std::holds_alternative<TrafficLight::LightContext::Y1*>(
+      light.current_state_));
+    hsm.handle(TrafficLight::TrafficLightHsmContext::EmergencySwitchOn());
+    REQUIRE(std::holds_alternative<EmergencyOverrideHsm*>(hsm.current_state_));
+    for (int i = 0; i < 5; i++) {
+        hsm.tick();
+    }
+    auto& emergency = std::get<EmergencyOverrideHsm>(hsm.states_);
+    REQUIRE(std::holds_alternative<TrafficLight::EmergencyOverrideContext::Y1*>(
+      emergency.current_state_));
+    REQUIRE(hsm.leaf_index() == 5);
+}
+
+namespace Parallel {
+struct Heavy {
+    static constexpr bool parallel_region = true;
+
+    struct Toggle {};
+    struct Off {};
+    struct On {
+        void entry(Heavy& h) { h.thread_ = std::this_thread::get_id(); }
+    };
+
+    using transitions =
+      std::tuple<Transition<Off, Toggle, On>, Transition<On, Toggle, Off>>;
+
+    std::thread::id thread_;
+};
+
+struct Stamp {
+    int value;
+};
+
+// Overwrites the event in its action
+struct Writer {
+    struct Idle {
+        void action(Writer&, Stamp& e) { e.value = -1; }
+    };
+    struct Busy {
+        void action(Writer&, Stamp& e) { e.value = -1; }
+    };
+    using transitions =
+      std::tuple<Transition<Idle, Stamp, Busy>, Transition<Busy, Stamp, Idle>>;
+};
+
+// Notes the event it was handed, on a worker
+struct Reader {
+    static constexpr bool parallel_region = true;
+
+    struct Idle {
+        void entry(Reader& r, Stamp const& e) { r.seen_ = e.value; }
+    };
+    struct Busy {
+        void entry(Reader& r, Stamp const& e) { r.seen_ = e.value; }
+    };
+    using transitions =
+      std::tuple<Transition<Idle, Stamp, Busy>, Transition<Busy, Stamp, Idle>>;
+
+    int seen_{};
+};
+
+// A region without a transitions table
+struct Wrapper {
+    template<typename Event>
+    bool handle(Event&& e) {
+        ++offered_;
+        return hsm_.handle(std::forward<Event>(e));
+    }
+    SwitchHsm hsm_;
+    int offered_{};
+};
+}
+
+TEST_CASE("OrthogonalExecutionPolicy only dispatches to relevant regions") {
+    using CounterHsm = make_hsm_t<SnapshotTest::Counter>;
+    using Regions = OrthogonalExecutionPolicy<CounterHsm, SwitchHsm>;
+    Regions regions;
+    REQUIRE(Regions::relevant_regions<SwitchHsmContext::Toggle>() ==
+            Regions::RegionResults{ 0b10 });
+
+    SwitchHsmContext::Toggle toggle;
+    REQUIRE(regions.handle_regions(toggle) == Regions::RegionResults{ 0b10 });
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<1>(regions.hsms_).current_state_));
+    REQUIRE(std::holds_alternative<SnapshotTest::Counter::Off*>(
+      std::get<0>(regions.hsms_).current_state_));
+
+    // Handled because every region that takes the event handled it
+    REQUIRE(regions.handle(SnapshotTest::Counter::Toggle{}));
+    REQUIRE(std::get<0>(regions.hsms_).entries_ == 1);
+    // No region takes the event
+    REQUIRE_FALSE(regions.handle(Parallel::Heavy::Toggle{}));
+}
+
+TEST_CASE("OrthogonalExecutionPolicy offers events to nested regions") {
+    using CounterHsm = make_hsm_t<SnapshotTest::Counter>;
+    using Inner = OrthogonalExecutionPolicy<SwitchHsm>;
+    using Regions = OrthogonalExecutionPolicy<CounterHsm, Inner>;
+    // A nested orthogonal region reacts to what its own regions take
+    REQUIRE(Regions::relevant_regions<SwitchHsmContext::Toggle>() ==
+            Regions::RegionResults{ 0b10 });
+    REQUIRE(Regions::relevant_regions<SnapshotTest::Counter::Toggle>() ==
+            Regions::RegionResults{ 0b01 });
+
+    Regions regions;
+    REQUIRE(regions.handle(SwitchHsmContext::Toggle{}));
+    auto& inner = std::get<1>(regions.hsms_);
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<0>(inner.hsms_).current_state_));
+    REQUIRE(regions.handle(SnapshotTest::Counter::Toggle{}));
+    REQUIRE(std::get<0>(regions.hsms_).entries_ == 1);
+
+    // A region whose events are unknown is offered everything
+    using Wrapped = OrthogonalExecutionPolicy<CounterHsm, Parallel::Wrapper>;
+    REQUIRE(Wrapped::relevant_regions<SnapshotTest::Counter::Toggle>() ==
+            Wrapped::RegionResults{ 0b11 });
+    Wrapped wrapped;
+    SnapshotTest::Counter::Toggle toggle;
+    REQUIRE(wrapped.handle_regions(toggle) == Wrapped::RegionResults{ 0b01 });
+    // The wrapper turned the event down, so not every region handled it
+    REQUIRE_FALSE(wrapped.handle(SnapshotTest::Counter::Toggle{}));
+    REQUIRE(wrapped.handle(SwitchHsmContext::Toggle{}));
+    REQUIRE(std::get<1>(wrapped.hsms_).offered_ == 3);
+}
+
+TEST_CASE("ParallelOrthogonalExecutionPolicy runs heavy regions on a worker") {
+    using HeavyHsm = make_hsm_t<Parallel::Heavy>;
+    using Regions = ParallelOrthogonalExecutionPolicy<HeavyHsm, SwitchHsm>;
+    STATIC_REQUIRE(Regions::parallel_count == 1);
+    Regions regions;
+
+    REQUIRE(regions.handle(Parallel::Heavy::Toggle{}));
+    auto& heavy = std::get<0>(regions.hsms_);
+    REQUIRE(std::holds_alternative<Parallel::Heavy::On*>(heavy.current_state_));
+    REQUIRE(heavy.thread_ != std::thread::id{});
+    REQUIRE(heavy.thread_ != std::this_thread::get_id());
+
+    REQUIRE(regions.handle(SwitchHsmContext::Toggle{}));
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<1>(regions.hsms_).current_state_));
+    for (int i = 0; i < 1000; i++) {
+        REQUIRE(regions.handle(Parallel::Heavy::Toggle{}));
+    }
+    REQUIRE(std::holds_alternative<Parallel::Heavy::On*>(heavy.current_state_));
+}
+
+TEST_CASE("ParallelOrthogonalExecutionPolicy copies the event before inline "
+          "regions change it") {
+    using WriterHsm = make_hsm_t<Parallel::Writer>;
+    using ReaderHsm = make_hsm_t<Parallel::Reader>;
+    using Regions = ParallelOrthogonalExecutionPolicy<ReaderHsm, WriterHsm>;
+    Regions regions;
+    auto& reader = std::get<0>(regions.hsms_);
+    for (int i = 1; i <= 200; i++) {
+        Parallel::Stamp stamp{ i };
+        REQUIRE(regions.handle_regions(stamp) ==
+                Regions::RegionResults{ 0b11 });
+        // The inline writer changed the caller's event, the worker's copy
+        // was taken before that
+        REQUIRE(stamp.value == -1);
+        REQUIRE(reader.seen_ == i);
+    }
+}
+
+TEST_CASE("MulticastExecutionPolicy broadcasts without copies") {
+    using CounterHsm = make_hsm_t<SnapshotTest::Counter>;
+    // A small ring exercises the backpressure path
+    using Street =
+      MulticastExecutionPolicy<4, CounterHsm, SwitchHsm, CounterHsm>;
+    Street street;
+    street.start();
+    for (int i = 0; i < 1000; i++) {
+        REQUIRE(street.send_event(SnapshotTest::Counter::Toggle{}));
+    }
+    REQUIRE(street.send_event(SwitchHsmContext::Toggle{}));
+    while (street.lag() != 0) {
+        std::this_thread::yield();
+    }
+    REQUIRE(std::get<0>(street.hsms_).entries_ == 500);
+    REQUIRE(std::get<2>(street.hsms_).entries_ == 500);
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<1>(street.hsms_).current_state_));
+    street.stop();
+    REQUIRE_FALSE(street.send_event(SwitchHsmContext::Toggle{}));
+}
+
+TEST_CASE("MulticastHsm ticks clocked machines") {
+    using Lights = MulticastHsm<ClockedHsm,
+                                8,
+                                TrafficLight::LightContext,
+                                TrafficLight::LightContext>;
+    Lights lights;
+    lights.start();
+    for (int i = 0; i < 35; i++) {
+        lights.tick();
+    }
+    while (lights.lag() != 0) {
+        std::this_thread::yield();
+    }
+    REQUIRE(std::holds_alternative<TrafficLight::LightContext::G2*>(
+      std::get<0>(lights.hsms_).current_state_));
+    REQUIRE(std::holds_alternative<TrafficLight::LightContext::G2*>(
+      std::get<1>(lights.hsms_).current_state_));
+}
+
+TEST_CASE("ConcurrentHsm routes events to the machines that take them") {
+    using Machines =
+      ConcurrentHsm<ThreadedExecutionPolicy, SwitchHsmContext,
+                    SnapshotTest::Counter, SwitchHsmContext>;
+    STATIC_REQUIRE(Machines::receivers<SwitchHsmContext::Toggle> == 2);
+    STATIC_REQUIRE(Machines::receivers<SnapshotTest::Counter::Toggle> == 1);
+    STATIC_REQUIRE(Machines::receivers<Parallel::Heavy::Toggle> == 0);
+
+    Machines machines;
+    std::apply([](auto&... hsm) { (hsm.start(), ...); }, machines.hsms_);
+    machines.send_event(SnapshotTest::Counter::Toggle{});
+    machines.send_event(SwitchHsmContext::Toggle{});
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    auto& counter = std::get<1>(machines.hsms_);
+    REQUIRE(std::holds_alternative<SnapshotTest::Counter::On*>(
+      counter.current_state_));
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<0>(machines.hsms_).current_state_));
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(
+      std::get<2>(machines.hsms_).current_state_));
+    std::apply([](auto&... hsm) { (hsm.stop(), ...); }, machines.hsms_);
+}
+
+#ifdef __linux__
+namespace Placement {
+struct Pinned {
+    struct Run {};
+    struct Idle {};
+    struct Running {
+        void entry(Pinned& p) { p.cpu_ = sched_getcpu(); }
+    };
+
+    using transitions = std::tuple<Transition<Idle, Run, Running>>;
+
+    std::atomic<int> cpu_{ -1 };
+};
+}
+
+TEST_CASE("ThreadPlacement pins machines and places their memory") {
+    REQUIRE(ThreadPlacement::node_count() >= 1);
+    auto node = ThreadPlacement::on_node(0);
+    REQUIRE(node.pinned());
+    REQUIRE(node.memory_node() == 0);
+    REQUIRE(ThreadPlacement{ 0 }.memory_node() ==
+            ThreadPlacement::node_of_cpu(0));
+    REQUIRE(ThreadPlacement{}.memory_node() == -1);
+
+    using PinnedHsm = ThreadedExecutionPolicy<Placement::Pinned>;
+    auto hsm = place<PinnedHsm>(ThreadPlacement{ 0 });
+    REQUIRE(hsm != nullptr);
+    REQUIRE(std::holds_alternative<Placement::Pinned::Idle*>(
+      hsm->current_state_));
+    hsm->set_placement(ThreadPlacement{ 0 });
+    hsm->start();
+    REQUIRE_FALSE(hsm->placement_error());
+    hsm->send_event(Placement::Pinned::Run{});
+    while (hsm->cpu_ < 0) {
+        std::this_thread::yield();
+    }
+    REQUIRE(hsm->cpu_ == 0);
+    hsm->stop();
+}
+
+TEST_CASE("Placement failures are reported") {
+    // No machine has this CPU online
+    ThreadPlacement nowhere{ ThreadPlacement::MaxCpus - 1 };
+
+    ThreadedExecutionPolicy<SwitchHsmContext> threaded;
+    threaded.set_placement(nowhere);
+    threaded.start();
+    REQUIRE(threaded.placement_error() ==
+            std::error_code(EINVAL, std::system_category()));
+    threaded.stop();
+
+    ChannelExecutionPolicy<SwitchHsmContext> channel;
+    channel.set_placement(nowhere);
+    channel.start();
+    REQUIRE(channel.placement_error() ==
+            std::error_code(EINVAL, std::system_category()));
+    channel.stop();
+
+    MulticastExecutionPolicy<8, SwitchHsm, SwitchHsm> street;
+    street.set_placement<1>(nowhere);
+    street.start();
+    REQUIRE_FALSE(street.placement_error<0>());
+    REQUIRE(street.placement_error<1>() ==
+            std::error_code(EINVAL, std::system_category()));
+    street.stop();
+}
+#endif // __linux__
+
+TEST_CASE("Build a machine graph in an arena") {
+    ArenaResource arena(1 << 20, ArenaResource::Pages::Huge);
+    REQUIRE(arena.capacity() >= (1 << 20));
+    auto* previous = std::pmr::set_default_resource(&arena);
+
+    using ObservedHsm =
+      ThreadedExecWithObserver<CallbackObserver, SwitchHsmContext>;
+    auto hsm = make_in<ObservedHsm>(&arena);
+    REQUIRE(arena.used() >= sizeof(ObservedHsm));
+    REQUIRE(hsm->get_allocator().resource() == &arena);
+    std::atomic<int> notified{};
+    hsm->reserve(4);
+    hsm->add_callback([&notified] { notified++; });
+    std::pmr::set_default_resource(previous);
+
+    hsm->start();
+    hsm->send_event(SwitchHsmContext::Toggle{});
+    while (notified < 2) {
+        std::this_thread::yield();
+    }
+    REQUIRE(std::holds_alternative<SwitchHsmContext::On*>(hsm->current_state_));
+    hsm->stop();
+    hsm.reset();
+
+    auto used = arena.used();
+    REQUIRE_THROWS_AS(arena.allocate(arena.capacity()), std::bad_alloc);
+    REQUIRE(arena.used() == used);
+    arena.release();
+    REQUIRE(arena.used() == 0);
+}
+
+namespace Notify {
+struct Worker {
+    struct Start {};
+    struct Work {};
+    struct Idle {};
+    struct Busy {};
+
+    void on_work() { work_++; }
+
+    using transitions =
+      std::tuple<Transition<Idle, Start, Busy>,
+                 Transition<Busy, Work, Busy, &Worker::on_work>>;
+
+    std::atomic<int> work_{};
+};
+
+template<NotifyMode Mode>
+struct Observed : ThreadedExecWithObserver<InlineObserver<Mode>, Worker> {
+    // Queue everything before the thread starts so the batch is known
+    void run(int work) {
+        this->send_event(Worker::Start{});
+        for (int i = 0; i < work; i++) {
+            this->send_event(Worker::Work{});
+        }
+        this->start();
+        while (this->work_ < work) {
+            std::this_thread::yield();
+        }
+    }
+};
+}
+
+TEST_CASE("InlineFunction stores callables inline") {
+    auto counter = std::make_shared<int>(0);
+    InlineFunction<int(int)> add([counter](int i) { return *counter += i; });
+    REQUIRE(add(2) == 2);
+    InlineFunction<int(int)> moved(std::move(add));
+    REQUIRE_FALSE(add);
+    REQUIRE(moved(3) == 5);
+    REQUIRE(counter.use_count() == 2);
+    moved.reset();
+    REQUIRE(counter.use_count() == 1);
+}
+
+TEST_CASE("InlineObserver notification modes") {
+    std::atomic<int> notified{};
+    auto count = [&notified] { notified++; };
+
+    Notify::Observed<NotifyMode::PerBatch> batch;
+    REQUIRE(batch.subscribe(count));
+    batch.run(20);
+    while (notified < 1) {
+        std::this_thread::yield();
+    }
+    batch.stop();
+    // all 21 events were handled as one batch
+    REQUIRE(notified == 1);
+
+    notified = 0;
+    Notify::Observed<NotifyMode::PerEvent> each;
+    REQUIRE(each.subscribe(count));
+    REQUIRE(each.subscribe(count));
+    each.run(20);
+    while (notified < 2 * 21) {
+        std::this_thread::yield();
+    }
+    each.stop();
+    REQUIRE(notified == 2 * 21);
+
+    notified = 0;
+    Notify::Observed<NotifyMode::PerStateChange> changes;
+    REQUIRE(changes.subscribe(count));
+    changes.run(20);
+    changes.stop();
+    // only Idle -> Busy changed the state
+    REQUIRE(notified == 1);
+
+    InlineObserver<NotifyMode::PerBatch, 2> full;
+    REQUIRE(full.subscribe(count));
+    REQUIRE(full.subscribe(count));
+    REQUIRE_FALSE(full.subscribe(count));
+    REQUIRE(full.subscribers() == 2);
+}
+
+namespace Completion {
+struct Door {
+    struct Open {};
+    struct Close {};
+    struct Lock {};
+    struct Closed {};
+    struct Opened {};
+    struct Locked {};
+
+    bool can_lock() { return lockable_; }
+    void on_lock() { locks_++; }
+
+    void on_close() {
+        if (echo_ != nullptr) {
+            // runs on the machine's own thread
+            inner_ = echo_();
+        }
+    }
+
+    using transitions =
+      std::tuple<Transition<Closed, Open, Opened>,
+                 Transition<Opened, Close, Closed, &Door::on_close>,
+                 Transition<Closed,
+                            Lock,
+                            Locked,
+                            &Door::on_lock,
+                            &Door::can_lock>>;
+
+    std::atomic<bool> lockable_{};
+    int locks_{};
+    std::function<EventResult()> echo_;
+    EventResult inner_{ EventResult::Dropped };
+};
+}
+
+TEST_CASE("Completion tokens and send_and_wait") {
+    using DoorHsm = ThreadedExecutionPolicy<Completion::Door>;
+    DoorHsm door;
+    door.start();
+
+    auto open = door.send_event(Completion::Door::Open{});
+    REQUIRE(open);
+    REQUIRE(door.wait(open) == EventResult::Handled);
+    REQUIRE(door.done(open));
+    // No transition for Open while opened
+    REQUIRE(door.send_and_wait(Completion::Door::Open{}) ==
+            EventResult::Rejected);
+
+    // An action that waits on its own machine is refused instead of
+    // deadlocking, and its event is not sent
+    door.echo_ = [&door] {
+        return door.send_and_wait(Completion::Door::Lock{});
+    };
+    door.lockable_ = true;
+    REQUIRE(door.send_and_wait(Completion::Door::Close{}) ==
+            EventResult::Handled);
+    REQUIRE(door.inner_ == EventResult::WouldDeadlock);
+    REQUIRE(door.locks_ == 0);
+    door.echo_ = nullptr;
+    door.lockable_ = false;
+
+    // A refused guard consumes the event, but its token reports Rejected
+    REQUIRE(door.send_and_wait(Completion::Door::Lock{}) ==
+            EventResult::Rejected);
+    REQUIRE(door.send_and_wait(Completion::Door::Open{}) ==
+            EventResult::Handled);
+    REQUIRE(door.send_and_wait(Completion::Door::Close{}) ==
+            EventResult::Handled);
+
+    // Tokens identify their own event, not just the latest one
+    std::vector<CompletionToken> tokens;
+    for (int i = 0; i < 10; i++) {
+        tokens.push_back(door.send_event(Completion::Door::Open{}));
+        tokens.push_back(door.send_event(Completion::Door::Close{}));
+    }
+    for (std::size_t i = 0; i < tokens.size(); i++) {
+        REQUIRE(door.wait(tokens[i]) == EventResult::Handled);
+    }
+    // An old result is no longer kept
+    for (int i = 0; i < 70; i++) {
+        auto lock = door.send_event(Completion::Door::Lock{});
+        REQUIRE(door.wait(lock) == EventResult::Rejected);
+    }
+    door.lockable_ = true;
+    REQUIRE(door.send_and_wait(Completion::Door::Lock{}) ==
+            EventResult::Handled);
+    REQUIRE(door.wait(open) == EventResult::Expired);
+    REQUIRE(door.locks_ == 1);
+
+    door.stop();
+    REQUIRE(door.wait(door.send_event(Completion::Door::Open{})) ==
+            EventResult::Dropped);
+
+    // the real-time policy knows its machine thread as well
+    RealtimeExecutionPolicy<Completion::Door> realtime;
+    realtime.echo_ = [&realtime] {
+        return realtime.send_and_wait(Completion::Door::Lock{});
+    };
+    realtime.start();
+    REQUIRE(realtime.send_and_wait(Completion::Door::Open{}) ==
+            EventResult::Handled);
+    REQUIRE(realtime.send_and_wait(Completion::Door::Close{}) ==
+            EventResult::Handled);
+    REQUIRE(realtime.inner_ == EventResult::WouldDeadlock);
+    realtime.stop();
+}
+
+namespace Pipeline {
+struct Output {
+    struct Reply {
+        int n;
+    };
+    struct Writing {
+        bool handle(Output& out, Reply const& r) {
+            out.sum_ += r.n;
+            out.replies_++;
+            return true;
+        }
+    };
+
+    using transitions = std::tuple<Transition<Writing, Reply, Writing>>;
+
+    std::atomic<long> sum_{};
+    std::atomic<int> replies_{};
+};
+
+struct Session : Outlet<Output::Reply> {
+    struct Request {
+        int n;
+    };
+    struct Serving {
+        bool handle(Session& s, Request const& r) {
+            return s.publish(Output::Reply{ r.n + 1 });
+        }
+    };
+
+    using transitions = std::tuple<Transition<Serving, Request, Serving>>;
+};
+
+struct Parser : Outlet<Session::Request> {
+    struct Chunk {
+        int n;
+    };
+    struct Parsing {
+        bool handle(Parser& p, Chunk const& c) {
+            return p.publish(Session::Request{ 2 * c.n });
+        }
+    };
+
+    using transitions = std::tuple<Transition<Parsing, Chunk, Parsing>>;
+};
+
+// An output stage that holds the first reply until released
+struct HeldOutput {
+    struct Writing {
+        bool handle(HeldOutput& out, Output::Reply const&) {
+            while (out.held_) {
+                std::this_thread::yield();
+            }
+            out.replies_++;
+            return true;
+        }
+    };
+
+    using transitions =
+      std::tuple<Transition<Writing, Output::Reply, Writing>>;
+
+    std::atomic<bool> held_{ true };
+    std::atomic<int> replies_{};
+};
+}
+
+TEST_CASE("PipelineHsm hands events over SPSC channels") {
+    using Stages = PipelineHsm<Pipeline::Parser, Pipeline::Session,
+                               Pipeline::Output>;
+    Stages pipeline;
+    auto& parser = std::get<0>(pipeline.hsms_);
+    auto& session = std::get<1>(pipeline.hsms_);
+    auto& output = std::get<2>(pipeline.hsms_);
+    // stages wait for room as long as it takes, so nothing is dropped
+    parser.set_max_wait(std::chrono::hours(1));
+    session.set_max_wait(std::chrono::hours(1));
+    pipeline.start();
+    long expected = 0;
+    for (int i = 0; i < 10000; i++) {
+        // the first stage's channel is full: back off and retry
+        while (!pipeline.send_event(Pipeline::Parser::Chunk{ i })) {
+            std::this_thread::yield();
+        }
+        expected += 2 * i + 1;
+    }
+    while (output.replies_ < 10000) {
+        std::this_thread::yield();
+    }
+    pipeline.stop();
+    REQUIRE(parser.dropped() == 0);
+    REQUIRE(session.dropped() == 0);
+    REQUIRE(output.sum_ == expected);
+}
+
+TEST_CASE("PipelineHsm drops what a stalled stage has no room for") {
+    using Stages = PipelineHsm<Pipeline::Parser, Pipeline::Session,
+                               Pipeline::HeldOutput>;
+    Stages pipeline;
+    auto& parser = std::get<0>(pipeline.hsms_);
+    auto& session = std::get<1>(pipeline.hsms_);
+    auto& output = std::get<2>(pipeline.hsms_);
+    // every chunk reaches the session, which gives up on a full channel
+    parser.set_max_wait(std::chrono::hours(1));
+    session.set_max_wait(std::chrono::microseconds(0));
+    pipeline.start();
+    // more than the output's channel holds while its stage is stalled
+    constexpr int count = 3000;
+    for (int i = 0; i < count; i++) {
+        while (!pipeline.send_event(Pipeline::Parser::Chunk{ i })) {
+            std::this_thread::yield();
+        }
+    }
+    while (session.dropped() == 0) {
+        std::this_thread::yield();
+    }
+    output.held_ = false;
+    while (output.replies_ + session.dropped() < count) {
+        std::this_thread::yield();
+    }
+    pipeline.stop();
+    REQUIRE(parser.dropped() == 0);
+    REQUIRE(output.replies_ > 0);
+    REQUIRE(output.replies_ + session.dropped() == count);
+}
+
+namespace Wire {
+struct Feed {
+    struct Connect {
+        static constexpr std::uint32_t id = 7;
+    };
+    // Trivially copyable payload
+    struct Price {
+        static constexpr std::uint32_t id = 9;
+        std::int64_t ticks;
+        std::uint32_t size;
+    };
+    // Refers to the frame instead of copying it
+    struct Text {
+        Text() = default;
+        explicit Text(std::span<std::byte const> payload)
+          : bytes(payload) {}
+        std::span<std::byte const> bytes;
+    };
+    struct Disconnect {};
+
+    struct Idle {};
+    struct Live {
+        bool handle(Feed& f, Price const& p) {
+            f.last_ = p.ticks;
+            return p.size > 0;
+        }
+        bool handle(Feed& f, Text const& t) {
+            f.text_ = t.bytes.data();
+            return true;
+        }
+    };
+
+    using transitions = std::tuple<Transition<Idle, Connect, Live>,
+                                   Transition<Live, Price, Live>,
+                                   Transition<Live, Text, Live>,
+                                   Transition<Live, Disconnect, Idle>>;
+
+    std::int64_t last_{};
+    std::byte const* text_{};
+};
+}
+
+TEST_CASE("handle_by_id decodes frames without a variant") {
+    using FeedHsm = make_hsm_t<Wire::Feed>;
+    using Registry = EventRegistry<FeedHsm>;
+    // declared ids are kept, the others are numbered by position
+    STATIC_REQUIRE(Registry::id<Wire::Feed::Connect> == 7);
+    STATIC_REQUIRE(Registry::id<Wire::Feed::Price> == 9);
+    STATIC_REQUIRE(Registry::id<Wire::Feed::Text> == 2);
+    STATIC_REQUIRE(Registry::id<Wire::Feed::Disconnect> == 3);
+
+    FeedHsm feed;
+    REQUIRE(handle_by_id(feed, 7, {}) == DispatchResult::Handled);
+    REQUIRE(std::holds_alternative<Wire::Feed::Live*>(feed.current_state_));
+
+    Wire::Feed::Price price{ 12345, 10 };
+    std::array<std::byte, sizeof(price)> frame;
+    std::memcpy(frame.data(), &price, sizeof(price));
+    REQUIRE(handle_by_id(feed, 9, frame) == DispatchResult::Handled);
+    REQUIRE(feed.last_ == 12345);
+    REQUIRE(handle_by_id(feed, 9, std::span(frame).first(4)) ==
+            DispatchResult::BadPayload);
+    price.size = 0;
+    std::memcpy(frame.data(), &price, sizeof(price));
+    REQUIRE(handle_by_id(feed, 9, frame) == DispatchResult::Rejected);
+
+    // the view event points into the frame
+    REQUIRE(handle_by_id(feed, 2, frame) == DispatchResult::Handled);
+    REQUIRE(feed.text_ == frame.data());
+
+    REQUIRE(handle_by_id(feed, 8, {}) == DispatchResult::UnknownId);
+    REQUIRE(handle_by_id(feed, 100000, {}) == DispatchResult::UnknownId);
+    REQUIRE(handle_by_id(feed, 3, {}) == DispatchResult::Handled);
+    REQUIRE(std::holds_alternative<Wire::Feed::Idle*>(feed.current_state_));
+}
+
+namespace Wire {
+struct Sparse {
+    struct Ping {
+        static constexpr std::uint32_t id = 0x10000;
+    };
+    struct Pong {
+        static constexpr std::uint32_t id = 0x20000;
+    };
+    // has an id, but cannot be decoded from a frame
+    struct Note {
+        static constexpr std::uint32_t id = 0x30000;
+        std::string text;
+    };
+    struct A {};
+    struct B {};
+
+    using transitions = std::tuple<Transition<A, Ping, B>,
+                                   Transition<B, Pong, A>,
+                                   Transition<B, Note, B>>;
+};
+}
+
+TEST_CASE("handle_by_id with sparse ids") {
+    using SparseHsm = make_hsm_t<Wire::Sparse>;
+    STATIC_REQUIRE_FALSE(EventRegistry<SparseHsm>::dense);
+    SparseHsm hsm;
+    REQUIRE(handle_by_id(hsm, 0x20000, {}) == DispatchResult::Rejected);
+    REQUIRE(handle_by_id(hsm, 0x10000, {}) == DispatchResult::Handled);
+    REQUIRE(handle_by_id(hsm, 0x20000, {}) == DispatchResult::Handled);
+    REQUIRE(handle_by_id(hsm, 0x15000, {}) == DispatchResult::UnknownId);
+    STATIC_REQUIRE_FALSE(is_wire_event_v<Wire::Sparse::Note>);
+    REQUIRE(handle_by_id(hsm, 0x30000, {}) == DispatchResult::UnknownId);
+}
+
+namespace Batch {
+struct Counter {
+    struct Add {
+        int amount;
+    };
+    struct Reset {};
+
+    struct Counting {
+        bool handle(Counter& c, Add const& add) {
+            c.total_ += add.amount;
+            return true;
+        }
+    };
+    struct Idle {};
+
+    using transitions = std::tuple<Transition<Counting, Add, Counting>,
+                                   Transition<Counting, Reset, Idle>>;
+
+    int total_{};
+};
+} // namespace Batch
+
+TEST_CASE("handle_batch dispatches spans of events in order") {
+    using CounterHsm = make_hsm_t<Batch::Counter>;
+    using Event = std::variant<Batch::Counter::Add, Batch::Counter::Reset>;
+
+    SECTION("Variant events set one bit per handled event") {
+        CounterHsm hsm;
+        std::vector<Event> events{ Batch::Counter::Add{ 1 },
+                                   Batch::Counter::Add{ 2 },
+                                   Batch::Counter::Reset{},
+                                   Batch::Counter::Add{ 4 },
+                                   Batch::Counter::Reset{} };
+        auto result = handle_batch(hsm, std::span(events));
+        REQUIRE(result.size == 5);
+        REQUIRE(result.handled.to_ulong() == 0b00111);
+        REQUIRE_FALSE(result.all());
+        REQUIRE(hsm.total_ == 3);
+        REQUIRE(std::holds_alternative<Batch::Counter::Idle*>(
+          hsm.current_state_));
+    }
+
+    SECTION("Longer batches are handled in chunks") {
+        CounterHsm hsm;
+        std::vector<Batch::Counter::Add> adds(100, Batch::Counter::Add{ 1 });
+        std::span<Batch::Counter::Add> rest(adds);
+        std::size_t chunks = 0;
+        while (!rest.empty()) {
+            auto result = handle_batch<32>(hsm, rest);
+            REQUIRE(result.all());
+            rest = rest.subspan(result.size);
+            ++chunks;
+        }
+        REQUIRE(chunks == 4);
+        REQUIRE(hsm.total_ == 100);
+    }
+
+    SECTION("SingleThreadedHsm handles a batch without its queue") {
+        SingleThreadedHsm<Batch::Counter> hsm;
+        std::array<Event, 3> events{ Batch::Counter::Add{ 5 },
+                                     Batch::Counter::Add{ 6 },
+                                     Batch::Counter::Reset{} };
+        auto result = hsm.handle_batch(events);
+        REQUIRE(result.all());
+        REQUIRE(hsm.total_ == 11);
+    }
+}
+
+namespace Lazy {
+struct Link {
+    static constexpr bool lazy_states = true;
+
+    struct Start {};
+    struct Chunk {
+        int bytes;
+    };
+    struct Done {};
+    struct Verify {};
+
+    struct Idle {};
+
+    struct Transfer {
+        Transfer() { ++constructed; }
+        ~Transfer() { ++destroyed; }
+        bool handle(Link&, Chunk const& c) {
+            received_ += c.bytes;
+            return true;
+        }
+        // hand what has to outlive the visit over to the context
+        void exit(Link& l) { l.received_ = received_; }
+
+        static inline int constructed = 0;
+        static inline int destroyed = 0;
+        std::array<std::byte, 4096> buffer_{};
+        int received_{};
+    };
+
+    struct Checking {
+        std::array<std::byte, 4096> digest_{};
+    };
+
+    using transitions = std::tuple<Transition<Idle, Start, Transfer>,
+                                   Transition<Transfer, Chunk, Transfer>,
+                                   Transition<Transfer, Done, Checking>,
+                                   Transition<Checking, Verify, Idle>>;
+
+    int received_{};
+};
+
+struct EagerLink : Link {
+    static constexpr bool lazy_states = false;
+};
+} // namespace Lazy
+
+TEST_CASE("lazy_states constructs states on entry") {
+    using LinkHsm = make_hsm_t<Lazy::Link>;
+    using Transfer = Lazy::Link::Transfer;
+    STATIC_REQUIRE(LinkHsm::lazy_states);
+    STATIC_REQUIRE(sizeof(LinkHsm) < 2 * 4096);
+    STATIC_REQUIRE(sizeof(Hsm<Lazy::EagerLink, Lazy::Link::transitions>) >=
+                   2 * 4096);
+
+    Transfer::constructed = 0;
+    Transfer::destroyed = 0;
+    LinkHsm hsm;
+    REQUIRE(Transfer::constructed == 0);
+    REQUIRE(std::holds_alternative<Lazy::Link::Idle>(hsm.states_));
+
+    hsm.handle(Lazy::Link::Start{});
+    REQUIRE(Transfer::constructed == 1);
+    hsm.handle(Lazy::Link::Chunk{ 100 });
+    hsm.handle(Lazy::Link::Chunk{ 20 });
+    // a self-transition keeps the object
+    REQUIRE(Transfer::constructed == 1);
+    REQUIRE(hsm.state<Transfer>().received_ == 120);
+
+    hsm.handle(Lazy::Link::Done{});
+    REQUIRE(Transfer::destroyed == 1);
+    REQUIRE(hsm.received_ == 120);
+    REQUIRE(std::holds_alternative<Lazy::Link::Checking*>(hsm.current_state_));
+
+    SECTION("Restoring a snapshot constructs the saved state") {
+        hsm.handle(Lazy::Link::Verify{});
+        hsm.handle(Lazy::Link::Start{});
+        auto in_transfer = hsm.snapshot();
+        hsm.handle(Lazy::Link::Done{});
+        REQUIRE(Transfer::destroyed == 2);
+        REQUIRE(hsm.restore(in_transfer));
+        REQUIRE(Transfer::constructed == 3);
+        REQUIRE(std::holds_alternative<Transfer*>(hsm.current_state_));
+        REQUIRE(hsm.state<Transfer>().received_ == 0);
+    }
+}
+
+namespace Constinit {
+struct Valve {
+    struct Open {};
+    struct Close {};
+
+    struct Shut {};
+    struct Flowing {
+        constexpr void entry(Valve& v) { ++v.opened_; }
+        constexpr bool handle(Valve&, ClockTickEvent& t) {
+            return t.ticks_ >= 2;
+        }
+    };
+    struct Timeout {};
+
+    using transitions = std::tuple<Transition<Shut, Open, Flowing>,
+                                   Transition<Flowing, Close, Shut>,
+                                   ClockedTransition<Flowing, Timeout>,
+                                   Transition<Timeout, Close, Shut>>;
+
+    int opened_{};
+};
+
+// Evaluated entirely by the compiler
+constexpr int
+opened_at_compile_time() {
+    make_hsm_t<Valve> valve;
+    valve.handle(Valve::Open{});
+    valve.handle(Valve::Close{});
+    valve.handle(Valve::Open{});
+    return valve.opened_;
+}
+
+constinit make_hsm_t<Valve> valve;
+constinit ClockedHsm<Valve> clocked_valve;
+constinit SingleThreadedHsm<Valve> queued_valve;
+} // namespace Constinit
+
+TEST_CASE("Machines can be constant-initialized") {
+    STATIC_REQUIRE(Constinit::opened_at_compile_time() == 2);
+    // a machine in static storage can be constexpr and live in .rodata
+    static constexpr make_hsm_t<Constinit::Valve> fresh;
+    STATIC_REQUIRE(
+      std::holds_alternative<Constinit::Valve::Shut*>(fresh.current_state_));
+
+    REQUIRE(Constinit::valve.handle(Constinit::Valve::Open{}));
+    REQUIRE(Constinit::valve.opened_ == 1);
+
+    Constinit::clocked_valve.handle(Constinit::Valve::Open{});
+    REQUIRE(Constinit::clocked_valve.tick());
+    REQUIRE(std::holds_alternative<Constinit::Valve::Flowing*>(
+      Constinit::clocked_valve.current_state_));
+    REQUIRE(Constinit::clocked_valve.tick());
+    REQUIRE(std::holds_alternative<Constinit::Valve::Timeout*>(
+      Constinit::clocked_valve.current_state_));
+
+    Constinit::queued_valve.send_event(Constinit::Valve::Open{});
+    REQUIRE(Constinit::queued_valve.step());
+    REQUIRE(Constinit::queued_valve.opened_ == 1);
+}
+
+namespace QueueMetrics {
+struct Pump {
+    static constexpr bool queue_stats = true;
+
+    struct Prime {};
+    struct Stroke {};
+
+    struct Dry {};
+    struct Primed {};
+
+    using transitions = std::tuple<Transition<Dry, Prime, Primed>,
+                                   Transition<Primed, Stroke, Primed>>;
+};
+} // namespace QueueMetrics
+
+TEST_CASE("Event queues report depth and wakeups") {
+    using QueueMetrics::Pump;
+    using Event = std::variant<Pump::Prime, Pump::Stroke>;
+    STATIC_REQUIRE(sizeof(EventQueue<Event>) <
+                   sizeof(EventQueue<Event, QueueStats>));
+
+    SECTION("Depth and high-water mark") {
+        SingleThreadedHsm<Pump> pump;
+        pump.send_event(Pump::Prime{});
+        pump.send_event(Pump::Stroke{});
+        pump.send_event(Pump::Stroke{});
+        REQUIRE(pump.step());
+        REQUIRE(pump.step());
+        auto stats = pump.queue_stats();
+        REQUIRE(stats.enqueued == 3);
+        REQUIRE(stats.dequeued == 2);
+        REQUIRE(stats.depth == 1);
+        REQUIRE(stats.high_water == 3);
+        REQUIRE(stats.dropped == 0);
+    }
+
+    SECTION("A running machine counts consumer wakeups") {
+        ThreadedHsm<Pump> pump;
+        pump.start();
+        REQUIRE(pump.send_and_wait(Pump::Prime{}) == EventResult::Handled);
+        // let the machine go back to sleep on an empty queue
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        REQUIRE(pump.send_and_wait(Pump::Stroke{}) == EventResult::Handled);
+        auto stats = pump.queue_stats();
+        pump.stop();
+        REQUIRE(stats.enqueued == 2);
+        REQUIRE(stats.dequeued == 2);
+        REQUIRE(stats.depth == 0);
+        REQUIRE(stats.wakeups >= 1);
+        REQUIRE(pump.send_event(Pump::Stroke{}).sequence == 0);
+        REQUIRE(pump.queue_stats().dropped == 1);
+    }
+}
+
+namespace Budget {
+using namespace std::chrono_literals;
+
+inline void
+busy_for(std::chrono::microseconds duration) {
+    auto until = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < until) {
+    }
+}
+
+struct Loop {
+    using budget_clock = std::chrono::steady_clock;
+
+    struct Tick {};
+    struct Slow {};
+
+    struct Idle {};
+    struct Control {
+        static constexpr auto entry_budget = 200us;
+        void entry(Loop& l) { busy_for(l.entry_work_); }
+    };
+
+    void integrate() { busy_for(action_work_); }
+    void on_overrun(BudgetOverrun const& o) { overruns_.push_back(o); }
+
+    using transitions = std::tuple<
+      Transition<Idle, Tick, Control>,
+      Budgeted<Transition<Control, Tick, Idle, &Loop::integrate>, 300'000>,
+      Transition<Control, Slow, Idle, &Loop::integrate>>;
+
+    std::chrono::microseconds entry_work_{ 0 };
+    std::chrono::microseconds action_work_{ 0 };
+    std::vector<BudgetOverrun> overruns_;
+};
+} // namespace Budget
+
+TEST_CASE("Handlers that overrun their budget are reported") {
+    using namespace std::chrono_literals;
+    using LoopHsm = make_hsm_t<Budget::Loop>;
+    using Control = Budget::Loop::Control;
+    STATIC_REQUIRE(LoopHsm::timed_handlers);
+    STATIC_REQUIRE_FALSE(make_hsm_t<Constinit::Valve>::timed_handlers);
+
+    LoopHsm loop;
+    loop.handle(Budget::Loop::Tick{});
+    loop.handle(Budget::Loop::Tick{});
+    REQUIRE(loop.overruns() == 0);
+
+    loop.entry_work_ = 2ms;
+    loop.handle(Budget::Loop::Tick{});
+    REQUIRE(loop.overruns() == 1);
+    REQUIRE(loop.overruns_.back().handler == Handler::Entry);
+    REQUIRE(loop.overruns_.back().budget == 200us);
+    REQUIRE(loop.overruns_.back().elapsed >= 2ms);
+    REQUIRE(loop.worst_case<Control>(Handler::Entry) >= 2ms);
+
+    // the transition's own budget covers its action
+    loop.action_work_ = 1ms;
+    loop.handle(Budget::Loop::Tick{});
+    REQUIRE(loop.overruns() == 2);
+    REQUIRE(loop.overruns_.back().handler == Handler::Action);
+    REQUIRE(loop.overruns_.back().state ==
+            tuple_index_v<Control, LoopHsm::States>);
+
+    // no budget, not timed
+    loop.entry_work_ = 0ms;
+    loop.handle(Budget::Loop::Tick{});
+    loop.handle(Budget::Loop::Slow{});
+    REQUIRE(loop.overruns() == 2);
+}
+
+namespace Profiling {
+// A nested machine that profiles its own transitions
+struct Cylinder {
+    static constexpr bool transition_profile = true;
+
+    struct Stroke {};
+
+    struct Down {};
+    struct Up {};
+
+    using transitions = std::tuple<Transition<Down, Stroke, Up>,
+                                   Transition<Up, Stroke, Down>>;
+};
+
+struct Pump {
+    static constexpr bool transition_profile = true;
+
+    struct Prime {};
+    struct Stop {};
+
+    struct Dry {};
+
+    // the first Prime is refused
+    bool primed() { return ++primes_ > 1; }
+
+    using transitions = std::tuple<
+      Transition<Dry, Prime, Cylinder, NoAction{}, &Pump::primed>,
+      Transition<Cylinder, Stop, Dry>>;
+
+    int primes_{};
+};
+} // namespace Profiling
+
+TEST_CASE("Transitions are charged where they are resolved") {
+    using Profiling::Cylinder;
+    using Profiling::Pump;
+    using PumpHsm = make_hsm_t<Pump>;
+    using CylinderHsm = make_hsm_t<Cylinder>;
+    STATIC_REQUIRE(PumpHsm::profiled_transitions);
+    STATIC_REQUIRE_FALSE(make_hsm_t<Constinit::Valve>::profiled_transitions);
+
+    PumpHsm pump;
+    // no transition, nothing to charge
+    REQUIRE_FALSE(pump.handle(Cylinder::Stroke{}));
+    REQUIRE(pump.handle(Pump::Prime{}));
+    REQUIRE(pump.handle(Pump::Prime{}));
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(pump.handle(Cylinder::Stroke{}));
+    }
+    REQUIRE(pump.handle(Pump::Stop{}));
+
+    auto const& prime = pump.profile<Pump::Dry, Pump::Prime>();
+    REQUIRE(prime.events == 2);
+    REQUIRE(prime.handled == 1);
+    REQUIRE(pump.profile<CylinderHsm, Pump::Stop>().events == 1);
+    std::size_t tried = 0;
+    pump.for_each_profile([&](std::size_t, auto const&) { ++tried; });
+    REQUIRE(tried == 2);
+
+    // strokes are charged to the cylinder's transitions, not to the pump
+    auto const& cylinder = pump.state<CylinderHsm>();
+    auto const& up = cylinder.profile<Cylinder::Down, Cylinder::Stroke>();
+    REQUIRE(up.events == 5);
+    REQUIRE(up.handled == 5);
+    REQUIRE(cylinder.profile<Cylinder::Up, Cylinder::Stroke>().events == 5);
+
+    // counters are optional: without them the profile only counts events
+    auto const& counters = thread_perf_counters();
+    if (counters.available()) {
+        REQUIRE(up.measured > 0);
+        REQUIRE(up.total(PerfEvent::Instructions) > 0);
+        REQUIRE(up.ipc() > 0.0);
+    } else {
+        REQUIRE(counters.error() != 0);
+        REQUIRE(up.measured == 0);
+        REQUIRE(up.ipc() == 0.0);
+    }
+
+    // a threaded machine charges its transitions on its own thread
+    ThreadedExecutionPolicy<Cylinder> threaded;
+    threaded.start();
+    CompletionToken last;
+    for (int i = 0; i < 9; ++i) {
+        last = threaded.send_event(Cylinder::Stroke{});
+    }
+    REQUIRE(threaded.wait(last) == EventResult::Handled);
+    threaded.stop();
+    REQUIRE(threaded.profile<Cylinder::Down, Cylinder::Stroke>().events == 5);
+    REQUIRE(threaded.profile<Cylinder::Up, Cylinder::Stroke>().events == 4);
+}
+
+namespace Latency {
+struct Press {
+    static constexpr bool event_latency = true;
+
+    struct Load {};
+    struct Stamp {};
+
+    struct Empty {};
+    struct Loaded {
+        bool handle(Press&, Stamp const&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            return true;
+        }
+    };
+
+    using transitions = std::tuple<Transition<Empty, Load, Loaded>,
+                                   Transition<Loaded, Stamp, Empty>>;
+};
+} // namespace Latency
+
+TEST_CASE("Threaded machines record queueing and handling latency") {
+    using namespace std::chrono_literals;
+    using Latency::Press;
+
+    LatencyHistogram histogram;
+    histogram.record(3ns);
+    histogram.record(100ns);
+    histogram.record(5us);
+    REQUIRE(histogram.count() == 3);
+    REQUIRE(histogram.bucket(2) == 1);
+    REQUIRE(histogram.percentile(0.5) == 127ns);
+    REQUIRE(histogram.percentile(1.0) == 5us);
+    LatencyHistogram merged;
+    merged.merge(histogram);
+    merged.merge(histogram);
+    REQUIRE(merged.count() == 6);
+    REQUIRE(merged.bucket(2) == 2);
+    REQUIRE(merged.max() == 5us);
+
+    ThreadedHsm<Press> press;
+    press.start();
+    for (int i = 0; i < 4; ++i) {
+        press.send_event(Press::Load{});
+        // queued behind the Stamp before it, which takes 2 ms
+        press.send_event(Press::Stamp{});
+    }
+    REQUIRE(press.wait(press.send_event(Press::Load{})) ==
+            EventResult::Handled);
+    press.stop();
+
+    auto const& stamp = press.handling_latency<Press::Stamp>();
+    REQUIRE(stamp.count() == 4);
+    REQUIRE(stamp.max() >= 2ms);
+    REQUIRE(press.handling_latency<Press::Load>().count() == 5);
+    REQUIRE(press.queued_latency<Press::Load>().count() == 5);
+    REQUIRE(press.queued_latency<Press::Load>().max() >= 2ms);
+}
+
+namespace Instantiated {
+struct Latch {
+    struct Set {};
+    struct Reset {};
+
+    struct Open {};
+    struct Closed {};
+
+    using transitions = std::tuple<Transition<Open, Set, Closed>,
+                                   Transition<Closed, Reset, Open>>;
+};
+} // namespace Instantiated
+
+TSM_EXTERN_MACHINE(tsm::detail::ThreadedExecutionPolicy, Instantiated::Latch);
+TSM_EXTERN_POLICY(tsm::detail::SingleThreadedExecutionPolicy,
+                  Instantiated::Latch);
+TSM_INSTANTIATE_MACHINE(tsm::detail::ThreadedExecutionPolicy,
+                        Instantiated::Latch);
+TSM_INSTANTIATE_POLICY(tsm::detail::SingleThreadedExecutionPolicy,
+                       Instantiated::Latch);
+
+TEST_CASE("Machines can be explicitly instantiated") {
+    using Instantiated::Latch;
+
+    // default actions and guards name the same type in every TU
+    using Defaulted = Transition<Latch::Open, Latch::Set, Latch::Closed>;
+    using Spelled = Transition<Latch::Open,
+                               Latch::Set,
+                               Latch::Closed,
+                               NoAction{},
+                               NoGuard{}>;
+    STATIC_REQUIRE(std::is_same_v<Defaulted, Spelled>);
+
+    SingleThreadedHsm<Latch> latch;
+    latch.send_event(Latch::Set{});
+    latch.step();
+    REQUIRE(std::holds_alternative<Latch::Closed*>(latch.current_state_));
+
+    ThreadedHsm<Latch> threaded;
+    threaded.start();
+    REQUIRE(threaded.wait(threaded.send_event(Latch::Set{})) ==
+            EventResult::Handled);
+    threaded.stop();
+    REQUIRE(std::holds_alternative<Latch::Closed*>(threaded.current_state_));
+}
+
+namespace Virtual {
+// each machine gets its own time line
+struct SyncTag {};
+struct ThreadedTag {};
+
+template<typename Context>
+using SyncPolicy = VirtualPeriodicExecutionPolicy<
+  Context,
+  make_hsm_t,
+  VirtualPeriodicTimer<VirtualClock<SyncTag>, std::chrono::milliseconds>>;
+
+#ifdef __linux__
+template<typename Context>
+using ThreadedPolicy = PeriodicExecutionPolicy<
+  Context,
+  ThreadedExecutionPolicy,
+  VirtualPeriodicTimer<VirtualClock<ThreadedTag>, std::chrono::milliseconds>>;
+#endif // __linux__
+
+// Toggles every half second of 1ms ticks
+struct Blinker {
+    struct Toggle {
+        bool handle(Blinker& b, ClockTickEvent const& t) {
+            b.last_tick = t.ticks_;
+            return t.ticks_ % 500 == 0;
+        }
+    };
+    struct Off : Toggle {};
+    struct On : Toggle {};
+
+    std::atomic<int> last_tick{};
+
+    using transitions =
+      std::tuple<ClockedTransition<Off, On>, ClockedTransition<On, Off>>;
+};
+} // namespace Virtual
+
+TEST_CASE("Periodic machines run in virtual time") {
+    using namespace std::chrono_literals;
+    using Virtual::Blinker;
+
+    VirtualPeriodicHsm<Blinker, Virtual::SyncPolicy> blinker;
+    blinker.start();
+    REQUIRE(blinker.advance(499ms) == 499);
+    REQUIRE(std::holds_alternative<Blinker::Off*>(blinker.current_state_));
+    // partial periods carry over
+    REQUIRE(blinker.advance(500us) == 0);
+    REQUIRE(blinker.advance(500us) == 1);
+    REQUIRE(std::holds_alternative<Blinker::On*>(blinker.current_state_));
+
+    // an hour of 1ms ticks, delivered without sleeping
+    REQUIRE(blinker.advance(1h) == 3'600'000);
+    REQUIRE(blinker.get_ticks() == 3'600'500);
+    REQUIRE(blinker.last_tick == 3'600'500);
+    REQUIRE(std::holds_alternative<Blinker::On*>(blinker.current_state_));
+    blinker.stop();
+    REQUIRE(blinker.advance(1s) == 0);
+
+#ifdef __linux__
+    // far more periods at once than the event queue holds: the tick thread
+    // waits for the machine instead of dropping ticks
+    PeriodicHsm<Blinker, Virtual::ThreadedPolicy> threaded;
+    threaded.start();
+    VirtualClock<Virtual::ThreadedTag>::advance(1000ms);
+    while (threaded.last_tick != 1000) {
+        std::this_thread::yield();
+    }
+    VirtualClock<Virtual::ThreadedTag>::advance(500ms);
+    while (threaded.last_tick != 1500) {
+        std::this_thread::yield();
+    }
+    // stop() releases the tick thread blocked on the clock
+    threaded.stop();
+    REQUIRE(threaded.get_ticks() == 1500);
+    REQUIRE(std::holds_alternative<Blinker::On*>(threaded.current_state_));
+#endif // __linux__
+}